@@ -1,12 +1,31 @@
 #ifndef CHUNK_H
 #define CHUNK_H
 
+#include <stddef.h>
+
 /** 
  * @file chunk.h
  *
  * @brief Chunk structure.
  *
- * Describes the structure of the chunk.
+ * Describes the structure of the chunk, and the functions managing the
+ * chunk payload.
+ *
+ * By default, the payload and the attributes of a chunk are allocated
+ * with malloc() and released with free(): this is what the chunkisers
+ * and decodeChunk() return, and what a chunk buffer expects.
+ * Payloads can also be reference counted, so that the same bytes can be
+ * shared by the chunk buffer, the trading functions and the output
+ * module without being copied. Such a payload is allocated with
+ * chunk_data_alloc(), every component keeping it takes a reference with
+ * chunk_data_ref(), and releases it with chunk_data_unref(); the memory
+ * is freed when the last reference is dropped. Reference counted chunks
+ * (payload and attributes) can only be passed to the components which
+ * have been configured to use them (for example, a chunk buffer created
+ * with "refcount=1"), and are released with chunk_release().
+ * Payloads are allocated from a per-thread pool of size classes, so that
+ * blocks released by the chunk buffer are recycled for new chunks without
+ * going through the system allocator.
  *
  */
 
@@ -46,4 +65,157 @@ typedef struct chunk {
     */
    int attributes_size;
 } Chunk;
+
+/**
+ * @brief Allocate a chunk payload.
+ *
+ * @param size the size of the payload, in bytes
+ * @return a pointer to the payload (with a reference count of 1), or NULL
+ *         on error
+ */
+uint8_t *chunk_data_alloc(int size);
+
+/**
+ * @brief Resize a chunk payload.
+ *
+ * Only a payload that is not shared (single reference, not a slice) can
+ * be resized.
+ *
+ * @param data the payload to be resized (if NULL, a new one is allocated)
+ * @param size the new size of the payload, in bytes
+ * @return a pointer to the resized payload, or NULL on error (in this case
+ *         data is left untouched)
+ */
+uint8_t *chunk_data_realloc(uint8_t *data, int size);
+
+/**
+ * @brief Take a reference to a chunk payload.
+ *
+ * @param data the payload
+ * @return data
+ */
+uint8_t *chunk_data_ref(uint8_t *data);
+
+/**
+ * @brief Release a reference to a chunk payload.
+ *
+ * The payload is freed when its last reference is released.
+ *
+ * @param data the payload (can be NULL)
+ */
+void chunk_data_unref(uint8_t *data);
+
+/**
+ * @brief Take a reference to a part of a chunk payload.
+ *
+ * Return a pointer to the bytes starting at data + offset, which can be
+ * used as a payload on its own and shares the reference count of data.
+ * The sizeof(void *) bytes preceding the slice are overwritten, so they
+ * must not contain anything useful (for example, they can contain an
+ * already decoded message header).
+ *
+ * @param data the payload
+ * @param offset the offset of the slice (at least sizeof(void *))
+ * @return a pointer to the slice, or NULL on error
+ */
+uint8_t *chunk_data_slice(uint8_t *data, int offset);
+
+/**
+ * @brief Use a memory area as a chunk payload.
+ *
+ * Make a memory area which has not been allocated by chunk_data_alloc()
+ * (for example, a memory mapped file) usable as a payload: slices of it
+ * can be taken with chunk_data_slice(), and when the last reference is
+ * released the release() function is invoked. The first sizeof(void *)
+ * bytes of the area are used for bookkeeping.
+ *
+ * @param mem the memory area
+ * @param size the size of the memory area
+ * @param release the function releasing the memory area
+ * @param opaque the argument passed to release()
+ * @return a payload of size - sizeof(void *) bytes, or NULL on error
+ */
+uint8_t *chunk_data_wrap(uint8_t *mem, int size, void (*release)(void *opaque), void *opaque);
+
+/**
+ * @brief Get the size of the memory block holding a chunk payload.
+ *
+ * @param data the payload
+ * @return the size of the block allocated by chunk_data_alloc()
+ */
+int chunk_data_size(const uint8_t *data);
+
+/**
+ * @brief Get the number of references to a chunk payload.
+ *
+ * @param data the payload
+ * @return the reference count (1 if data is not shared)
+ */
+int chunk_data_refcount(const uint8_t *data);
+
+/**
+ * Statistics about the chunk payload pool of a thread.
+ */
+struct chunk_data_stats {
+  unsigned long hits;	/**< allocations served by the pool */
+  unsigned long misses;	/**< allocations served by the system allocator */
+  size_t cached_bytes;	/**< free memory kept by the pool */
+};
+
+/**
+ * @brief Get the statistics of the chunk payload pool.
+ *
+ * @param stats where to store the statistics of the calling thread's pool
+ */
+void chunk_data_get_stats(struct chunk_data_stats *stats);
+
+/**
+ * @brief Release the memory cached by the chunk payload pool.
+ *
+ * Free all the unused blocks cached by the calling thread's pool (for
+ * example, before the thread exits).
+ */
+void chunk_data_pool_flush(void);
+
+/**
+ * @brief Allocate the payload and the attributes of a chunk.
+ *
+ * Allocate (with a single allocation, if the attributes are small) the
+ * payload and the attributes of a chunk, filling the data, size,
+ * attributes, and attributes_size fields.
+ *
+ * @param c the chunk
+ * @param size the size of the payload
+ * @param attributes_size the size of the attributes (can be 0)
+ * @return 0 on success, < 0 on error
+ */
+int chunk_alloc(struct chunk *c, int size, int attributes_size);
+
+/**
+ * @brief Take ownership of the payload and the attributes of a chunk view.
+ *
+ * Turn a chunk whose data and attributes point into memory that the chunk
+ * does not own (for example, a chunk decoded with decodeChunkView()) into
+ * a reference counted chunk holding its own references, which can be
+ * stored (in a chunk buffer created with "refcount=1") or released with
+ * chunk_release(). If block is not NULL, it must be the buffer
+ * (allocated with chunk_data_alloc()) containing the viewed payload:
+ * when the payload is large enough compared to block, the chunk takes a
+ * reference to block instead of copying the payload (overwriting the
+ * bytes preceding the payload). Otherwise, payload and attributes are
+ * copied.
+ *
+ * @param c the chunk view
+ * @param block the buffer containing the payload, or NULL
+ * @return 0 on success, < 0 on error (c is left unchanged)
+ */
+int chunk_adopt(struct chunk *c, uint8_t *block);
+
+/**
+ * @brief Release the payload and the attributes of a chunk.
+ *
+ * @param c the chunk
+ */
+void chunk_release(struct chunk *c);
+
 #endif
@@ -15,6 +15,17 @@
  * sequence number (the chunk ID), the chunk buffer's clients
  * (scheduler and output module) can easily check if there are gaps in the
  * list.
+ * The buffer is organised as a ring of "size" slots indexed by chunk ID, so
+ * it contains the chunks whose IDs fall in a window of "size" IDs ending at
+ * the newest chunk: adding, looking up, and discarding a chunk are O(1)
+ * operations, and the ordered list is obtained without sorting.
+ * Optionally, the memory used by the buffer can be limited with a byte
+ * budget: chunks are then evicted according to their deadline (timestamp)
+ * or to their priority (as set by the chunkiser in the chunk attributes)
+ * to make room for new chunks.
+ * For large windows, the payloads can be kept in memory mapped segment
+ * files instead of the heap, so that the kernel can page them out; such
+ * segments are recycled as the window slides.
  * See @link cb_test.c cb_test.c @endlink for an usage example
  *
  */
@@ -25,14 +36,20 @@
  *
  */
 
+#include <stddef.h>
+
 #define E_CB_OLD -1		/**< The chunk is too old */
 #define E_CB_DUPLICATE -2	/**< The chunk is already in the buffer */
+#define E_CB_FULL -3		/**< The chunk does not fit in the byte budget */
+#define E_CB_ERROR -4		/**< The chunk cannot be stored (out of memory) */
 
 /**
  * Structure describing a chunk buffer. This is an opaque type.
  */
 typedef struct chunk_buffer ChunkBuffer;
 
+struct chunkID_set;
+
 
 /**
  * Allocate a chunk buffer.
@@ -42,9 +59,26 @@ typedef struct chunk_buffer ChunkBuffer;
  *
  * @param config a text string containing some configuration parameters for
  *        the buffer, such as the playout delay and maybe some additional
- *        parameters (estimated size of the buffer, etc...)
+ *        parameters (estimated size of the buffer, etc...). The "size"
+ *        tag sets the number of chunk IDs in the buffer window (at most
+ *        CHUNKID_SET_MAX_SPAN); the "bytes"
+ *        tag (for example, "bytes=64M": a number optionally followed by
+ *        one of the K, M or G suffixes) sets a limit to the payload and
+ *        attributes bytes stored in the buffer, and "policy" selects
+ *        the chunks to be evicted when such a limit is reached: "deadline"
+ *        (the default) evicts the chunks with the smallest timestamp, and
+ *        "priority" evicts the least important chunks first (then the
+ *        ones with the smallest timestamp). "size" is mandatory if "bytes"
+ *        is not specified. "store=mmap" stores the chunk payloads in
+ *        memory mapped files created in the "path" directory (default:
+ *        /tmp); each file has the size given by "segment" (default: 256M),
+ *        and "segments" optionally limits the number of files (when all
+ *        of them are full, the chunks of the oldest one are discarded).
+ *        "refcount=1" makes the buffer store reference counted chunks
+ *        (see chunk.h) instead of malloc()ed ones
  * @return a pointer to the allocated chunk buffer in case of success, NULL
- *         otherwise
+ *         otherwise (for example, if "bytes" or "segment" are not valid
+ *         sizes)
  */
 struct chunk_buffer *cb_init(const char *config);
 
@@ -53,7 +87,17 @@ struct chunk_buffer *cb_init(const char *config);
  *
  * Insert a chunk in the given buffer. One or more chunks can be removed
  * from the buffer (if necessary, and according to the internal logic of
- * the chunk buffer) to create space for the new one.
+ * the chunk buffer) to create space for the new one: when the chunk is
+ * newer than the ones in the buffer, the chunks falling out of the ID
+ * window are discarded. A chunk older than the window is refused with
+ * E_CB_OLD (unless its timestamp shows that the IDs looped around, in
+ * which case the buffer is flushed). If the buffer has a byte budget,
+ * chunks are evicted according to the eviction policy; a chunk that would
+ * be evicted before all the others is refused with E_CB_FULL.
+ * If the chunk is accepted, the buffer takes ownership of its payload and
+ * attributes, which must have been allocated with malloc() (or must be
+ * reference counted, if the buffer has been created with "refcount=1");
+ * otherwise, they still belong to the caller.
  *
  * @param cb a pointer to the chunk buffer
  * @param c a pointer to the descriptor of the chunk to be inserted in the
@@ -62,6 +106,27 @@ struct chunk_buffer *cb_init(const char *config);
  */
 int cb_add_chunk(struct chunk_buffer *cb, const struct chunk *c);
 
+/**
+ * Add a chunk view to a buffer.
+ *
+ * Like cb_add_chunk(), but the payload and the attributes of c are not
+ * owned by c (for example, c has been decoded with decodeChunkView()):
+ * they are copied only if the chunk is accepted, so refusing a duplicate
+ * or old chunk does not allocate or copy anything. The caller can reuse
+ * the memory c points to as soon as the function returns, unless the
+ * chunk took a reference to block.
+ *
+ * @param cb a pointer to the chunk buffer
+ * @param c a pointer to the chunk view
+ * @param block the buffer containing the payload of c (allocated with
+ *        chunk_data_alloc()), or NULL to copy the payload. If the buffer
+ *        has been created with "refcount=1", the chunk can take a
+ *        reference to block instead of copying the payload (see
+ *        chunk_adopt()); otherwise, block is not used
+ * @return >=0 in case of success, < 0 in case of failure
+ */
+int cb_add_chunk_view(struct chunk_buffer *cb, const struct chunk *c, uint8_t *block);
+
 /** 
  * Get the chunks from a buffer.
  *
@@ -80,6 +145,29 @@ int cb_add_chunk(struct chunk_buffer *cb, const struct chunk *c);
  */
 struct chunk *cb_get_chunks(const struct chunk_buffer *cb, int *n);
 
+/**
+ * Get the buffermap of a buffer.
+ *
+ * Provide the set of the IDs of the chunks which are currently stored in
+ * the specified chunk buffer. The set is kept up to date by the buffer
+ * while chunks are added and discarded, so it can be directly passed
+ * to sendBufferMap() without being rebuilt.
+ *
+ * @param cb a pointer to the chunk buffer
+ * @return a (read-only) chunk ID set of type "bitmap", owned by the
+ *         chunk buffer
+ */
+const struct chunkID_set *cb_get_bmap(const struct chunk_buffer *cb);
+
+/**
+ * Get the memory used by a buffer.
+ *
+ * @param cb a pointer to the chunk buffer
+ * @return the number of payload and attributes bytes of the chunks stored
+ *         in the buffer
+ */
+size_t cb_get_bytes(const struct chunk_buffer *cb);
+
 /**
  * Clear a chunk buffer
  *
@@ -109,12 +197,51 @@ void cb_destroy(struct chunk_buffer *cb);
  * Get a specific chunk from a buffer
  *
  * Provide one single chunk from the specified chunkbuffer,
- * with the requested identifier.
+ * with the requested identifier. If the buffer has been created with
+ * "store=mmap", the returned structure is filled when the function is
+ * invoked (its payload still points into the store), and is overwritten
+ * by the next call.
  *
  * @param cb a pointer to the chunk buffer
  * @param id the identifier of the chunk to be returned
- * @return a pointer to the requested chunk
+ * @return a pointer to the requested chunk, or NULL if the chunk is not
+ *         in the buffer
 */
 const struct chunk *cb_get_chunk(const struct chunk_buffer *cb, int id);
 
+/**
+ * Get the chunks missing from a buffer
+ *
+ * Provide the IDs of the chunks in the range [from, to] (for example,
+ * the playout window) which are not stored in the specified chunk buffer.
+ *
+ * The range cannot be wider than CHUNKID_SET_MAX_SPAN IDs.
+ *
+ * @param cb a pointer to the chunk buffer
+ * @param from the first chunk ID of the range
+ * @param to the last chunk ID of the range
+ * @return a chunk ID set of type "bitmap" containing the missing IDs (to
+ *         be freed with chunkID_set_free()), or NULL on error
+*/
+struct chunkID_set *cb_get_missing(const struct chunk_buffer *cb, int from, int to);
+
+/**
+ * Get the chunks missing from a buffer into an existing set
+ *
+ * Like cb_get_missing(), but the IDs are stored in a set provided by the
+ * caller (which is emptied first). Since the memory of the set is reused,
+ * computing the missing chunks periodically does not allocate memory
+ * once the set is large enough. Only the IDs in the buffer window are
+ * looked up; the IDs below it and above the last received one are
+ * missing by definition.
+ *
+ * @param cb a pointer to the chunk buffer
+ * @param missing the set that will contain the missing IDs
+ * @param from the first chunk ID of the range
+ * @param to the last chunk ID of the range
+ * @return the number of missing IDs, or < 0 on error (for example, if the
+ *         range is wider than CHUNKID_SET_MAX_SPAN IDs)
+*/
+int cb_get_missingInto(const struct chunk_buffer *cb, struct chunkID_set *missing, int from, int to);
+
 #endif	/* CHUNKBUFFER_H */
@@ -6,6 +6,13 @@
  * (chunk ID, priority) couples. Few simple operations for adding chunk IDs
  * in a set, for getting the chunk IDs present in a set, for allocating a
  * set, and for clearing a set are provided.
+ * Sets of type "bitmap" keep their chunk IDs ordered (see
+ * chunkID_set_rank() for the position of a chunk ID), and are stored as a
+ * sliding bitmap: adding, checking, and removing an ID take constant time,
+ * and the memory used depends on the distance between the smallest and
+ * the largest ID, not on the number of IDs (which is at most 2^20: adding
+ * an ID farther than that from the others fails). Sets of type "priority"
+ * keep the insertion order.
  * See @link chunkidset_test.c chunkidset_test.c @endlink for an usage example.
  *
  */
@@ -25,6 +32,7 @@
 typedef struct chunkID_set ChunkIDSet;
 
 #define CHUNKID_INVALID (uint32_t)-1	/**< Trying to get a chunk ID from an empty set */
+#define CHUNKID_SET_MAX_SPAN (1 << 20)	/**< Consecutive IDs that always fit in a set of type "bitmap" */
 
  /**
   * @brief Allocate a chunk ID set.
@@ -35,7 +43,11 @@ typedef struct chunkID_set ChunkIDSet;
   *                   the chunk ID set. For example, the "size" tag indicates
   *                   the expected number of chunk IDs that will be stored
   *                   in the set; 0 or not present if such a number is not
-  *                   known.
+  *                   known. "encoding=compact" makes encodeChunkSignaling()
+  *                   send the set in the most compact of the run length,
+  *                   delta and sparse encodings; this should be enabled
+  *                   only if all the peers can decode them. The default
+  *                   ("encoding=dense") is the original bitmap or ID list.
   * @return the pointer to the new set on success, NULL on error
   */
 struct chunkID_set *chunkID_set_init(const char *config);
@@ -83,10 +95,24 @@ int chunkID_set_get_chunk(const struct chunkID_set *h, int i);
   * @param h a pointer to the set
   * @param chunk_id the chunk ID we are searching for
   * @return the priority of the chunk ID if it is present in the set,
-  *         < 0 on error or if the chunk ID is not in the set
+  *         < 0 on error or if the chunk ID is not in the set (in sets of
+  *         type "bitmap" the IDs are sorted, and the priority is the
+  *         position of the ID, as given by chunkID_set_rank())
   */
 int chunkID_set_check(const struct chunkID_set *h, int chunk_id);
 
+ /**
+  * @brief Remove a chunk ID from a set
+  *
+  * Remove a chunk ID from the set. The priority order of the other
+  * chunk IDs is kept.
+  *
+  * @param h a pointer to the set
+  * @param chunk_id the chunk ID to be removed
+  * @return 1 if the chunk ID has been removed, 0 if it was not in the set
+  */
+int chunkID_set_remove_chunk(struct chunkID_set *h, int chunk_id);
+
  /**
   * Add chunks from a chunk ID set to another one
   * 
@@ -99,7 +125,91 @@ int chunkID_set_check(const struct chunkID_set *h, int chunk_id);
   * @return > 0 if the chunk ID is correctly inserted in the set, 0 if chunk_id
   *         is already in the set, < 0 on error
   */
-int chunkID_set_union(struct chunkID_set *h, struct chunkID_set *a);
+int chunkID_set_union(struct chunkID_set *h, const struct chunkID_set *a);
+
+ /**
+  * Remove from a set the chunk IDs which are not in another one
+  *
+  * Keep in h only the chunk IDs which are also in a. If both sets are of
+  * type "bitmap", this is done by combining whole words of the bitmaps.
+  *
+  * @param h a pointer to the set to be modified
+  * @param a a pointer to the other set
+  * @return the size of h after the operation
+  */
+int chunkID_set_intersection(struct chunkID_set *h, const struct chunkID_set *a);
+
+ /**
+  * Remove from a set the chunk IDs contained in another one
+  *
+  * Remove from h all the chunk IDs which are in a (for example, to
+  * compute the chunks which a neighbour needs and the local peer has).
+  * If both sets are of type "bitmap", this is done by combining whole
+  * words of the bitmaps.
+  *
+  * @param h a pointer to the set to be modified
+  * @param a a pointer to the set of chunk IDs to be removed
+  * @return the size of h after the operation
+  */
+int chunkID_set_difference(struct chunkID_set *h, const struct chunkID_set *a);
+
+ /**
+  * Toggle the chunk IDs contained in another set
+  *
+  * Remove from h the chunk IDs which are in a, and add to h the chunk IDs
+  * of a which are not in h (so, h becomes the symmetric difference of the
+  * two sets). Applying the symmetric difference of two buffermaps to the
+  * first one gives the second one.
+  * If both sets are of type "bitmap", this is done by combining whole
+  * words of the bitmaps.
+  *
+  * @param h a pointer to the set to be modified
+  * @param a a pointer to the set of chunk IDs to be toggled
+  * @return the size of h after the operation, or < 0 on error
+  */
+int chunkID_set_symmetric_difference(struct chunkID_set *h, const struct chunkID_set *a);
+
+ /**
+  * Count the chunk IDs which are in both sets
+  *
+  * Compute the size of the intersection of two sets, without building it.
+  *
+  * @param h a pointer to a set
+  * @param a a pointer to the other set
+  * @return the number of chunk IDs contained in both h and a
+  */
+int chunkID_set_intersection_size(const struct chunkID_set *h, const struct chunkID_set *a);
+
+ /**
+  * Count the chunk IDs which are in a set but not in another one
+  *
+  * Compute the size of the difference of two sets, without building it
+  * (for example, to know how many useful chunks a neighbour can provide).
+  *
+  * @param h a pointer to a set
+  * @param a a pointer to the set of chunk IDs to be excluded
+  * @return the number of chunk IDs contained in h and not in a
+  */
+int chunkID_set_difference_size(const struct chunkID_set *h, const struct chunkID_set *a);
+
+ /**
+  * Count the chunk IDs smaller than a given one
+  *
+  * @param h a pointer to the set
+  * @param chunk_id a chunk ID (not necessarily in the set)
+  * @return the number of chunk IDs in h which are smaller than chunk_id
+  *         (for a set of type "bitmap", this is the position that
+  *         chunk_id has or would have in the set)
+  */
+int chunkID_set_rank(const struct chunkID_set *h, int chunk_id);
+
+ /**
+  * Check the wire encoding of a set
+  *
+  * @param h a pointer to the set
+  * @return 1 if the set was created with "encoding=compact", 0 otherwise
+  */
+int chunkID_set_compact(const struct chunkID_set *h);
 
  /**
   * Clear a set
@@ -122,7 +232,8 @@ void chunkID_set_free(struct chunkID_set *h);
  /**
   * @brief Get the smallest chunk ID from a set
   * 
-  * Return the ID of the earliest chunk from the the set.
+  * Return the ID of the earliest chunk from the the set. This takes
+  * constant time for sets of type "bitmap".
   *
   * @param h a pointer to the set
   * @return the chunk ID in case of success, or CHUNKID_INVALID on error
@@ -132,7 +243,8 @@ uint32_t chunkID_set_get_earliest(const struct chunkID_set *h);
  /**
   * @brief Get the largest chunk ID from a set
   * 
-  * Return the ID of the latest chunk from the the set.
+  * Return the ID of the latest chunk from the the set. This takes
+  * constant time for sets of type "bitmap".
   *
   * @param h a pointer to the set
   * @return the chunk ID in case of success, or CHUNKID_INVALID on error
@@ -45,7 +45,7 @@ struct input_stream *input_stream_open(const char *fname, int *period, const cha
  *
  * Return a "-1 terminated" array of integers containing the FDs used for
  * reading an input stream. Such an array can be directly passed to wait4data()
- * as user_fds
+ * as user_fds, or its FDs can be added to a waitset (see waitset_add())
  *
  * @param s the pointer to the chunkiser context
  * @return the array with the input FDs on success, NULL on error or if
@@ -12,8 +12,8 @@ struct chunk_attributes_chunker {
   uint8_t priority;
 } __attribute__((packed));
 
-inline void chunk_attributes_chunker_init(struct chunk_attributes_chunker *ca);
+void chunk_attributes_chunker_init(struct chunk_attributes_chunker *ca);
 
-inline int chunk_attributes_chunker_verify(void *attr, int attr_size);
+int chunk_attributes_chunker_verify(const void *attr, int attr_size);
 
 #endif	/* CHUNKISER_ATTRIB_H */
@@ -15,5 +15,6 @@
 #define MSG_TYPE_CHUNK      0x11
 #define MSG_TYPE_SIGNALLING 0x12
 #define MSG_TYPE_TMAN       0x13
+#define MSG_TYPE_FEC        0x14
 
 #endif	/* GRAPES_MSG_TYPES_H */
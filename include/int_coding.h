@@ -43,4 +43,48 @@ static inline uint16_t int16_rcpy(const uint8_t *p)
   return tmp;
 }
 
+/* LEB128 variable length integers: 7 bits per byte, low bits first */
+static inline int varint_len(uint32_t v)
+{
+  int n = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+
+  return n;
+}
+
+static inline int varint_cpy(uint8_t *p, uint32_t v)
+{
+  int n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+
+  return n;
+}
+
+/* Returns the number of bytes read, or -1 if the varint is truncated or too long */
+static inline int varint_rcpy(const uint8_t *p, int len, uint32_t *v)
+{
+  uint32_t res = 0;
+  int i;
+
+  for (i = 0; i < len && i < 5; i++) {
+    res |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+    if ((p[i] & 0x80) == 0) {
+      *v = res;
+
+      return i + 1;
+    }
+  }
+
+  return -1;
+}
+
 #endif	/* INT_CODING */
@@ -2,6 +2,15 @@
 #define NET_HELPER_H
 
 #include <sys/time.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#else
+#include <stddef.h>
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
 
 /**
 * @file net_helper.h
@@ -15,13 +24,17 @@
 
 /**
 * Implementation dependent internal representation of a node ID.
+* In the UDP implementation the nodeIDs are interned: all the nodeIDs of
+* an address are the same object, with a reference count, so nodeIDs must
+* never be modified.
 */
 struct nodeID;
 
 /**
 * @brief Duplicate a nodeID.
 *
-* This function provides a duplicate of the given nodeID.
+* This function provides a duplicate of the given nodeID (possibly the
+* same pointer, with one more reference: it must be freed anyway).
 * @param[in] s A pointer to the nodeID to be duplicated.
 * @return A pointer to the duplicate of the argument nodeID.
 */
@@ -70,7 +83,20 @@ void nodeid_free(struct nodeID *s);
 * Initialize the parameters for the networking facilities and create a nodeID representing the caller.
 * @param[in] IPaddr The IP in string form to be associated to the caller.
 * @param[in] port The port to be associated to the caller.
-* @param[in] config Additional configuration options.
+* @param[in] config Additional configuration options. For the UDP implementation: "reasm_memory" is the
+*            maximum size in KB of the fragment reassembly buffers, and "reasm_timeout" is the time in ms
+*            after which an incomplete message is dropped. If "mtu" is set, messages are sent in fragments
+*            fitting in datagrams of mtu bytes (instead of 60KB datagrams fragmented by IP), and the
+*            receivers NACK the missing fragments, which are sent again: the messages are cached by the
+*            sender for "send_cache_time" ms (500 by default) using up to "send_cache" KB (4096 by default),
+*            and an incomplete message is NACKed "nack_delay" ms (20 by default) after its last fragment
+*            arrived (each receiver gets its NACKed fragments sent again at most once every "nack_delay" ms).
+*            Receivers always accept both kinds of fragments, but older versions do not.
+*            If "upload" (in kbit/s) is set, the messages are queued per destination and paced to that
+*            rate with a token bucket of "burst" KB (16 by default): signalling messages are sent first,
+*            and chunks waiting for more than "chunk_deadline" ms (300 by default) are dropped, as are
+*            the chunks exceeding "send_queue" KB (1024 by default) queued for a destination
+*            (see send_queue_stats()).
 * @return A pointer to a nodeID representing the caller, initialized with all the necessary data.
 */
 struct nodeID *net_helper_init(const char *IPaddr, int port,const char *config);
@@ -90,6 +116,10 @@ void bind_msg_type(uint8_t msgtype);
 * @brief Send data to a remote peer.
 *
 * This function provides a transparently handles the sending routines.
+* With an upload limit (see net_helper_init()) the message is copied in
+* a queue, and its datagrams are sent later, while waiting for data with
+* waitset_wait(), wait4data() or recv_from_peer(): in this case, sent
+* means queued (this holds for all the send functions).
 * @param[in] from A pointer to the nodeID representing the caller.
 * @param[in] to A pointer to the nodeID representing the remote peer.
 * @param[in] buffer_ptr A pointer to the buffer containing the data to be sent.
@@ -98,6 +128,154 @@ void bind_msg_type(uint8_t msgtype);
 */
 int send_to_peer(const struct nodeID *from, struct nodeID *to, const uint8_t *buffer_ptr, int buffer_size);
 
+/**
+* @brief Send data scattered in multiple buffers to a remote peer.
+*
+* Like send_to_peer(), but the message is the concatenation of iovcnt
+* buffers (for example, a header and a payload), which are passed to
+* the socket without copying them in a single buffer, when possible.
+* @param[in] from A pointer to the nodeID representing the caller.
+* @param[in] to A pointer to the nodeID representing the remote peer.
+* @param[in] iov The buffers containing the data to be sent (the first byte is the message type).
+* @param[in] iovcnt The number of buffers (at most NH_IOV_MAX).
+* @return The number of bytes sent or -1 if some error occurred.
+*/
+int send_to_peer_iov(const struct nodeID *from, struct nodeID *to, const struct iovec *iov, int iovcnt);
+
+/**
+* @brief Send the same message to multiple remote peers.
+*
+* Like send_to_peer_iov(), but the message is sent to n peers, batching
+* the system calls when possible (with sendmmsg()).
+* @param[in] from A pointer to the nodeID representing the caller.
+* @param[in] to An array of n pointers to the nodeIDs of the remote peers.
+* @param[in] n The number of remote peers.
+* @param[in] iov The buffers containing the data to be sent (the first byte is the message type).
+* @param[in] iovcnt The number of buffers (at most NH_IOV_MAX).
+* @param[out] res If not NULL, an array of n results: the number of bytes sent to each peer, or -1 on error.
+* @return The number of peers the message has been sent to, or -1 if the message is invalid.
+*/
+int send_to_peers_iov(const struct nodeID *from, struct nodeID **to, int n,
+                      const struct iovec *iov, int iovcnt, int *res);
+
+/**
+* @brief Send the same message to multiple remote peers, sharing its payload.
+*
+* Like send_to_peers_iov(), but the buffers flagged in shared are
+* reference counted chunk payloads (see chunk_data_alloc()): when the
+* message must be kept after the call (for retransmissions), they are
+* referenced instead of being copied, so they must not be modified
+* afterwards.
+* @param[in] from A pointer to the nodeID representing the caller.
+* @param[in] to An array of n pointers to the nodeIDs of the remote peers.
+* @param[in] n The number of remote peers.
+* @param[in] iov The buffers containing the data to be sent (the first byte is the message type).
+* @param[in] iovcnt The number of buffers (at most NH_IOV_MAX).
+* @param[in] shared A bit mask: bit i is set if iov[i].iov_base is a chunk payload.
+* @param[out] res If not NULL, an array of n results: the number of bytes sent to each peer, or -1 on error.
+* @return The number of peers the message has been sent to, or -1 if the message is invalid.
+*/
+int send_to_peers_iov_shared(const struct nodeID *from, struct nodeID **to, int n,
+                             const struct iovec *iov, int iovcnt, unsigned int shared, int *res);
+
+/**
+* Maximum number of buffers for send_to_peer_iov().
+*/
+#define NH_IOV_MAX 8
+
+/**
+* A message in a batch, for send_to_peers().
+*/
+struct nh_send_msg {
+  struct nodeID *peer;	/**< destination of the message */
+  const uint8_t *buff;	/**< message data */
+  int len;		/**< length of the message */
+};
+
+/**
+* A message in a batch, for recv_from_peers().
+*/
+struct nh_msg {
+  struct nodeID *peer;	/**< sender of the message */
+  uint8_t *buff;	/**< buffer for the message data */
+  int size;		/**< size of buff */
+  int len;		/**< length of the message */
+};
+
+/**
+* @brief Send a batch of messages.
+*
+* Send n messages (each one to its own destination), using as few
+* system calls as possible (with sendmmsg(), where available).
+* @param[in] from A pointer to the nodeID representing the caller.
+* @param[in] msgs The messages: peer is the destination, and buff contains len bytes of data (the first byte is the message type).
+* @param[in] n The number of messages.
+* @param[out] res If not NULL, an array of n results: the number of bytes sent for each message, or -1 on error.
+* @return The number of messages sent.
+*/
+int send_to_peers(const struct nodeID *from, const struct nh_send_msg *msgs, int n, int *res);
+
+/**
+* @brief Receive a batch of messages.
+*
+* Block until some data arrives, and then receive up to n datagrams
+* with as few system calls as possible (with recvmmsg(), where
+* available). For each received message, buff is filled with len bytes
+* of data and peer is set to a new nodeID representing the sender, which
+* must be freed with nodeid_free() (the nodeID of a known peer is
+* shared, and the freed ones are recycled, so that receiving a message
+* does not require memory allocations).
+* A message larger than 60KB is sent in more datagrams (fragments), which
+* can arrive in any order and interleaved with other messages: fragments
+* found in the same batch are assembled directly in a message buffer,
+* the others are kept in a reassembly buffer until the message is
+* complete (see net_helper_init() and reasm_stats()). So, all the buffers
+* should have the same size, and it is possible that no message is
+* complete yet.
+* @param[in] local A pointer to the nodeID representing the caller.
+* @param[in,out] msgs The messages: buff and size must be set by the caller.
+* @param[in] n The number of messages.
+* @return The number of received messages (the first ones in msgs, possibly 0), or -1 if some error occurred.
+*/
+int recv_from_peers(const struct nodeID *local, struct nh_msg *msgs, int n);
+
+/**
+* Fragmentation counters.
+*/
+struct nh_reasm_stats {
+  unsigned int reassembled;	/**< messages assembled from more fragments */
+  unsigned int timeouts;	/**< incomplete messages dropped after reasm_timeout */
+  unsigned int evicted;		/**< incomplete messages dropped to make room for new ones */
+  unsigned int dropped;		/**< invalid, duplicated or too large fragments */
+  unsigned int nacks;		/**< NACKs sent for missing fragments (MTU mode) */
+  unsigned int retransmitted;	/**< fragments sent again because a receiver NACKed them (MTU mode) */
+};
+
+/**
+* @brief Get the fragmentation counters.
+*
+* @param[out] stats The counters (all 0 if the implementation does not fragment messages).
+*/
+void reasm_stats(struct nh_reasm_stats *stats);
+
+/**
+* Upload queue counters (see the "upload" option of net_helper_init()).
+*/
+struct nh_queue_stats {
+  unsigned int queued;		/**< messages queued (once per destination) */
+  unsigned int sent;		/**< datagrams sent from the queues */
+  unsigned int late;		/**< chunks dropped because they waited more than chunk_deadline */
+  unsigned int overflows;	/**< messages not queued because the destination queue was full */
+  unsigned int backlog;		/**< bytes currently queued */
+};
+
+/**
+* @brief Get the upload queue counters.
+*
+* @param[out] stats The counters (all 0 if the messages are not queued).
+*/
+void send_queue_stats(struct nh_queue_stats *stats);
+
 /**
 * @brief Receive data from a remote peer.
 *
@@ -115,13 +293,87 @@ int recv_from_peer(const struct nodeID *local, struct nodeID **remote, uint8_t *
 * @brief Check for newly arrived data.
 *
 * Check if some data arrived for a given nodeID. It sets a timeout to return at most after a given time.
+* The FDs of user_fds which are not ready are set to -2. New code should
+* rather use a waitset (see waitset_init()).
 * @param[in] n A pointer to the nodeID representing the caller.
 * @param[in] tout A pointer to a timer to be used to set the waiting timeout.
 * @param[in] user_fds A "-1 terminated" array of FDs to be monitored.
-* @return 1 if some data has arrived, 0 otherwise.
+* @return 1 if some data has arrived for the nodeID, 2 if some data has arrived on user_fds, 0 otherwise.
 */
 int wait4data(const struct nodeID *n, struct timeval *tout, int *user_fds);
 
+/**
+* @brief Stop monitoring an FD passed to wait4data().
+*
+* wait4data() registers the FDs of user_fds once, and keeps monitoring
+* them while they are passed to the following calls. If one of them is
+* closed (and its number can be reused for a new file before the next
+* call), this function must be invoked first; FDs which hung up are
+* forgotten automatically after being reported.
+* @param[in] fd The FD.
+* @return 0 on success, -1 if the FD is not monitored.
+*/
+int wait4data_forget(int fd);
+
+/**
+* Opaque data type representing a set of FDs monitored for incoming data.
+*/
+struct nh_waitset;
+
+/**
+* Value reported by waitset_wait() when data arrived for the nodeID.
+*/
+#define WAITSET_NODE -1
+
+/**
+* @brief Create a set of monitored FDs.
+*
+* Unlike wait4data(), which monitors the FDs it is given at each call,
+* the FDs are registered once, and the cost of waiting does not depend on
+* their number (epoll is used where available).
+* @param[in] n A pointer to the nodeID representing the caller (whose incoming messages are monitored), or NULL.
+* @return The set, or NULL if some error occurred.
+*/
+struct nh_waitset *waitset_init(const struct nodeID *n);
+
+/**
+* @brief Start monitoring an FD.
+*
+* The FD must be removed from the set (with waitset_del()) before being
+* closed.
+* @param[in] w The set.
+* @param[in] fd The FD.
+* @return 0 on success, -1 if some error occurred.
+*/
+int waitset_add(struct nh_waitset *w, int fd);
+
+/**
+* @brief Stop monitoring an FD.
+*
+* @param[in] w The set.
+* @param[in] fd The FD.
+* @return 0 on success, -1 if the FD is not in the set.
+*/
+int waitset_del(struct nh_waitset *w, int fd);
+
+/**
+* @brief Wait for data on the FDs of a set.
+*
+* @param[in] w The set.
+* @param[in] tout A pointer to the maximum time to wait (NULL means forever); it is not modified.
+* @param[out] ready An array of up to max_ready FDs on which data arrived (WAITSET_NODE for the nodeID).
+* @param[in] max_ready The size of the ready array.
+* @return The number of FDs stored in ready (0 on timeout), or -1 if some error occurred.
+*/
+int waitset_wait(struct nh_waitset *w, struct timeval *tout, int *ready, int max_ready);
+
+/**
+* @brief Destroy a set of monitored FDs.
+*
+* @param[in] w The set.
+*/
+void waitset_free(struct nh_waitset *w);
+
 /**
 * @brief Give a string representation of a nodeID.
 *
@@ -9,6 +9,7 @@
 #ifndef _PEER_H
 #define	_PEER_H
 
+#include <stdint.h>
 #include <sys/time.h>
 
 struct peer {
@@ -16,6 +17,12 @@ struct peer {
     struct timeval creation_timestamp; ///< creation timestamp
     struct chunkID_set *bmap; ///< buffermap of the peer
     struct timeval bmap_timestamp; ///< buffermap timestamp
+    uint16_t bmap_seq; ///< sequence number of bmap, for delta buffermaps (0 if unknown)
+    struct timeval bmap_req_timestamp; ///< when the whole buffermap was requested (0 if no request is pending)
+    struct chunkID_set *bmap_sent; ///< last buffermap sent to the peer, base for the next delta
+    uint16_t bmap_sent_seq; ///< sequence number of bmap_sent (0: send the whole buffermap)
+    int srtt; ///< smoothed round trip time, in us (0 if unknown)
+    int rttvar; ///< round trip time variation, in us
     int cb_size; ///< chunk buffer size
     double capacity; ///< chunk buffer size
     int subnet;
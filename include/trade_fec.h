@@ -0,0 +1,135 @@
+/** @file trade_fec.h
+ *
+ * @brief Chunk Trading Forward Error Correction.
+ *
+ * Protect groups of k consecutive chunks (the chunks with IDs from g * k
+ * to g * k + k - 1) with m repair chunks (Reed-Solomon code over GF(256),
+ * with a Cauchy generator matrix): a receiver getting any k of the k + m
+ * chunks of a group can rebuild the missing ones, without asking for
+ * retransmissions.
+ *
+ * The sender passes each chunk it generates to fecEncode(), and sends the
+ * repair chunks returned by fecEncoderGet() with sendRepairChunk(). The
+ * receiver passes each received chunk (and repair chunk, received in
+ * MSG_TYPE_FEC messages) to fecDecode(), and adds the chunks returned by
+ * fecDecoderGet() to its chunk buffer.
+ */
+
+#ifndef TRADE_FEC_H
+#define TRADE_FEC_H
+
+#include <stdint.h>
+
+#include "chunk.h"
+#include "net_helper.h"
+
+/**
+ * Opaque data type representing a FEC encoder
+ */
+struct fec_encoder;
+
+/**
+ * Opaque data type representing a FEC decoder
+ */
+struct fec_decoder;
+
+/**
+ * @brief Allocate a FEC encoder.
+ *
+ * @param[in] config a configuration string: "k" is the number of chunks
+ *            in a group (8 by default), "m" the number of repair chunks
+ *            per group (2 by default), "kernel" selects the GF(256)
+ *            implementation ("auto", "avx2", "ssse3" or "scalar"), and
+ *            "refcount=1" makes the encoder work with reference counted
+ *            chunks (see chunk.h) instead of malloc()ed ones.
+ * @return the encoder, or NULL on error.
+ */
+struct fec_encoder *fecEncoderInit(const char *config);
+
+/**
+ * @brief Add a chunk to the current group.
+ *
+ * The encoder keeps its own copy of the chunk payload and attributes
+ * (or its own references to them, with "refcount=1"). When the last chunk of a group is added, the repair chunks
+ * are computed. Chunks must be added in order of ID: a group which is
+ * not complete when a chunk of a following group is added is discarded.
+ *
+ * @param[in] e the encoder.
+ * @param[in] c the chunk.
+ * @return the number of repair chunks ready, <0 on error.
+ */
+int fecEncode(struct fec_encoder *e, const struct chunk *c);
+
+/**
+ * @brief Get a repair chunk.
+ *
+ * @param[in] e the encoder.
+ * @param[out] repair the repair chunk (its payload is to be freed with
+ *             free(), or released with chunk_release() with "refcount=1").
+ * @return 1 if a repair chunk has been returned, 0 if none is ready.
+ */
+int fecEncoderGet(struct fec_encoder *e, struct chunk *repair);
+
+/**
+ * @brief Free a FEC encoder.
+ *
+ * @param[in] e the encoder.
+ */
+void fecEncoderFree(struct fec_encoder *e);
+
+/**
+ * @brief Allocate a FEC decoder.
+ *
+ * @param[in] config a configuration string: "k", "m", "kernel" and
+ *            "refcount" as for fecEncoderInit() ("k" and "m" must match
+ *            the ones of the sender), and "groups" is the number of
+ *            groups being collected at the same time (8 by default).
+ * @return the decoder, or NULL on error.
+ */
+struct fec_decoder *fecDecoderInit(const char *config);
+
+/**
+ * @brief Add a received chunk to its group.
+ *
+ * The decoder keeps its own copy of the chunk payload and attributes
+ * (or its own references to them, with "refcount=1"). When k chunks of a group have been received, the missing
+ * chunks of the group are rebuilt.
+ *
+ * @param[in] d the decoder.
+ * @param[in] c the chunk.
+ * @param[in] repair 1 if c is a repair chunk, 0 otherwise.
+ * @return the number of rebuilt chunks ready, <0 on error.
+ */
+int fecDecode(struct fec_decoder *d, const struct chunk *c, int repair);
+
+/**
+ * @brief Get a rebuilt chunk.
+ *
+ * @param[in] d the decoder.
+ * @param[out] c the rebuilt chunk, allocated as the chunks passed to
+ *             fecDecode() (to be added to a chunk buffer, or released).
+ * @return 1 if a chunk has been returned, 0 if none is ready.
+ */
+int fecDecoderGet(struct fec_decoder *d, struct chunk *c);
+
+/**
+ * @brief Free a FEC decoder.
+ *
+ * @param[in] d the decoder.
+ */
+void fecDecoderFree(struct fec_decoder *d);
+
+/**
+ * @brief Send a repair chunk to a peer.
+ *
+ * Like sendChunk(), but the message type is MSG_TYPE_FEC (the message
+ * can be parsed with parseChunkMsg()).
+ *
+ * @param[in] to destination peer.
+ * @param[in] repair the repair chunk.
+ * @param[in] transid the transaction ID.
+ * @return 0 on success, <0 on error.
+ */
+int sendRepairChunk(struct nodeID *to, const struct chunk *repair, uint16_t transid);
+
+#endif /* TRADE_FEC_H */
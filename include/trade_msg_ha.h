@@ -16,6 +16,10 @@
 
 #include "chunk.h"
 
+struct peer;
+struct peerset;
+struct chunkID_set;
+
 /**
  * @brief Parse an incoming chunk message, providing the chunk structure and transaction ID.
  * @return 1 on success, <0 on error.
@@ -28,6 +32,71 @@
  */
 int parseChunkMsg(const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *transid);
 
+/**
+ * @brief Parse an incoming chunk message without copying the chunk payload.
+ *
+ * Like parseChunkMsg(), but the message must have been received in a buffer
+ * allocated with chunk_data_alloc(), and the payload of the chunk shares
+ * that buffer (see decodeChunkShared()). The chunk is reference counted,
+ * and must be released with chunk_release().
+ *
+ * @param[in] block buffer allocated with chunk_data_alloc() containing the incoming message.
+ * @param[in] buff pointer (inside block) to the chunk message.
+ * @param[in] buff_len length of the chunk message.
+ * @param[out] c the chunk filled with data (an already allocated chunk structure must be passed!).
+ * @param[out] transid the transaction ID.
+ * @return 1 on success, <0 on error.
+ */
+int parseChunkMsgShared(uint8_t *block, const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *transid);
+
+/**
+ * @brief Parse an incoming chunk message without allocating anything.
+ *
+ * Like parseChunkMsg(), but the payload and the attributes of the chunk
+ * point inside buff (see decodeChunkView()). The chunk must not be
+ * released: use chunk_adopt() or cb_add_chunk_view() to keep it.
+ *
+ * @param[in] buff containing the incoming message.
+ * @param[in] buff_len length of the buffer.
+ * @param[out] c the chunk view.
+ * @param[out] transid the transaction ID.
+ * @return 1 on success, <0 on error.
+ */
+int parseChunkMsgView(uint8_t *buff, int buff_len, struct chunk *c, uint16_t *transid);
+
+/**
+ * @brief Parse an incoming chunk message, updating the BufferMap of its sender.
+ *
+ * Like parseChunkMsg(), but if the message carries a BufferMap trailer
+ * (see sendChunkPeer()) and the sender is in the peerset, the bmap of
+ * the sender is updated (if a trailer has been lost, the whole BufferMap
+ * is requested to the sender with requestBufferMap()).
+ *
+ * @param[in] ps the peerset.
+ * @param[in] from the sender of the message.
+ * @param[in] buff containing the incoming message.
+ * @param[in] buff_len length of the buffer.
+ * @param[out] c the chunk filled with data (an already allocated chunk structure must be passed!).
+ * @param[out] transid the transaction ID.
+ * @return 1 on success, <0 on error.
+ */
+int parseChunkMsgPeerset(struct peerset *ps, const struct nodeID *from,
+                         const uint8_t *buff, int buff_len,
+                         struct chunk *c, uint16_t *transid);
+
+/**
+ * @brief Get the ID of the chunk contained in an incoming chunk message.
+ *
+ * Read only the chunk ID, so that duplicate or late chunks can be
+ * discarded before parsing the message.
+ *
+ * @param[in] buff containing the incoming message.
+ * @param[in] buff_len length of the buffer.
+ * @param[out] id the chunk ID.
+ * @return 0 on success, <0 if the message is too short.
+ */
+int peekChunkId(const uint8_t *buff, int buff_len, int *id);
+
 /**
   * @brief Send a Chunk to a target Peer
   *
@@ -40,6 +109,42 @@ int parseChunkMsg(const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *
   */
 int sendChunk(struct nodeID *to, const struct chunk *c, uint16_t transid);
 
+/**
+  * @brief Send a Chunk to multiple Peers
+  *
+  * Send the same Chunk to n Peers (for example, when pushing a new chunk
+  * to the neighbours). The message is encoded only once, and it is
+  * sent to all the Peers with as few system calls as possible.
+  *
+  * @param[in] to array of n destination peers
+  * @param[in] n number of destination peers
+  * @param[in] c Chunk to send
+  * @param[in] transid the ID of transaction this send belongs to (if any)
+  * @param[out] res if not NULL, array of n results: for each peer, the number of bytes sent or -1 on error
+  * @return the number of peers the chunk has been sent to, <0 on error
+  */
+int sendChunkToPeers(struct nodeID **to, int n, const struct chunk *c, uint16_t transid, int *res);
+
+/**
+  * @brief Send a chunk to a peer, piggybacking the local BufferMap.
+  *
+  * Like sendChunk(), but if BufferMap trailers are enabled (see
+  * chunkDeliveryConfig()) the message also carries bmap, or its changes
+  * from the last BufferMap sent to the peer (sharing the sequence numbers
+  * of sendBufferMapDelta()), so that no separate signaling message is
+  * needed. Peers parsing the message with parseChunkMsg() ignore the
+  * trailer. If the encoded BufferMap does not fit in the configured
+  * size, it is not sent.
+  *
+  * @param[in] to destination peer
+  * @param[in] c chunk to send
+  * @param[in] transid transaction ID
+  * @param[in] bmap the local BufferMap (can be NULL)
+  * @return 0 on success, <0 on error
+  */
+int sendChunkPeer(struct peer *to, const struct chunk *c, uint16_t transid,
+                  const struct chunkID_set *bmap);
+
 /**
   * @brief Init the Chunk trading internals.
   *
@@ -49,6 +154,21 @@ int sendChunk(struct nodeID *to, const struct chunk *c, uint16_t transid);
   */
 int chunkDeliveryInit(struct nodeID *myID);
 
+/**
+  * @brief Configure the Chunk trading internals.
+  *
+  * @param config a configuration string: "piggyback=1" enables the
+  *        BufferMap trailers of sendChunkPeer() (disabled by default),
+  *        and "piggyback_max" is the maximum size in bytes of a trailer
+  *        (256 by default). "refcount=1" means that the chunks passed
+  *        to the send functions are reference counted (see chunk.h):
+  *        then, the messages kept by the network helper for
+  *        retransmissions reference their payloads instead of copying
+  *        them
+  * @return >= 0 on success, <0 on error
+  */
+int chunkDeliveryConfig(const char *config);
+
 
 #if 0
 /** 
@@ -27,6 +27,25 @@
   */
 int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len);
 
+/**
+  * Size of the encoded chunk header (the payload and the attributes follow it).
+  */
+#define CHUNK_HEADER_SIZE 20
+
+/**
+  * @brief Encode the header of a chunk.
+  *
+  * Encode only the header of a chunk. The encoding of the whole chunk
+  * is the header followed by the payload and the attributes, so they
+  * can be sent from their own buffers (see send_to_peer_iov()).
+  *
+  * @param[in] c Chunk to send
+  * @param[in] buff Buffer that will be filled with the header
+  * @param[in] buff_len length of the buffer (at least CHUNK_HEADER_SIZE)
+  * @return the length of the header on success, <0 on error
+  */
+int encodeChunkHeader(const struct chunk *c, uint8_t *buff, int buff_len);
+
 /**
   * @brief Decode the bit stream.
   *
@@ -38,3 +57,42 @@ int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len);
   * @return 0 on success, <0 on error
   */
 int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len);
+
+/**
+  * @brief Decode the bit stream in place.
+  *
+  * Like decodeChunk(), but nothing is allocated or copied: the data and
+  * attributes of the decoded chunk point inside buff, so the chunk is
+  * only valid as long as buff is, and must not be released. Use
+  * chunk_adopt() to turn it into a chunk owning its payload (for example,
+  * only after checking that the chunk is not a duplicate).
+  *
+  * @param[in] c Chunks that has been transmitted
+  * @param[in] buff Buffer which contain the bit stream to decode
+  * @param[in] buff_len length of the buffer that contain the bit stream
+  * @return the length of the decoded bit stream on success, <0 on error
+  */
+int decodeChunkView(struct chunk *c, uint8_t *buff, int buff_len);
+
+/**
+  * @brief Decode the bit stream without copying the chunk payload.
+  *
+  * Like decodeChunk(), but the payload of the decoded chunk references the
+  * memory of the received message instead of being copied into a new
+  * payload (if the payload is small compared to the message buffer, it is
+  * copied anyway, to avoid keeping a large buffer alive).
+  * The chunk holds its own reference to block; the caller keeps its
+  * reference, and should check chunk_data_refcount() before reusing block
+  * for receiving another message. The bytes preceding the chunk payload
+  * in buff (the already decoded header) are overwritten.
+  * The decoded chunk is reference counted (see chunk.h): it is released
+  * with chunk_release(), and can only be added to a chunk buffer created
+  * with "refcount=1".
+  *
+  * @param[in] c Chunks that has been transmitted
+  * @param[in] block Buffer allocated with chunk_data_alloc(), containing the received message
+  * @param[in] buff Pointer (inside block) to the bit stream to decode
+  * @param[in] buff_len length of the bit stream
+  * @return the length of the decoded bit stream on success, <0 on error
+  */
+int decodeChunkShared(struct chunk *c, uint8_t *block, const uint8_t *buff, int buff_len);
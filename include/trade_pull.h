@@ -0,0 +1,116 @@
+/** @file trade_pull.h
+ *
+ * @brief Chunk Trading Pull Engine.
+ *
+ * The pull engine pipelines the chunk requests sent to each peer: instead
+ * of waiting for the chunks requested with requestChunks() before sending
+ * the next request, up to a window of requests per peer can be pending.
+ * The window grows while the chunks are delivered (slow start, then one
+ * chunk per window), is halved when a request times out, and is bounded
+ * by the bandwidth-delay product measured for the peer (delivery rate
+ * times round trip time). Requests that miss their playout deadline are
+ * cancelled, and timed out requests are returned to the application, so
+ * that they can be reassigned to other peers.
+ *
+ */
+
+#ifndef TRADE_PULL_H
+#define TRADE_PULL_H
+
+#include <sys/time.h>
+
+#include "net_helper.h"
+#include "chunkidset.h"
+
+/**
+ * Opaque data type representing a pull engine
+ */
+struct pull_engine;
+
+/**
+ * @brief Allocate a pull engine.
+ *
+ * @param[in] config a configuration string: "window" is the initial
+ *            window and "window_max" its maximum (in chunks), "rto" is the
+ *            request timeout used for peers without an RTT estimation,
+ *            and "rto_min" and "rto_max" bound the timeouts (in ms).
+ * @return the pull engine, or NULL on error.
+ */
+struct pull_engine *pullInit(const char *config);
+
+/**
+ * @brief Get the number of chunks that can be requested to a peer.
+ *
+ * @param[in] pe the pull engine.
+ * @param[in] to the peer.
+ * @return the free slots in the window of the peer.
+ */
+int pullWindow(struct pull_engine *pe, const struct nodeID *to);
+
+/**
+ * @brief Request some chunks to a peer.
+ *
+ * Request to the peer (with a single requestChunks()) the chunks of
+ * cset which are not already pending, as long as the window of the peer
+ * is not full.
+ *
+ * @param[in] pe the pull engine.
+ * @param[in] to the peer.
+ * @param[in] cset the chunks to request, in order of preference.
+ * @param[in] deadline the time after which the chunks are useless, or
+ *            NULL.
+ * @return the number of requested chunks, <0 on error.
+ */
+int pullRequest(struct pull_engine *pe, struct nodeID *to, const struct chunkID_set *cset,
+                const struct timeval *deadline);
+
+/**
+ * @brief Notify the reception of a chunk.
+ *
+ * To be invoked for every chunk received from a peer (for example, after
+ * parseChunkMsg()): the window and the estimations of the peer are
+ * updated if the chunk had been requested to it.
+ *
+ * @param[in] pe the pull engine.
+ * @param[in] from the sender of the chunk.
+ * @param[in] chunk_id the ID of the chunk.
+ * @return 1 if the chunk had been requested to the peer, 0 otherwise.
+ */
+int pullReceived(struct pull_engine *pe, const struct nodeID *from, int chunk_id);
+
+/**
+ * @brief Handle the expired requests.
+ *
+ * Cancel the requests whose deadline passed, and the requests which
+ * timed out (shrinking the window of their peers). Should be invoked
+ * periodically.
+ *
+ * @param[in] pe the pull engine.
+ * @param[out] retry if not NULL, the timed out chunks which are still
+ *             useful are added to it (to be requested to other peers).
+ * @return the number of cancelled requests.
+ */
+int pullCheck(struct pull_engine *pe, struct chunkID_set *retry);
+
+/**
+ * @brief Forget a peer.
+ *
+ * Cancel the pending requests to a peer (for example, because it left
+ * the neighbourhood), and discard its estimations.
+ *
+ * @param[in] pe the pull engine.
+ * @param[in] id the peer.
+ * @param[out] retry if not NULL, the cancelled chunks which are still
+ *             useful are added to it.
+ * @return the number of cancelled requests.
+ */
+int pullRemovePeer(struct pull_engine *pe, const struct nodeID *id, struct chunkID_set *retry);
+
+/**
+ * @brief Free a pull engine.
+ *
+ * @param[in] pe the pull engine.
+ */
+void pullDestroy(struct pull_engine *pe);
+
+#endif /* TRADE_PULL_H */
@@ -20,8 +20,11 @@
   */
 enum signaling_type {
   sig_offer, sig_accept, sig_request, sig_deliver, sig_send_buffermap, sig_request_buffermap, sig_ack,
+  sig_send_buffermap_delta,
 };
 
+struct peer;
+
 /**
  * @brief Set current node identifier.
  *
@@ -50,6 +53,53 @@ int parseSignaling(uint8_t *buff, int buff_len, struct nodeID **owner_id,
                    struct chunkID_set **cset, int *max_deliver, uint16_t *trans_id,
                    enum signaling_type *sig_type);
 
+/**
+ * @brief Parse an incoming signaling message, storing its chunkIDs in an existing set.
+ *
+ * Like parseSignaling(), but the chunkIDs are stored in cset (which is
+ * emptied first, and reused across messages), so that no memory is
+ * allocated for parsing the message (except for owner_id).
+ *
+ * @param[in] buff containing the incoming message.
+ * @param[in] buff_len length of the buffer.
+ * @param[out] owner_id identifier of the node on which refer the message just received.
+ * @param[out] cset set filled with the chunkIDs (empty if the message does not contain any).
+ * @param[out] max_deliver deliver at most this number of Chunks.
+ * @param[out] trans_id transaction number associated with this message.
+ * @param[out] sig_type Type of signaling message.
+ * @return 1 on success, <0 on error.
+ */
+int parseSignalingInto(const uint8_t *buff, int buff_len, struct nodeID **owner_id,
+                       struct chunkID_set *cset, int *max_deliver, uint16_t *trans_id,
+                       enum signaling_type *sig_type);
+
+/**
+ * @brief Parse an incoming signaling message from a neighbour, updating its BufferMap.
+ *
+ * Like parseSignalingInto(), but the BufferMaps sent by sendBufferMapDelta()
+ * are applied to the bmap of the sending peer (so, sig_type is
+ * sig_send_buffermap for both whole BufferMaps and deltas, and cset
+ * contains the chunkIDs that have been received). If a delta does not
+ * apply to the BufferMap known for the peer (because a message has been
+ * lost), the whole BufferMap is requested to the peer, and 0 is returned.
+ * A BufferMap request from the peer causes the next sendBufferMapDelta()
+ * to it to send the whole BufferMap.
+ *
+ * @param[in] buff containing the incoming message.
+ * @param[in] buff_len length of the buffer.
+ * @param[in] from the peer which sent the message.
+ * @param[out] owner_id identifier of the node on which refer the message just received.
+ * @param[out] cset set filled with the chunkIDs in the message.
+ * @param[out] max_deliver deliver at most this number of Chunks.
+ * @param[out] trans_id transaction number associated with this message.
+ * @param[out] sig_type Type of signaling message.
+ * @return 1 on success, 0 if the message has been discarded, <0 on error.
+ */
+int parseSignalingPeer(const uint8_t *buff, int buff_len, struct peer *from,
+                       struct nodeID **owner_id, struct chunkID_set *cset,
+                       int *max_deliver, uint16_t *trans_id,
+                       enum signaling_type *sig_type);
+
 /**
  * @brief Request a set of chunks from a Peer.
  *
@@ -116,7 +166,26 @@ int acceptChunks(struct nodeID *to, struct chunkID_set *cset, uint16_t trans_id)
  * @param[in] trans_id transaction number associated with this send.
  * @return 1 Success, <0 on error.
  */
-int sendBufferMap(struct nodeID *to, const struct nodeID *owner, struct chunkID_set *bmap, int cb_size, uint16_t trans_id);
+int sendBufferMap(struct nodeID *to, const struct nodeID *owner, const struct chunkID_set *bmap, int cb_size, uint16_t trans_id);
+
+/**
+ * @brief Send our own BufferMap to a neighbour, as a delta from the previous one.
+ *
+ * Send only the chunkIDs which have been added to or removed from the
+ * BufferMap since the last one sent to the peer (remembered in the
+ * bmap_sent field of the peer, with its sequence number). The whole
+ * BufferMap is sent the first time, when the peer asked for it (see
+ * parseSignalingPeer()), or when it is smaller than the changes.
+ * The peer must use parseSignalingPeer() to receive it.
+ *
+ * @param[in] to the neighbour.
+ * @param[in] bmap the BufferMap to send.
+ * @param[in] cb_size the size of the chunk buffer (not the size of the buffer map sent, but that of the chunk buffer).
+ * @param[in] trans_id transaction number associated with this send.
+ * @return 1 Success, <0 on error.
+ */
+int sendBufferMapDelta(struct peer *to, const struct chunkID_set *bmap,
+                       int cb_size, uint16_t trans_id);
 
 /**
  * @brief Request a BufferMap to a Peer.
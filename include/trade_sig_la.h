@@ -14,7 +14,11 @@
   * 
   * Encode a sequence of information given as parameters and fills a buffer (given as parameter) with the corresponding bit stream.
   * The main reason to encode and return the bit stream is the possibility to either send directly a packet with the encoded bit stream, or 
-  * add this bit stream in piggybacking
+  * add this bit stream in piggybacking.
+  * The set is encoded as a bitmap or a list of IDs, unless it was created with
+  * "encoding=compact": then the most compact of the supported encodings (including
+  * the lengths of the runs of consecutive IDs, or the varint coded distances between
+  * IDs) is used. decodeChunkSignaling() accepts all of them.
   * 
   * @param[in] h set of ChunkIDs
   * @param[in] meta metadata associated to the ChunkID set
@@ -38,5 +42,22 @@ int encodeChunkSignaling(const struct chunkID_set *h, const void *meta, int meta
   */
 struct chunkID_set *decodeChunkSignaling(void **meta, int *meta_len, const uint8_t *buff, int buff_len);
 
+/**
+  * @brief Decode the bit stream into an existing chunk ID set.
+  *
+  * Like decodeChunkSignaling(), but the IDs are stored in a set provided
+  * by the caller (emptying it, and changing its type if needed), and the
+  * metadata are not copied. Since the memory of the set is reused, decoding
+  * a stream of messages in the same set does not allocate memory once the
+  * set is large enough (and the messages carry sets of the same type).
+  *
+  * @param[in] h set that will contain the decoded IDs
+  * @param[out] meta set to point to the metadata, in buff (NULL if there are no metadata)
+  * @param[out] meta_len length of the metadata
+  * @param[in] buff Buffer which contain the bit stream to decode
+  * @param[in] buff_len length of the buffer that contain the bit stream
+  * @return 1 if the bit stream contains a set, 0 if it contains only metadata (h is emptied), <0 on error
+  */
+int decodeChunkSignalingInto(struct chunkID_set *h, const uint8_t **meta, int *meta_len, const uint8_t *buff, int buff_len);
 
 #endif /* TRADE_SIG_LA_H */
@@ -0,0 +1,151 @@
+/** @file trade_trans.h
+ *
+ * @brief Chunk Trading Transactions.
+ *
+ * The transaction table keeps track of the signaling messages that are
+ * waiting for a reply (a request waiting for the chunks, an offer waiting
+ * for an accept, and so on), matching the replies through their
+ * transaction ID. Replies are used to estimate the round trip time to
+ * each peer (the srtt and rttvar fields of struct peer, which can be used
+ * by the scheduler), and transactions that are not answered in time are
+ * retransmitted, or reported to the application (which can move them to
+ * a different peer).
+ *
+ */
+
+#ifndef TRADE_TRANS_H
+#define TRADE_TRANS_H
+
+#include <sys/time.h>
+
+#include "net_helper.h"
+#include "chunkidset.h"
+#include "trade_sig_ha.h"
+
+struct peer;
+struct peerset;
+
+/**
+ * Opaque data type representing a transaction table
+ */
+struct trans_table;
+
+/**
+ * @brief Notification of an expired transaction.
+ *
+ * Invoked when a transaction has not been answered after all the
+ * retransmissions.
+ *
+ * @param[in] to the peer which did not answer.
+ * @param[in] trans_id the transaction ID.
+ * @param[in] type the signaling message of the transaction.
+ * @param[in] cset the chunk IDs of the transaction (they can be changed
+ *            before moving the transaction to a different peer).
+ * @param[in] opaque the pointer passed to transSend().
+ * @return the peer the transaction has to be sent to (with the same
+ *         transaction ID), or NULL to drop the transaction.
+ */
+typedef struct nodeID *(*transTimeoutCallback)(const struct nodeID *to, uint16_t trans_id,
+                                               enum signaling_type type,
+                                               struct chunkID_set *cset, void *opaque);
+
+/**
+ * @brief Allocate a transaction table.
+ *
+ * @param[in] ps the peerset containing the peers whose round trip times
+ *            are estimated (can be NULL).
+ * @param[in] config a configuration string: "rto" is the timeout used for
+ *            peers without an RTT estimation, "rto_min" and "rto_max"
+ *            bound the timeouts (all of them in ms), and "retries" is the
+ *            number of retransmissions before a transaction expires.
+ * @param[in] cb function invoked when a transaction expires (can be NULL).
+ * @return the transaction table, or NULL on error.
+ */
+struct trans_table *transInit(struct peerset *ps, const char *config, transTimeoutCallback cb);
+
+/**
+ * @brief Send a signaling message and track it.
+ *
+ * Allocate a transaction ID and send the message with requestChunks(),
+ * offerChunks(), acceptChunks() or sendBufferMap() (depending on type).
+ *
+ * @param[in] t the transaction table.
+ * @param[in] type sig_request, sig_offer, sig_accept or sig_send_buffermap.
+ * @param[in] to the destination peer.
+ * @param[in] cset the chunk IDs (copied in the table).
+ * @param[in] max_deliver max_deliver (or cb_size, for a buffermap).
+ * @param[in] opaque pointer passed to the timeout callback and transComplete().
+ * @return the transaction ID (>= 0) on success, <0 on error.
+ */
+int transSend(struct trans_table *t, enum signaling_type type, struct nodeID *to,
+              const struct chunkID_set *cset, int max_deliver, void *opaque);
+
+/**
+ * @brief Notify the reception of a reply.
+ *
+ * Close the transaction trans_id with peer from, updating the RTT
+ * estimation of the peer (replies to retransmitted messages are not
+ * used, since it is not known which transmission they answer).
+ *
+ * @param[in] t the transaction table.
+ * @param[in] from the sender of the reply.
+ * @param[in] trans_id the transaction ID of the reply.
+ * @param[out] opaque if not NULL, the pointer passed to transSend().
+ * @return 1 if the reply closed a transaction, 0 if it is unknown (for
+ *         example, late), <0 on error.
+ */
+int transComplete(struct trans_table *t, const struct nodeID *from, uint16_t trans_id, void **opaque);
+
+/**
+ * @brief Handle the expired transactions.
+ *
+ * Retransmit the transactions whose timeout expired (doubling the
+ * timeout each time), or invoke the timeout callback if they have no
+ * retransmissions left. Should be invoked periodically, or when the time
+ * returned by transNextTimeout() elapsed.
+ *
+ * @param[in] t the transaction table.
+ * @return the number of expired transactions.
+ */
+int transCheck(struct trans_table *t);
+
+/**
+ * @brief Get the time until the next timeout.
+ *
+ * @param[in] t the transaction table.
+ * @param[out] tv the time until the first transaction expires (suitable
+ *             for wait4data()).
+ * @return 1 if there are pending transactions, 0 otherwise (tv is not set).
+ */
+int transNextTimeout(const struct trans_table *t, struct timeval *tv);
+
+/**
+ * @brief Get the number of pending transactions.
+ *
+ * @param[in] t the transaction table.
+ * @return the number of transactions waiting for a reply.
+ */
+int transPending(const struct trans_table *t);
+
+/**
+ * @brief Evaluate a peer according to its round trip time.
+ *
+ * A peerEvaluateFunction (see scheduler_la.h) preferring the peers that
+ * answer faster: the value is the inverse of the peer timeout (in
+ * seconds), and peers without an RTT estimation are valued 1.
+ *
+ * @param[in] p the peer.
+ * @return the value of the peer.
+ */
+double transEvaluateRTT(struct peer **p);
+
+/**
+ * @brief Free a transaction table.
+ *
+ * Pending transactions are dropped without invoking the callback.
+ *
+ * @param[in] t the transaction table.
+ */
+void transDestroy(struct trans_table *t);
+
+#endif /* TRADE_TRANS_H */
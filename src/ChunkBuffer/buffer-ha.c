@@ -6,26 +6,101 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "chunkbuffer.h"
+#include "chunkidset.h"
+#include "buffer_private.h"
 
 const struct chunk *cb_get_chunk(const struct chunk_buffer *cb, int id)
 {
-  int i, n;
-  const struct chunk *buffer;
-
-  buffer = cb_get_chunks(cb, &n);
-  if (buffer == NULL) {
+  if (cb->num_chunks == 0 || id < cb->first_id || id > cb->last_id ||
+      cb_slot_id(cb, id) != id) {
     return NULL;
   }
+  if (cb->index) {
+    cb_store_view(cb->store, &cb->index[cb_pos(cb, id)], cb->view);
+
+    return cb->view;
+  }
+
+  return cb_slot(cb, id);
+}
 
-  for (i = 0; i < n; i++) {
-    if (buffer[i].id == id) {
-      return &buffer[i];
+/* Add the IDs in [from, to] to the set */
+static int missing_add(struct chunkID_set *missing, int64_t from, int64_t to)
+{
+  int64_t id;
+
+  for (id = from; id <= to; id++) {
+    if (chunkID_set_add_chunk(missing, id) < 0) {
+      return -1;
     }
   }
 
-  return NULL;
+  return 0;
+}
+
+int cb_get_missingInto(const struct chunk_buffer *cb, struct chunkID_set *missing, int from, int to)
+{
+  int64_t lo, hi, id;
+
+  chunkID_set_clear(missing, 0);
+  if (to < from) {
+    return 0;
+  }
+  if ((int64_t)to - from + 1 > CHUNKID_SET_MAX_SPAN) {
+    return -1;
+  }
+  if (cb->num_chunks == 0) {
+    return missing_add(missing, from, to) < 0 ? -1 : chunkID_set_size(missing);
+  }
+
+  /*
+   * Only the IDs in [first_id, last_id] can be in the ring: the ones
+   * below the window and the unseen tail are missing without looking
+   */
+  lo = from > cb->first_id ? from : cb->first_id;
+  hi = to < cb->last_id ? to : cb->last_id;
+  if (lo > hi) {
+    return missing_add(missing, from, to) < 0 ? -1 : chunkID_set_size(missing);
+  }
+  if (missing_add(missing, from, lo - 1) < 0) {
+    return -1;
+  }
+  for (id = lo; id <= hi; id++) {
+    if (cb_slot_id(cb, id) != id && chunkID_set_add_chunk(missing, id) < 0) {
+      return -1;
+    }
+  }
+  if (missing_add(missing, hi + 1, to) < 0) {
+    return -1;
+  }
+
+  return chunkID_set_size(missing);
+}
+
+struct chunkID_set *cb_get_missing(const struct chunk_buffer *cb, int from, int to)
+{
+  struct chunkID_set *missing;
+  char cfg[32];
+  int64_t span = (int64_t)to - from + 1;
+
+  if (span <= 0 || span > CHUNKID_SET_MAX_SPAN) {
+    return NULL;
+  }
+  sprintf(cfg, "type=bitmap,size=%d", (int)span);
+  missing = chunkID_set_init(cfg);
+  if (missing == NULL) {
+    return NULL;
+  }
+  if (cb_get_missingInto(cb, missing, from, to) < 0) {
+    chunkID_set_free(missing);
+
+    return NULL;
+  }
+
+  return missing;
 }
@@ -0,0 +1,313 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+/*
+ * Disk-backed storage for the chunks of a buffer ("store=mmap").
+ * Payloads and attributes are appended to memory mapped segment files,
+ * and the buffer only keeps a compact record (segment, offset and sizes)
+ * for each chunk: the chunks returned by cb_get_chunk() are built when
+ * needed, and point into the mapping (so, nothing is copied). Every
+ * segment is wrapped as a chunk payload, and each record is preceded by
+ * the owner pointer of a slice, so that references to the stored chunks
+ * can be taken: a segment is unmapped when all its chunks have been
+ * discarded and nobody holds a reference to them.
+ * The segment files are unlinked as soon as they are mapped, so nothing
+ * is left on the disk when the buffer is destroyed (or the peer crashes).
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "chunk.h"
+#include "chunkbuffer.h"
+#include "buffer_private.h"
+
+#define RECORD_ALIGN 8
+
+struct cb_segment {
+  unsigned int seq;	// sequence number, referenced by the records
+  uint8_t *map;
+  size_t size;
+  uint8_t *data;	// the mapping, wrapped as a chunk payload
+  int used;		// bytes of data already filled
+  int n_chunks;		// buffered chunks stored in the segment
+};
+
+struct cb_store {
+  char *path;
+  size_t segment_size;
+  int max_segments;	// 0 if unlimited
+  int n_segments;
+  int size;
+  struct cb_segment **segments;	// oldest first, the last one is being filled
+  unsigned int counter;
+};
+
+static void segment_unmap(void *opaque)
+{
+  struct cb_segment *seg = opaque;
+
+#ifndef _WIN32
+  munmap(seg->map, seg->size);
+#endif
+  free(seg);
+}
+
+static struct cb_segment *segment_open(struct cb_store *st)
+{
+#ifndef _WIN32
+  struct cb_segment *seg;
+  char *name;
+  int fd;
+
+  name = malloc(strlen(st->path) + 64);
+  seg = malloc(sizeof(struct cb_segment));
+  if (name == NULL || seg == NULL) {
+    free(name);
+    free(seg);
+
+    return NULL;
+  }
+  seg->seq = st->counter++;
+  sprintf(name, "%s/grapes-cb-%d-%u", st->path, (int)getpid(), seg->seq);
+  fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create chunk segment %s\n", name);
+    free(name);
+    free(seg);
+
+    return NULL;
+  }
+  seg->size = st->segment_size;
+  seg->map = MAP_FAILED;
+  if (ftruncate(fd, seg->size) == 0) {
+    seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  unlink(name);
+  close(fd);
+  free(name);
+  if (seg->map == MAP_FAILED) {
+    fprintf(stderr, "Cannot map chunk segment (%lu bytes)\n", (unsigned long)seg->size);
+    free(seg);
+
+    return NULL;
+  }
+  seg->data = chunk_data_wrap(seg->map, seg->size, segment_unmap, seg);
+  if (seg->data == NULL) {
+    segment_unmap(seg);
+
+    return NULL;
+  }
+  seg->used = 0;
+  seg->n_chunks = 0;
+
+  return seg;
+#else
+  fprintf(stderr, "Memory mapped chunk store not supported\n");
+
+  return NULL;
+#endif
+}
+
+/* Forget a segment: it is unmapped when its last slice is released */
+static void segment_close(struct cb_store *st, int i)
+{
+  chunk_data_unref(st->segments[i]->data);
+  memmove(&st->segments[i], &st->segments[i + 1], sizeof(struct cb_segment *) * (st->n_segments - i - 1));
+  st->n_segments--;
+}
+
+/* Position of the segment of a record in segments[], -1 if none */
+static int segment_find(const struct cb_store *st, const struct cb_record *r)
+{
+  int i;
+
+  if (r->offset == 0) {
+    return -1;
+  }
+
+  for (i = st->n_segments - 1; i >= 0; i--) {
+    if (st->segments[i]->seq == r->segment) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+struct cb_store *cb_store_init(const char *path, size_t segment_size, int max_segments)
+{
+  struct cb_store *st;
+
+  if (segment_size <= RECORD_ALIGN || segment_size > INT_MAX) {
+    return NULL;
+  }
+  st = malloc(sizeof(struct cb_store));
+  if (st == NULL) {
+    return NULL;
+  }
+  memset(st, 0, sizeof(struct cb_store));
+  st->path = strdup(path);
+  st->size = max_segments > 0 ? max_segments : 4;
+  st->segments = malloc(sizeof(struct cb_segment *) * st->size);
+  if (st->path == NULL || st->segments == NULL) {
+    free(st->path);
+    free(st->segments);
+    free(st);
+
+    return NULL;
+  }
+  st->segment_size = segment_size;
+  st->max_segments = max_segments;
+
+  return st;
+}
+
+static int align(int n)
+{
+  return (n + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+/* Offset of the attributes of a record, which follow the payload */
+static unsigned int attributes_offset(const struct cb_record *r)
+{
+  return r->size ? align(r->offset + r->size) + sizeof(void *) : r->offset;
+}
+
+static unsigned int record_write(struct cb_segment *seg, const uint8_t *src, int size)
+{
+  unsigned int res = seg->used + sizeof(void *);
+
+  /*
+   * Each record is preceded by the owner pointer: write it by taking a
+   * slice, whose reference is not needed (the segment holds its own)
+   */
+  chunk_data_unref(chunk_data_slice(seg->data, res));
+  memcpy(seg->data + res, src, size);
+  seg->used = align(seg->used + sizeof(void *) + size);
+
+  return res;
+}
+
+/*
+ * Copy the payload and the attributes of c in the current segment (opening
+ * a new one if needed), and store their position in r.
+ */
+int cb_store_append(struct cb_store *st, const struct chunk *c, struct cb_record *r)
+{
+  struct cb_segment *seg = st->n_segments ? st->segments[st->n_segments - 1] : NULL;
+  int needed;
+
+  if (c->size == 0 && c->attributes_size == 0) {
+    r->offset = 0;
+
+    return 0;
+  }
+  needed = c->size ? align(sizeof(void *) + c->size) : 0;
+  needed += c->attributes_size ? align(sizeof(void *) + c->attributes_size) : 0;
+  if (needed > (int)st->segment_size - RECORD_ALIGN) {
+    return CB_STORE_ERROR;
+  }
+  if (seg && seg->used + needed > chunk_data_size(seg->data)) {
+    if (seg->n_chunks == 0 && chunk_data_refcount(seg->data) == 1) {
+      seg->used = 0;
+    } else {
+      if (seg->n_chunks == 0) {
+        segment_close(st, st->n_segments - 1);
+      }
+      seg = NULL;
+    }
+  }
+  if (seg == NULL) {
+    if (st->max_segments && st->n_segments == st->max_segments) {
+      return CB_STORE_FULL;
+    }
+    if (st->n_segments == st->size) {
+      struct cb_segment **s = realloc(st->segments, sizeof(struct cb_segment *) * st->size * 2);
+
+      if (s == NULL) {
+        return CB_STORE_ERROR;
+      }
+      st->segments = s;
+      st->size *= 2;
+    }
+    seg = segment_open(st);
+    if (seg == NULL) {
+      return CB_STORE_ERROR;
+    }
+    st->segments[st->n_segments++] = seg;
+  }
+
+  r->segment = seg->seq;
+  r->offset = seg->used + sizeof(void *);
+  if (c->size) {
+    record_write(seg, c->data, c->size);
+  }
+  if (c->attributes_size) {
+    record_write(seg, c->attributes, c->attributes_size);
+  }
+  seg->n_chunks++;
+
+  return 0;
+}
+
+void cb_store_view(const struct cb_store *st, const struct cb_record *r, struct chunk *c)
+{
+  int i = segment_find(st, r);
+
+  c->id = r->id;
+  c->timestamp = r->timestamp;
+  c->size = r->size;
+  c->attributes_size = r->attributes_size;
+  c->data = NULL;
+  c->attributes = NULL;
+  if (i >= 0) {
+    uint8_t *data = st->segments[i]->data;
+
+    c->data = r->size ? data + r->offset : NULL;
+    c->attributes = r->attributes_size ? data + attributes_offset(r) : NULL;
+  }
+}
+
+int cb_store_segments(const struct cb_store *st)
+{
+  return st->n_segments;
+}
+
+int cb_store_oldest(const struct cb_store *st, const struct cb_record *r)
+{
+  return r->offset && st->n_segments && st->segments[0]->seq == r->segment;
+}
+
+void cb_store_drop(struct cb_store *st, const struct cb_record *r)
+{
+  int i = segment_find(st, r);
+
+  if (i < 0) {
+    return;
+  }
+  if (--st->segments[i]->n_chunks == 0 && i != st->n_segments - 1) {
+    segment_close(st, i);
+  }
+}
+
+void cb_store_free(struct cb_store *st)
+{
+  while (st->n_segments) {
+    segment_close(st, st->n_segments - 1);
+  }
+  free(st->segments);
+  free(st->path);
+  free(st);
+}
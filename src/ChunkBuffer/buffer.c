@@ -6,80 +6,469 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "chunkbuffer.h"
+#include "chunkidset.h"
+#include "chunkiser_attrib.h"
+#include "buffer_private.h"
 #include "config.h"
 
-struct chunk_buffer {
-  int size;
-  int num_chunks;
-  struct chunk *buffer;
-};
+#define DEFAULT_BUDGET_SIZE 4096
+#define DEFAULT_SEGMENT_SIZE "256M"
+#define DEFAULT_STORE_PATH "/tmp"
 
-static void insert_sort(struct chunk *b, int size)
+/* Release the payload and the attributes of a chunk added by the user */
+static void chunk_data_free(const struct chunk_buffer *cb, struct chunk *c)
 {
-  int i, j;
-  struct chunk tmp;
-
-  for(i = 1; i < size; i++) {
-    tmp = b[i];
-    j = i - 1;
-    while(j >= 0 && tmp.id < b[j].id) {
-      b[j + 1] = b[j];
-      j = j - 1;
-    }
-    b[j + 1] = tmp;
+  if (cb->refcount) {
+    chunk_release(c);
+  } else {
+    free(c->data);
+    c->data = NULL;
+    free(c->attributes);
+    c->attributes = NULL;
   }
 }
 
-static void chunk_free(struct chunk *c)
+static void chunk_free(const struct chunk_buffer *cb, struct chunk *c)
 {
+    chunk_data_free(cb, c);
+    c->id = -1;
+}
+
+/* Make a copy of a chunk view with malloc()ed payload and attributes */
+static int chunk_copy(struct chunk *c)
+{
+  uint8_t *data = c->data;
+  void *attributes = c->attributes;
+
+  c->data = malloc(c->size);
+  c->attributes = c->attributes_size > 0 ? malloc(c->attributes_size) : NULL;
+  if (c->data == NULL || (c->attributes_size > 0 && c->attributes == NULL)) {
     free(c->data);
-    c->data = NULL;
     free(c->attributes);
-    c->attributes = NULL;
-    c->id = -1;
+    c->data = data;
+    c->attributes = attributes;
+
+    return -1;
+  }
+  memcpy(c->data, data, c->size);
+  if (c->attributes_size > 0) {
+    memcpy(c->attributes, attributes, c->attributes_size);
+  }
+
+  return 0;
+}
+
+static int chunk_priority(const struct chunk *c)
+{
+  if (chunk_attributes_chunker_verify(c->attributes, c->attributes_size)) {
+    return ((const struct chunk_attributes_chunker *)c->attributes)->priority;
+  }
+
+  return 0;
+}
+
+/* What the eviction order of a chunk depends on */
+struct evict_key {
+  uint64_t timestamp;
+  int id;
+  int priority;
+};
+
+static void chunk_key(const struct chunk_buffer *cb, const struct chunk *c, struct evict_key *k)
+{
+  k->timestamp = c->timestamp;
+  k->id = c->id;
+  k->priority = cb->policy == CB_POLICY_PRIORITY ? chunk_priority(c) : 0;
 }
 
-static int remove_oldest_chunk(struct chunk_buffer *cb, int id, uint64_t ts)
+static void slot_key(const struct chunk_buffer *cb, int slot, struct evict_key *k)
 {
-  int i, min, pos_min;
+  if (cb->index) {
+    k->timestamp = cb->index[slot].timestamp;
+    k->id = cb->index[slot].id;
+    k->priority = cb->index[slot].priority;
+  } else {
+    chunk_key(cb, &cb->buffer[slot], k);
+  }
+}
 
-  if (cb->buffer[0].id == id) {
-    return E_CB_DUPLICATE;
+/* Payload and attributes bytes of the chunk in a slot */
+static size_t slot_bytes(const struct chunk_buffer *cb, int slot)
+{
+  if (cb->index) {
+    return cb->index[slot].size + cb->index[slot].attributes_size;
   }
-  min = cb->buffer[0].id; pos_min = 0;
-  for (i = 1; i < cb->num_chunks; i++) {
-    if (cb->buffer[i].id == id) {
-      return E_CB_DUPLICATE;
+
+  return cb->buffer[slot].size + cb->buffer[slot].attributes_size;
+}
+
+/* < 0 if chunk a has to be evicted before chunk b */
+static int evict_cmp(const struct chunk_buffer *cb, const struct evict_key *a, const struct evict_key *b)
+{
+  /* Higher values mean less important chunks (I frames have priority 1) */
+  if (cb->policy == CB_POLICY_PRIORITY && a->priority != b->priority) {
+    return b->priority - a->priority;
+  }
+  if (a->timestamp != b->timestamp) {
+    return a->timestamp < b->timestamp ? -1 : 1;
+  }
+
+  return a->id - b->id;
+}
+
+static int heap_less(const struct chunk_buffer *cb, int i, int j)
+{
+  struct evict_key a, b;
+
+  slot_key(cb, cb->heap[i], &a);
+  slot_key(cb, cb->heap[j], &b);
+
+  return evict_cmp(cb, &a, &b) < 0;
+}
+
+static void heap_swap(struct chunk_buffer *cb, int i, int j)
+{
+  int tmp;
+
+  tmp = cb->heap[i];
+  cb->heap[i] = cb->heap[j];
+  cb->heap[j] = tmp;
+  cb->heap_pos[cb->heap[i]] = i;
+  cb->heap_pos[cb->heap[j]] = j;
+}
+
+static int heap_up(struct chunk_buffer *cb, int i)
+{
+  while (i > 0 && heap_less(cb, i, (i - 1) / 2)) {
+    heap_swap(cb, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+
+  return i;
+}
+
+static void heap_down(struct chunk_buffer *cb, int i)
+{
+  while (1) {
+    int l = 2 * i + 1;
+    int m = i;
+
+    if (l < cb->heap_n && heap_less(cb, l, m)) {
+      m = l;
     }
-    if (cb->buffer[i].id < min) {
-      min = cb->buffer[i].id;
-      pos_min = i;
+    if (l + 1 < cb->heap_n && heap_less(cb, l + 1, m)) {
+      m = l + 1;
     }
+    if (m == i) {
+      return;
+    }
+    heap_swap(cb, i, m);
+    i = m;
   }
-  if (min < id) {
-    chunk_free(&cb->buffer[pos_min]);
-    cb->num_chunks--;
+}
 
-    return pos_min;
+static void heap_insert(struct chunk_buffer *cb, int slot)
+{
+  cb->heap[cb->heap_n] = slot;
+  cb->heap_pos[slot] = cb->heap_n;
+  heap_up(cb, cb->heap_n++);
+}
+
+static void heap_remove(struct chunk_buffer *cb, int slot)
+{
+  int i = cb->heap_pos[slot];
+
+  cb->heap_pos[slot] = -1;
+  if (i != --cb->heap_n) {
+    cb->heap[i] = cb->heap[cb->heap_n];
+    cb->heap_pos[cb->heap[i]] = i;
+    heap_down(cb, heap_up(cb, i));
   }
-  // check for ID looparound and other anomalies
-  if (cb->buffer[pos_min].timestamp < ts) {
-    cb_clear(cb);
+}
+
+/*
+ * Store a chunk (or, with a store, its record r) in its free slot (its ID
+ * has already been added to the buffermap)
+ */
+static void chunk_store(struct chunk_buffer *cb, const struct chunk *c, const struct cb_record *r)
+{
+  int slot = cb_pos(cb, c->id);
+
+  if (cb->index) {
+    cb->index[slot] = *r;
+  } else {
+    cb->buffer[slot] = *c;
+  }
+  cb->bytes += c->size + c->attributes_size;
+  if (cb->heap) {
+    heap_insert(cb, slot);
+  }
+  if (cb->num_chunks++ == 0) {
+    cb->first_id = cb->last_id = c->id;
+  } else if (c->id < cb->first_id) {
+    cb->first_id = c->id;
+  } else if (c->id > cb->last_id) {
+    cb->last_id = c->id;
+  }
+  cb->list->valid = 0;
+}
+
+/* Free a slot (the caller takes care of first_id, last_id and bmap) */
+static void chunk_drop(struct chunk_buffer *cb, int slot)
+{
+  if (cb->heap) {
+    heap_remove(cb, slot);
+  }
+  cb->bytes -= slot_bytes(cb, slot);
+  if (cb->index) {
+    cb_store_drop(cb->store, &cb->index[slot]);
+    cb->index[slot].id = -1;
+  } else {
+    chunk_free(cb, &cb->buffer[slot]);
+  }
+  cb->num_chunks--;
+  cb->list->valid = 0;
+}
+
+/* Drop all the chunks with ID smaller than "id" */
+static void remove_older_chunks(struct chunk_buffer *cb, int id)
+{
+  int i, last;
+
+  last = id - 1 < cb->last_id ? id - 1 : cb->last_id;
+  for (i = cb->first_id; i <= last && cb->num_chunks; i++) {
+    if (cb_slot_id(cb, i) == i) {
+      chunk_drop(cb, cb_pos(cb, i));
+    }
+  }
+  if (cb->num_chunks) {
+    for (cb->first_id = id; cb_slot_id(cb, cb->first_id) != cb->first_id; cb->first_id++);
+  }
+  /* The evicted chunks are the oldest ones: keep the newest IDs only */
+  chunkID_set_trim(cb->bmap, cb->num_chunks);
+}
+
+/* Drop a single chunk, wherever it is in the window */
+static void remove_chunk(struct chunk_buffer *cb, int id)
+{
+  chunk_drop(cb, cb_pos(cb, id));
+  chunkID_set_remove_chunk(cb->bmap, id);
+  if (cb->num_chunks == 0) {
+    return;
+  }
+  if (id == cb->first_id) {
+    for (cb->first_id = id + 1; cb_slot_id(cb, cb->first_id) != cb->first_id; cb->first_id++);
+  } else if (id == cb->last_id) {
+    for (cb->last_id = id - 1; cb_slot_id(cb, cb->last_id) != cb->last_id; cb->last_id--);
+  }
+}
+
+/*
+ * Bytes (at least "needed", if possible) of the chunks in the i-th heap
+ * subtree which are evicted before c, not counting the ones with ID
+ * smaller than min_id
+ */
+static size_t evictable_bytes(const struct chunk_buffer *cb, int i, const struct evict_key *c,
+                              int min_id, size_t needed)
+{
+  struct evict_key s;
+  size_t res = 0;
+
+  if (i >= cb->heap_n) {
+    return 0;
+  }
+  slot_key(cb, cb->heap[i], &s);
+  if (evict_cmp(cb, &s, c) >= 0) {
+    /* The whole subtree follows c */
+    return 0;
+  }
+  if (s.id >= min_id) {
+    res = slot_bytes(cb, cb->heap[i]);
+  }
+  if (res < needed) {
+    res += evictable_bytes(cb, 2 * i + 1, c, min_id, needed - res);
+  }
+  if (res < needed) {
+    res += evictable_bytes(cb, 2 * i + 2, c, min_id, needed - res);
+  }
+
+  return res;
+}
+
+/*
+ * Check, without touching the buffer, if c fits in the byte budget once
+ * the chunks with ID smaller than min_id are dropped, and the chunks to
+ * be evicted before c are evicted
+ */
+static int room_check(const struct chunk_buffer *cb, const struct chunk *c, int min_id)
+{
+  size_t needed = c->size + c->attributes_size;
+  size_t bytes = cb->bytes;
+  struct evict_key k;
+  int i;
+
+  if (cb->max_bytes == 0) {
     return 0;
   }
-  return E_CB_OLD;
+  if (needed > cb->max_bytes) {
+    return E_CB_FULL;
+  }
+  for (i = cb->first_id; cb->num_chunks && i < min_id && i <= cb->last_id; i++) {
+    if (cb_slot_id(cb, i) == i) {
+      bytes -= slot_bytes(cb, cb_pos(cb, i));
+    }
+  }
+  if (bytes + needed <= cb->max_bytes) {
+    return 0;
+  }
+  needed = bytes + needed - cb->max_bytes;
+  chunk_key(cb, c, &k);
+
+  return evictable_bytes(cb, 0, &k, min_id, needed) >= needed ? 0 : E_CB_FULL;
+}
+
+/*
+ * Evict chunks according to the policy, until c fits in the byte budget
+ * (room_check() tells if this is possible)
+ */
+static int make_room(struct chunk_buffer *cb, const struct chunk *c)
+{
+  size_t needed = c->size + c->attributes_size;
+  struct evict_key k, victim;
+
+  if (cb->max_bytes == 0) {
+    return 0;
+  }
+  chunk_key(cb, c, &k);
+  while (cb->bytes + needed > cb->max_bytes) {
+    slot_key(cb, cb->heap[0], &victim);
+    if (evict_cmp(cb, &k, &victim) < 0) {
+      return E_CB_FULL;
+    }
+    remove_chunk(cb, victim.id);
+  }
+
+  return 0;
+}
+
+/* Drop the chunks stored in the oldest segment, so that it can be recycled */
+static int evict_segment(struct chunk_buffer *cb)
+{
+  int i, n = 0, segments = cb_store_segments(cb->store);
+
+  /* When its last chunk is dropped, the segment is closed */
+  for (i = cb->first_id; cb->num_chunks && i <= cb->last_id &&
+                         cb_store_segments(cb->store) == segments; i++) {
+    if (cb_slot_id(cb, i) == i && cb_store_oldest(cb->store, &cb->index[cb_pos(cb, i)])) {
+      remove_chunk(cb, i);
+      n++;
+    }
+  }
+
+  return n;
+}
+
+/*
+ * Copy the payload and attributes of c to the disk-backed store, and
+ * describe the copy in r (the caller still owns the original ones)
+ */
+static int store_append(struct chunk_buffer *cb, const struct chunk *c, struct cb_record *r)
+{
+  int res;
+
+  r->timestamp = c->timestamp;
+  r->id = c->id;
+  r->size = c->size;
+  r->attributes_size = c->attributes_size;
+  r->priority = chunk_priority(c);
+  while ((res = cb_store_append(cb->store, c, r)) == CB_STORE_FULL) {
+    if (evict_segment(cb) == 0) {
+      return E_CB_FULL;
+    }
+  }
+
+  return res < 0 ? E_CB_FULL : 0;
+}
+
+/* Parse a size such as "64M"; return < 0 if str is not a valid size */
+static int bytes_parse(const char *str, size_t *bytes)
+{
+  char *end;
+  unsigned long res;
+  int shift = 0;
+
+  if (*str < '0' || *str > '9') {
+    return -1;
+  }
+  errno = 0;
+  res = strtoul(str, &end, 10);
+  if (errno == ERANGE) {
+    return -1;
+  }
+  switch (*end) {
+    case '\0':
+      break;
+    case 'k':
+    case 'K':
+      shift = 10;
+      break;
+    case 'm':
+    case 'M':
+      shift = 20;
+      break;
+    case 'g':
+    case 'G':
+      shift = 30;
+      break;
+    default:
+      return -1;
+  }
+  if (shift && *++end != '\0') {
+    return -1;
+  }
+  if (res > SIZE_MAX >> shift) {
+    return -1;
+  }
+  *bytes = (size_t)res << shift;
+
+  return 0;
+}
+
+static void buffer_free(struct chunk_buffer *cb)
+{
+  if (cb->list) {
+    free(cb->list->chunks);
+  }
+  free(cb->list);
+  free(cb->index);
+  free(cb->view);
+  if (cb->bmap) {
+    chunkID_set_free(cb->bmap);
+  }
+  free(cb->heap);
+  free(cb->heap_pos);
+  if (cb->store) {
+    cb_store_free(cb->store);
+  }
+  free(cb->buffer);
+  free(cb);
 }
 
 struct chunk_buffer *cb_init(const char *config)
 {
   struct tag *cfg_tags;
   struct chunk_buffer *cb;
-  int res, i;
+  const char *str;
+  char bmap_cfg[32];
+  int res, i, refcount = 0, segments = 0;
 
   cb = malloc(sizeof(struct chunk_buffer));
   if (cb == NULL) {
@@ -93,82 +482,260 @@ struct chunk_buffer *cb_init(const char *config)
     return NULL;
   }
   res = config_value_int(cfg_tags, "size", &cb->size);
-  if (!res) {
+  str = config_value_str(cfg_tags, "bytes");
+  if (str) {
+    if (bytes_parse(str, &cb->max_bytes) < 0) {
+      res = 0;
+    } else if (!res) {
+      cb->size = DEFAULT_BUDGET_SIZE;
+      res = 1;
+    }
+  }
+  config_value_int(cfg_tags, "refcount", &refcount);
+  cb->refcount = refcount;
+  cb->policy = CB_POLICY_DEADLINE;
+  str = config_value_str(cfg_tags, "policy");
+  if (str && !strcmp(str, "priority")) {
+    cb->policy = CB_POLICY_PRIORITY;
+  } else if (str && strcmp(str, "deadline")) {
+    res = 0;
+  }
+  str = config_value_str(cfg_tags, "store");
+  if (str && !strcmp(str, "mmap")) {
+    const char *path = config_value_str(cfg_tags, "path");
+    const char *segment = config_value_str(cfg_tags, "segment");
+    size_t segment_size;
+
+    config_value_int(cfg_tags, "segments", &segments);
+    if (bytes_parse(segment ? segment : DEFAULT_SEGMENT_SIZE, &segment_size) < 0) {
+      res = 0;
+    } else {
+      cb->store = cb_store_init(path ? path : DEFAULT_STORE_PATH, segment_size, segments);
+      if (cb->store == NULL) {
+        res = 0;
+      }
+    }
+  } else if (str && strcmp(str, "memory")) {
+    res = 0;
+  }
+  free(cfg_tags);
+  if (!res || cb->size <= 0 || cb->size > CHUNKID_SET_MAX_SPAN) {
+    if (cb->store) {
+      cb_store_free(cb->store);
+    }
     free(cb);
-    free(cfg_tags);
 
     return NULL;
   }
-  free(cfg_tags);
 
-  cb->buffer = malloc(sizeof(struct chunk) * cb->size);
-  if (cb->buffer == NULL) {
-    free(cb);
+  cb->list = malloc(sizeof(struct chunk_list));
+  if (cb->list == NULL) {
+    buffer_free(cb);
     return NULL;
   }
-  memset(cb->buffer, 0, cb->size);
-  for (i = 0; i < cb->size; i++) {
-    cb->buffer[i].id = -1;
+  memset(cb->list, 0, sizeof(struct chunk_list));
+  if (cb->store) {
+    /* The chunks are described by compact records */
+    cb->index = malloc(sizeof(struct cb_record) * cb->size);
+    cb->view = malloc(sizeof(struct chunk));
+    if (cb->index == NULL || cb->view == NULL) {
+      buffer_free(cb);
+      return NULL;
+    }
+    memset(cb->index, 0, sizeof(struct cb_record) * cb->size);
+    for (i = 0; i < cb->size; i++) {
+      cb->index[i].id = -1;
+    }
+  } else {
+    cb->buffer = malloc(sizeof(struct chunk) * cb->size);
+    if (cb->buffer == NULL) {
+      buffer_free(cb);
+      return NULL;
+    }
+    memset(cb->buffer, 0, sizeof(struct chunk) * cb->size);
+    for (i = 0; i < cb->size; i++) {
+      cb->buffer[i].id = -1;
+    }
+  }
+
+  if (cb->max_bytes) {
+    cb->heap = malloc(sizeof(int) * cb->size);
+    cb->heap_pos = malloc(sizeof(int) * cb->size);
+    if (cb->heap == NULL || cb->heap_pos == NULL) {
+      buffer_free(cb);
+      return NULL;
+    }
+    for (i = 0; i < cb->size; i++) {
+      cb->heap_pos[i] = -1;
+    }
+  }
+
+  sprintf(bmap_cfg, "type=bitmap,size=%d", cb->size);
+  cb->bmap = chunkID_set_init(bmap_cfg);
+  if (cb->bmap == NULL) {
+    buffer_free(cb);
+    return NULL;
   }
 
   return cb;
 }
 
-int cb_add_chunk(struct chunk_buffer *cb, const struct chunk *c)
+/*
+ * If view is not 0, c does not own its payload, and is copied (or adopted,
+ * see chunk_adopt()) only once it is known to be accepted.
+ */
+static int add_chunk(struct chunk_buffer *cb, const struct chunk *c, uint8_t *block, int view)
 {
-  int i;
+  struct chunk stored;
+  struct cb_record r;
+  int res, min_id = -1, clear = 0;
 
-  if (cb->num_chunks == cb->size) {
-    i = remove_oldest_chunk(cb, c->id, c->timestamp);
-  } else {
-    i = 0;
+  if (c->id < 0) {
+    return E_CB_OLD;
   }
 
-  if (i < 0) {
-    return i;
-  }
-  
-  while(1) {
-    if (cb->buffer[i].id == c->id) {
+  /* Nothing is dropped before knowing that c can be stored */
+  if (cb->num_chunks && c->id > cb->last_id) {
+    if (c->id - cb->size + 1 > cb->first_id) {
+      min_id = c->id - cb->size + 1;
+    }
+  } else if (cb->num_chunks && c->id > cb->last_id - cb->size) {
+    if (cb_slot_id(cb, c->id) == c->id) {
       return E_CB_DUPLICATE;
     }
-    if (cb->buffer[i].id < 0) {
-      cb->buffer[i] = *c;
-      cb->num_chunks++;
+  } else if (cb->num_chunks) {
+    struct evict_key first;
 
-      return 0; 
+    // check for ID looparound and other anomalies
+    slot_key(cb, cb_pos(cb, cb->first_id), &first);
+    if (first.timestamp >= c->timestamp) {
+      return E_CB_OLD;
+    }
+    clear = 1;
+  }
+  res = room_check(cb, c, clear ? INT_MAX : min_id);
+  if (res < 0) {
+    return res;
+  }
+  if (clear) {
+    cb_clear(cb);
+  } else if (min_id >= 0) {
+    remove_older_chunks(cb, min_id);
+  }
+
+  stored = *c;
+  res = make_room(cb, &stored);
+  if (res >= 0 && cb->store) {
+    /* The segment gets its own copy, even of a view */
+    res = store_append(cb, &stored, &r);
+  } else if (res >= 0 && view) {
+    if (cb->refcount) {
+      res = chunk_adopt(&stored, block);
+    } else {
+      res = chunk_copy(&stored);
+    }
+    res = res < 0 ? E_CB_FULL : 0;
+  }
+  if (res >= 0 && chunkID_set_add_chunk(cb->bmap, c->id) < 0) {
+    /* Undo the copy: the caller still owns c */
+    if (cb->store) {
+      cb_store_drop(cb->store, &r);
+    } else if (view) {
+      chunk_data_free(cb, &stored);
     }
-    i++;
+    res = E_CB_ERROR;
   }
+  if (res < 0) {
+    return res;
+  }
+
+  if (cb->store && !view) {
+    struct chunk orig = *c;
+
+    chunk_data_free(cb, &orig);
+  }
+  chunk_store(cb, &stored, &r);
+
+  return 0;
+}
+
+int cb_add_chunk(struct chunk_buffer *cb, const struct chunk *c)
+{
+  return add_chunk(cb, c, NULL, 0);
+}
+
+int cb_add_chunk_view(struct chunk_buffer *cb, const struct chunk *c, uint8_t *block)
+{
+  return add_chunk(cb, c, block, 1);
 }
 
 struct chunk *cb_get_chunks(const struct chunk_buffer *cb, int *n)
 {
+  struct chunk_list *l = cb->list;
+
   *n = cb->num_chunks;
   if (*n == 0) {
     return NULL;
   }
 
-  insert_sort(cb->buffer, cb->num_chunks);
+  if (!l->valid) {
+    int i;
+
+    if (l->size < cb->num_chunks) {
+      struct chunk *chunks = realloc(l->chunks, sizeof(struct chunk) * cb->num_chunks);
 
-  return cb->buffer;
+      if (chunks == NULL) {
+        *n = -1;
+
+        return NULL;
+      }
+      l->chunks = chunks;
+      l->size = cb->num_chunks;
+    }
+    l->n = 0;
+    for (i = cb->first_id; l->n < cb->num_chunks; i++) {
+      if (cb_slot_id(cb, i) != i) {
+        continue;
+      }
+      if (cb->index) {
+        cb_store_view(cb->store, &cb->index[cb_pos(cb, i)], &l->chunks[l->n++]);
+      } else {
+        l->chunks[l->n++] = *cb_slot(cb, i);
+      }
+    }
+    l->valid = 1;
+  }
+
+  return l->chunks;
 }
 
 int cb_clear(struct chunk_buffer *cb)
 {
   int i;
 
-  for (i = 0; i < cb->num_chunks; i++) {
-    chunk_free(&cb->buffer[i]);
+  for (i = cb->first_id; cb->num_chunks; i++) {
+    if (cb_slot_id(cb, i) == i) {
+      chunk_drop(cb, cb_pos(cb, i));
+    }
   }
-  cb->num_chunks = 0;
+  chunkID_set_clear(cb->bmap, cb->size);
+  cb->list->valid = 0;
 
   return 0;
 }
 
+const struct chunkID_set *cb_get_bmap(const struct chunk_buffer *cb)
+{
+  return cb->bmap;
+}
+
+size_t cb_get_bytes(const struct chunk_buffer *cb)
+{
+  return cb->bytes;
+}
+
 void cb_destroy(struct chunk_buffer *cb)
 {
   cb_clear(cb);
-  free(cb->buffer);
-  free(cb);
+  buffer_free(cb);
 }
@@ -0,0 +1,75 @@
+#ifndef BUFFER_PRIVATE
+#define BUFFER_PRIVATE
+
+#define CB_POLICY_DEADLINE 0
+#define CB_POLICY_PRIORITY 1
+
+struct chunk_list {
+  int valid;		// chunks[] reflects the current buffer content
+  int n;		// number of chunks in chunks[]
+  int size;		// size of chunks[], allocated when needed
+  struct chunk *chunks;	// buffered chunks, ordered by increasing ID
+};
+
+/* A chunk kept in the disk-backed store: where it is, and its metadata */
+struct cb_record {
+  uint64_t timestamp;
+  int id;			// -1 if the slot is empty
+  int size;
+  int attributes_size;
+  int priority;			// so that evicting does not touch the mapping
+  unsigned int segment;		// sequence number of the segment
+  unsigned int offset;		// of the payload in the segment, 0 if nothing is stored
+};
+
+#define CB_STORE_FULL -1	// all the segments are in use
+#define CB_STORE_ERROR -2
+
+struct cb_store;
+
+struct chunk_buffer {
+  int size;		// number of slots, i.e., width of the ID window
+  int num_chunks;	// number of chunks currently stored
+  int first_id;		// smallest ID in the buffer (meaningful if num_chunks > 0)
+  int last_id;		// largest ID in the buffer (meaningful if num_chunks > 0)
+  struct chunk *buffer;	// ring of slots, chunk "id" is stored in slot id % size
+  struct cb_record *index;	// ring of records, used instead of buffer with a store
+  struct chunk *view;	// chunk returned by cb_get_chunk() with a store
+  struct chunk_list *list;
+  struct chunkID_set *bmap;	// IDs of the buffered chunks
+  size_t bytes;		// payload and attributes bytes currently stored
+  size_t max_bytes;	// byte budget (0 if the buffer is limited by "size" only)
+  int policy;		// eviction order used to respect max_bytes
+  int *heap;		// slots, in eviction order (only if max_bytes != 0)
+  int *heap_pos;	// position of each slot in heap[], -1 if empty
+  int heap_n;
+  struct cb_store *store;	// NULL if the chunks are stored in memory
+  int refcount;		// chunks are reference counted instead of malloc()ed
+};
+
+static inline int cb_pos(const struct chunk_buffer *cb, int id)
+{
+  return (unsigned int)id % cb->size;
+}
+
+/* The slot of chunk "id" (only if the chunks are stored in memory) */
+static inline struct chunk *cb_slot(const struct chunk_buffer *cb, int id)
+{
+  return &cb->buffer[cb_pos(cb, id)];
+}
+
+/* ID of the chunk stored in the slot of chunk "id" (-1 if the slot is empty) */
+static inline int cb_slot_id(const struct chunk_buffer *cb, int id)
+{
+  return cb->index ? cb->index[cb_pos(cb, id)].id : cb->buffer[cb_pos(cb, id)].id;
+}
+
+struct cb_store *cb_store_init(const char *path, size_t segment_size, int max_segments);
+int cb_store_append(struct cb_store *st, const struct chunk *c, struct cb_record *r);
+void cb_store_view(const struct cb_store *st, const struct cb_record *r, struct chunk *c);
+int cb_store_segments(const struct cb_store *st);
+int cb_store_oldest(const struct cb_store *st, const struct cb_record *r);
+void cb_store_drop(struct cb_store *st, const struct cb_record *r);
+void cb_store_free(struct cb_store *st);
+
+#endif /* BUFFER_PRIVATE */
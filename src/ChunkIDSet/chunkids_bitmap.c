@@ -0,0 +1,612 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+/*
+ * Sliding bitmap implementation of the "bitmap" chunk ID sets: adding,
+ * checking, and removing an ID are O(1), trimming the set costs one
+ * operation per discarded word, and set operations work on whole words
+ * (two at a time, with SSE2).
+ *
+ * To scan a set in order with get_chunk() in O(1) per ID, the bitmap
+ * remembers the last word it was read from: the word and the index of its
+ * first ID are packed in a single 64 bit value, accessed atomically, so
+ * that threads reading the same (not modified) set do not race on it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "chunkids_private.h"
+
+#define WORD_BITS 64
+#define CURSOR_NONE UINT64_MAX
+
+static inline int word_of(int id)
+{
+  return id >> 6;	/* rounds towards -infinity */
+}
+
+static inline uint64_t bit_of(int id)
+{
+  return 1ULL << (id & (WORD_BITS - 1));
+}
+
+static inline uint64_t *word_ptr(const struct chunkID_set *h, int w)
+{
+  return &h->bitmap->words[(unsigned int)w & (h->bitmap->nwords - 1)];
+}
+
+static inline uint64_t word_get(const struct chunkID_set *h, int w)
+{
+  if (h->n_elements == 0 || w < h->lo || w > h->hi) {
+    return 0;
+  }
+
+  return *word_ptr(h, w);
+}
+
+static inline void cursor_reset(const struct chunkID_set *h)
+{
+  if (h->bitmap) {
+    __atomic_store_n(&h->bitmap->cursor, CURSOR_NONE, __ATOMIC_RELAXED);
+  }
+}
+
+static struct cist_bitmap *bitmap_alloc(uint32_t nwords)
+{
+  struct cist_bitmap *b;
+
+  b = calloc(1, sizeof(struct cist_bitmap) + nwords * sizeof(uint64_t));
+  if (b == NULL) {
+    return NULL;
+  }
+  b->nwords = nwords;
+  b->cursor = CURSOR_NONE;
+
+  return b;
+}
+
+static uint32_t words_for(uint32_t n)
+{
+  uint32_t res = 1;
+
+  while (res < n) {
+    res <<= 1;
+  }
+
+  return res;
+}
+
+/* Make sure that words [lo, hi] fit in the ring (allocating it, if needed) */
+static int bitmap_cover(struct chunkID_set *h, int lo, int hi)
+{
+  struct cist_bitmap *b;
+  uint32_t nwords;
+  int w;
+
+  if (h->bitmap && (uint32_t)(hi - lo) < h->bitmap->nwords) {
+    return 0;
+  }
+  if ((uint32_t)(hi - lo) > CIST_BITMAP_MAX_WORDS) {
+    return -1;
+  }
+  nwords = words_for((uint32_t)(hi - lo) + 1);
+  b = bitmap_alloc(nwords);
+  if (b == NULL) {
+    return -1;
+  }
+  for (w = h->lo; h->n_elements && w <= h->hi; w++) {
+    b->words[(unsigned int)w & (nwords - 1)] = *word_ptr(h, w);
+  }
+  free(h->bitmap);
+  h->bitmap = b;
+
+  return 0;
+}
+
+/* Move lo and hi to the first and last non-empty words */
+static void bitmap_normalize(struct chunkID_set *h)
+{
+  if (h->n_elements == 0) {
+    return;
+  }
+  while (*word_ptr(h, h->lo) == 0) {
+    h->lo++;
+  }
+  while (*word_ptr(h, h->hi) == 0) {
+    h->hi--;
+  }
+}
+
+/* Recompute the size of a set whose IDs are all in words [lo, hi] */
+static void bitmap_recount(struct chunkID_set *h, int lo, int hi)
+{
+  int w;
+
+  h->n_elements = 0;
+  for (w = lo; w <= hi; w++) {
+    h->n_elements += __builtin_popcountll(*word_ptr(h, w));
+  }
+  h->lo = lo;
+  h->hi = hi;
+  bitmap_normalize(h);
+}
+
+/* Allocate the ring for "size" IDs (or nothing, if size is 0) */
+int cist_bitmap_init(struct chunkID_set *h, int size)
+{
+  h->lo = h->hi = 0;
+  h->n_elements = 0;
+  free(h->bitmap);
+  h->bitmap = NULL;
+  if (size <= 0) {
+    return 0;
+  }
+  if (size > CIST_BITMAP_MAX_SPAN) {
+    return -1;
+  }
+  h->bitmap = bitmap_alloc(words_for(size / WORD_BITS + 1));
+
+  return h->bitmap ? 0 : -1;
+}
+
+void cist_bitmap_clear(struct chunkID_set *h)
+{
+  int w;
+
+  for (w = h->lo; h->n_elements && w <= h->hi; w++) {
+    *word_ptr(h, w) = 0;
+  }
+  h->n_elements = 0;
+  cursor_reset(h);
+}
+
+int cist_bitmap_add(struct chunkID_set *h, int id)
+{
+  int w = word_of(id);
+  int lo, hi;
+  uint64_t *p;
+
+  lo = (h->n_elements && h->lo < w) ? h->lo : w;
+  hi = (h->n_elements && h->hi > w) ? h->hi : w;
+  if (bitmap_cover(h, lo, hi) < 0) {
+    return -1;
+  }
+  p = word_ptr(h, w);
+  if (*p & bit_of(id)) {
+    return 0;
+  }
+  *p |= bit_of(id);
+  h->lo = lo;
+  h->hi = hi;
+  cursor_reset(h);
+
+  return ++h->n_elements;
+}
+
+int cist_bitmap_has(const struct chunkID_set *h, int id)
+{
+  return (word_get(h, word_of(id)) & bit_of(id)) != 0;
+}
+
+/* Number of IDs smaller than id */
+int cist_bitmap_count_below(const struct chunkID_set *h, int id)
+{
+  int w, res = 0;
+
+  if (h->n_elements == 0 || word_of(id) < h->lo) {
+    return 0;
+  }
+  if (word_of(id) > h->hi) {
+    return h->n_elements;
+  }
+  for (w = h->lo; w < word_of(id); w++) {
+    res += __builtin_popcountll(*word_ptr(h, w));
+  }
+
+  return res + __builtin_popcountll(*word_ptr(h, w) & (bit_of(id) - 1));
+}
+
+/*
+ * Get the i^th ID. The position of the last word is remembered, so
+ * that scanning the set in order costs O(1) per ID.
+ */
+int cist_bitmap_get(const struct chunkID_set *h, int i)
+{
+  struct cist_bitmap *b = h->bitmap;
+  uint64_t v, cursor;
+  int w, r;
+
+  if (i < 0 || i >= h->n_elements) {
+    return -1;
+  }
+  cursor = __atomic_load_n(&b->cursor, __ATOMIC_RELAXED);
+  if (cursor != CURSOR_NONE && (int)(uint32_t)cursor <= i) {
+    w = (int)(uint32_t)(cursor >> 32);
+    r = (int)(uint32_t)cursor;
+  } else {
+    w = h->lo;
+    r = 0;
+  }
+  while (r + __builtin_popcountll(*word_ptr(h, w)) <= i) {
+    r += __builtin_popcountll(*word_ptr(h, w));
+    w++;
+  }
+  __atomic_store_n(&b->cursor, (uint64_t)(uint32_t)w << 32 | (uint32_t)r, __ATOMIC_RELAXED);
+
+  for (v = *word_ptr(h, w); r < i; r++) {
+    v &= v - 1;
+  }
+
+  return w * WORD_BITS + __builtin_ctzll(v);
+}
+
+int cist_bitmap_remove(struct chunkID_set *h, int id)
+{
+  if (!cist_bitmap_has(h, id)) {
+    return 0;
+  }
+  *word_ptr(h, word_of(id)) &= ~bit_of(id);
+  h->n_elements--;
+  bitmap_normalize(h);
+  cursor_reset(h);
+
+  return 1;
+}
+
+/* Keep the "size" largest IDs only */
+void cist_bitmap_trim(struct chunkID_set *h, int size)
+{
+  if (size < 0) {
+    size = 0;
+  }
+  if (h->n_elements <= size) {
+    return;
+  }
+  while (h->n_elements > size) {
+    uint64_t *p = word_ptr(h, h->lo);
+    int n = __builtin_popcountll(*p);
+
+    if (h->n_elements - n >= size) {
+      *p = 0;
+      h->n_elements -= n;
+      h->lo++;
+    } else {
+      for (n = h->n_elements - size; n; n--) {
+        *p &= *p - 1;
+      }
+      h->n_elements = size;
+    }
+  }
+  bitmap_normalize(h);
+  cursor_reset(h);
+}
+
+int cist_bitmap_earliest(const struct chunkID_set *h)
+{
+  return h->lo * WORD_BITS + __builtin_ctzll(*word_ptr(h, h->lo));
+}
+
+int cist_bitmap_latest(const struct chunkID_set *h)
+{
+  return h->hi * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(*word_ptr(h, h->hi));
+}
+
+/*
+ * First ID >= id which is in the set (if in != 0) or not in the set
+ * (if in == 0). Returns -1 if there are no more IDs in the set.
+ */
+int cist_bitmap_next(const struct chunkID_set *h, int id, int in)
+{
+  uint64_t mask = in ? 0 : ~0ULL;
+  uint64_t v;
+  int w;
+
+  if (in && (h->n_elements == 0 || word_of(id) > h->hi)) {
+    return -1;
+  }
+  if (in && word_of(id) < h->lo) {
+    id = h->lo * WORD_BITS;
+  }
+  w = word_of(id);
+  v = (word_get(h, w) ^ mask) & ~(bit_of(id) - 1);
+  while (v == 0) {
+    if (in && w >= h->hi) {
+      return -1;
+    }
+    v = word_get(h, ++w) ^ mask;
+  }
+
+  return w * WORD_BITS + __builtin_ctzll(v);
+}
+
+static void words_or(uint64_t *d, const uint64_t *s, int n)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(d + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+
+    _mm_storeu_si128((__m128i *)(d + i), _mm_or_si128(a, b));
+  }
+#endif
+  for (; i < n; i++) {
+    d[i] |= s[i];
+  }
+}
+
+static void words_and(uint64_t *d, const uint64_t *s, int n)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(d + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+
+    _mm_storeu_si128((__m128i *)(d + i), _mm_and_si128(a, b));
+  }
+#endif
+  for (; i < n; i++) {
+    d[i] &= s[i];
+  }
+}
+
+static void words_andnot(uint64_t *d, const uint64_t *s, int n)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(d + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+
+    _mm_storeu_si128((__m128i *)(d + i), _mm_andnot_si128(b, a));
+  }
+#endif
+  for (; i < n; i++) {
+    d[i] &= ~s[i];
+  }
+}
+
+static void words_xor(uint64_t *d, const uint64_t *s, int n)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(d + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+
+    _mm_storeu_si128((__m128i *)(d + i), _mm_xor_si128(a, b));
+  }
+#endif
+  for (; i < n; i++) {
+    d[i] ^= s[i];
+  }
+}
+
+/*
+ * Apply op to the words [lo, hi] of h and a. The rings of the two sets
+ * can have different sizes, so the range is split in runs which are
+ * contiguous in both.
+ */
+static void bitmap_apply(struct chunkID_set *h, const struct chunkID_set *a, int lo, int hi,
+                         void (*op)(uint64_t *d, const uint64_t *s, int n))
+{
+  uint32_t hmask = h->bitmap->nwords - 1;
+  uint32_t amask = a->bitmap->nwords - 1;
+  int w = lo;
+
+  while (w <= hi) {
+    uint32_t hpos = (unsigned int)w & hmask;
+    uint32_t apos = (unsigned int)w & amask;
+    uint32_t run = hi - w + 1;
+
+    if (run > hmask + 1 - hpos) {
+      run = hmask + 1 - hpos;
+    }
+    if (run > amask + 1 - apos) {
+      run = amask + 1 - apos;
+    }
+    op(h->bitmap->words + hpos, a->bitmap->words + apos, run);
+    w += run;
+  }
+}
+
+int cist_bitmap_union(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int lo, hi;
+
+  if (a->n_elements == 0) {
+    return h->n_elements;
+  }
+  lo = (h->n_elements && h->lo < a->lo) ? h->lo : a->lo;
+  hi = (h->n_elements && h->hi > a->hi) ? h->hi : a->hi;
+  if (bitmap_cover(h, lo, hi) < 0) {
+    return -1;
+  }
+  bitmap_apply(h, a, a->lo, a->hi, words_or);
+  bitmap_recount(h, lo, hi);
+  cursor_reset(h);
+
+  return h->n_elements;
+}
+
+int cist_bitmap_symmetric_difference(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int lo, hi;
+
+  if (a->n_elements == 0) {
+    return h->n_elements;
+  }
+  lo = (h->n_elements && h->lo < a->lo) ? h->lo : a->lo;
+  hi = (h->n_elements && h->hi > a->hi) ? h->hi : a->hi;
+  if (bitmap_cover(h, lo, hi) < 0) {
+    return -1;
+  }
+  bitmap_apply(h, a, a->lo, a->hi, words_xor);
+  bitmap_recount(h, lo, hi);
+  cursor_reset(h);
+
+  return h->n_elements;
+}
+
+void cist_bitmap_intersection(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int lo, hi, w;
+
+  if (h->n_elements == 0) {
+    return;
+  }
+  lo = h->lo > a->lo ? h->lo : a->lo;
+  hi = h->hi < a->hi ? h->hi : a->hi;
+  if (a->n_elements == 0 || lo > hi) {
+    cist_bitmap_clear(h);
+
+    return;
+  }
+  for (w = h->lo; w < lo; w++) {
+    *word_ptr(h, w) = 0;
+  }
+  for (w = hi + 1; w <= h->hi; w++) {
+    *word_ptr(h, w) = 0;
+  }
+  bitmap_apply(h, a, lo, hi, words_and);
+  bitmap_recount(h, lo, hi);
+  cursor_reset(h);
+}
+
+void cist_bitmap_difference(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int lo, hi;
+
+  if (h->n_elements == 0 || a->n_elements == 0) {
+    return;
+  }
+  lo = h->lo > a->lo ? h->lo : a->lo;
+  hi = h->hi < a->hi ? h->hi : a->hi;
+  if (lo > hi) {
+    return;
+  }
+  bitmap_apply(h, a, lo, hi, words_andnot);
+  bitmap_recount(h, h->lo, h->hi);
+  cursor_reset(h);
+}
+
+/* Size of the intersection of h and a */
+int cist_bitmap_count_common(const struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int lo, hi, w, res = 0;
+
+  if (h->n_elements == 0 || a->n_elements == 0) {
+    return 0;
+  }
+  lo = h->lo > a->lo ? h->lo : a->lo;
+  hi = h->hi < a->hi ? h->hi : a->hi;
+  for (w = lo; w <= hi; w++) {
+    res += __builtin_popcountll(*word_ptr(h, w) & *word_ptr(a, w));
+  }
+
+  return res;
+}
+
+static uint64_t le_load(const uint8_t *p, int len)
+{
+  uint64_t v = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&v, p, len);
+#else
+  while (len--) {
+    v = (v << 8) | p[len];
+  }
+#endif
+
+  return v;
+}
+
+static void le_store(uint8_t *p, uint64_t v, int len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(p, &v, len);
+#else
+  int i;
+
+  for (i = 0; i < len; i++) {
+    p[i] = v >> (8 * i);
+  }
+#endif
+}
+
+/*
+ * Write the IDs [base, base + bits) as a bitmap of (bits + 7) / 8 bytes,
+ * where bit i % 8 of byte i / 8 is set if base + i is in the set.
+ */
+void cist_bitmap_export(const struct chunkID_set *h, uint8_t *buff, int base, int bits)
+{
+  int shift = base & (WORD_BITS - 1);
+  int w = word_of(base);
+  int bytes = (bits + 7) / 8;
+  int i;
+
+  for (i = 0; i * 8 < bytes; i++, w++) {
+    uint64_t v = word_get(h, w) >> shift;
+    int len = bytes - i * 8 < 8 ? bytes - i * 8 : 8;
+
+    if (shift) {
+      v |= word_get(h, w + 1) << (WORD_BITS - shift);
+    }
+    if ((i + 1) * WORD_BITS > bits) {
+      v &= (1ULL << (bits - i * WORD_BITS)) - 1;
+    }
+    le_store(buff + i * 8, v, len);
+  }
+}
+
+/* Add the IDs from a bitmap written by cist_bitmap_export() */
+int cist_bitmap_import(struct chunkID_set *h, const uint8_t *buff, int base, int bits)
+{
+  int shift = base & (WORD_BITS - 1);
+  int w = word_of(base);
+  int bytes = (bits + 7) / 8;
+  int lo, hi, i;
+
+  if (bits <= 0) {
+    return h->n_elements;
+  }
+  lo = word_of(base);
+  hi = word_of(base + bits - 1);
+  if (h->n_elements) {
+    lo = h->lo < lo ? h->lo : lo;
+    hi = h->hi > hi ? h->hi : hi;
+  }
+  if (bitmap_cover(h, lo, hi) < 0) {
+    return -1;
+  }
+  for (i = 0; i * 8 < bytes; i++, w++) {
+    int len = bytes - i * 8 < 8 ? bytes - i * 8 : 8;
+    uint64_t v = le_load(buff + i * 8, len);
+
+    if ((i + 1) * WORD_BITS > bits) {
+      v &= (1ULL << (bits - i * WORD_BITS)) - 1;
+    }
+    *word_ptr(h, w) |= v << shift;
+    if (shift && (v >> (WORD_BITS - shift))) {
+      *word_ptr(h, w + 1) |= v >> (WORD_BITS - shift);
+    }
+  }
+  bitmap_recount(h, lo, hi);
+  cursor_reset(h);
+
+  return h->n_elements;
+}
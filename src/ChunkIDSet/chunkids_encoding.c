@@ -8,46 +8,219 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include "chunkids_private.h"
 #include "chunkidset.h"
 #include "trade_sig_la.h"
 #include "int_coding.h"
 
-int encodeChunkSignaling(const struct chunkID_set *h, const void *meta, int meta_len, uint8_t *buff, int buff_len)
+/*
+ * Besides the original encodings (a bitmap for "bitmap" sets, and 32 bit
+ * IDs for "priority" sets), a set can be encoded as
+ * - run lengths: the lengths of the runs of present and missing IDs,
+ *   starting from the earliest ID (sorted sets only);
+ * - deltas: the distance of every ID from the previous one, as a varint
+ *   (zigzag coded for priority sets, which are not sorted);
+ * - sparse: 16 bit offsets of the IDs from the smallest one.
+ * Sets created with "encoding=compact" are sent in the most compact one,
+ * which is stored in the second byte of the "type" field. The other sets
+ * use the original encodings (0 in that byte), which older peers can
+ * decode; the new encodings are always accepted by the decoder.
+ * For the new encodings, the "size" field is the number of IDs, and the
+ * first ID (or the smallest one, for sparse priority sets) follows the
+ * header.
+ */
+#define ENC_DENSE 0
+#define ENC_RLE 1
+#define ENC_DELTA 2
+#define ENC_SPARSE 3
+#define ENC_TYPES 4
+#define ENC_SHIFT 8
+#define SPARSE_SPAN 65536
+
+static inline uint32_t zigzag(uint32_t d)
+{
+  return (d << 1) ^ -(d >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t v)
+{
+  return (v >> 1) ^ -(v & 1);
+}
+
+static int bitmap_bytes(int bits)
+{
+  return bits / 8 + (bits % 8 ? 1 : 0);
+}
+
+/*
+ * Size (after the header) of a sorted set in every encoding. The set is
+ * scanned one run of consecutive IDs at a time.
+ */
+static void sorted_costs(const struct chunkID_set *h, int *cost)
+{
+  int first = cist_bitmap_earliest(h);
+  int last = cist_bitmap_latest(h);
+  int s, e, prev_e = first;
+
+  cost[ENC_DENSE] = 4 + bitmap_bytes(last - first + 1);
+  cost[ENC_RLE] = 4;
+  cost[ENC_DELTA] = 4;
+  cost[ENC_SPARSE] = last - first < SPARSE_SPAN ? 4 + 2 * (h->n_elements - 1) : INT_MAX;
+  for (s = first; s >= 0; s = cist_bitmap_next(h, e, 1)) {
+    e = cist_bitmap_next(h, s, 0);
+    if (s != first) {
+      cost[ENC_RLE] += varint_len(s - prev_e);
+      cost[ENC_DELTA] += varint_len(s - prev_e);
+    }
+    cost[ENC_RLE] += varint_len(e - s);
+    cost[ENC_DELTA] += e - s - 1;
+    prev_e = e;
+  }
+}
+
+static uint8_t *sorted_write(const struct chunkID_set *h, int enc, uint8_t *p)
+{
+  int first = cist_bitmap_earliest(h);
+  int i, s, e, prev_e = first;
+
+  int_cpy(p, first);
+  p += 4;
+  for (s = first; s >= 0; s = cist_bitmap_next(h, e, 1)) {
+    e = cist_bitmap_next(h, s, 0);
+    switch (enc) {
+      case ENC_RLE:
+        if (s != first) {
+          p += varint_cpy(p, s - prev_e);
+        }
+        p += varint_cpy(p, e - s);
+        break;
+      case ENC_DELTA:
+        if (s != first) {
+          p += varint_cpy(p, s - prev_e);
+        }
+        for (i = s + 1; i < e; i++) {
+          *p++ = 0;
+        }
+        break;
+      case ENC_SPARSE:
+        for (i = s == first ? s + 1 : s; i < e; i++) {
+          int16_cpy(p, i - first);
+          p += 2;
+        }
+        break;
+    }
+    prev_e = e;
+  }
+
+  return p;
+}
+
+static void priority_costs(const struct chunkID_set *h, int *cost, int *min)
+{
+  int i, max;
+
+  cost[ENC_DENSE] = 4 * h->n_elements;
+  cost[ENC_RLE] = INT_MAX;
+  cost[ENC_DELTA] = 4;
+  *min = max = h->elements[0];
+  for (i = 1; i < h->n_elements; i++) {
+    cost[ENC_DELTA] += varint_len(zigzag((uint32_t)h->elements[i] - (uint32_t)h->elements[i - 1]));
+    if (h->elements[i] < *min) {
+      *min = h->elements[i];
+    }
+    if (h->elements[i] > max) {
+      max = h->elements[i];
+    }
+  }
+  cost[ENC_SPARSE] = (int64_t)max - *min < SPARSE_SPAN ? 4 + 2 * h->n_elements : INT_MAX;
+}
+
+static uint8_t *priority_write(const struct chunkID_set *h, int enc, int min, uint8_t *p)
 {
   int i;
+
+  switch (enc) {
+    case ENC_DELTA:
+      int_cpy(p, h->elements[0]);
+      p += 4;
+      for (i = 1; i < h->n_elements; i++) {
+        p += varint_cpy(p, zigzag((uint32_t)h->elements[i] - (uint32_t)h->elements[i - 1]));
+      }
+      break;
+    case ENC_SPARSE:
+      int_cpy(p, min);
+      p += 4;
+      for (i = 0; i < h->n_elements; i++) {
+        int16_cpy(p, h->elements[i] - min);
+        p += 2;
+      }
+      break;
+  }
+
+  return p;
+}
+
+int encodeChunkSignaling(const struct chunkID_set *h, const void *meta, int meta_len, uint8_t *buff, int buff_len)
+{
+  int i, enc, min = 0;
+  int cost[ENC_TYPES];
   uint8_t *meta_p;
   uint32_t type = h ? h->type : -1;
-  
+
+  enc = ENC_DENSE;
+  if (h && h->compact && h->n_elements && (type == CIST_BITMAP || type == CIST_PRIORITY)) {
+    if (type == CIST_BITMAP) {
+      sorted_costs(h, cost);
+    } else {
+      priority_costs(h, cost, &min);
+    }
+    for (i = ENC_DENSE + 1; i < ENC_TYPES; i++) {
+      if (cost[i] < cost[enc]) {
+        enc = i;
+      }
+    }
+    if (enc != ENC_DENSE) {
+      if (buff_len < cost[enc] + 12 + meta_len) {
+        return -1;
+      }
+      int_cpy(buff, h->n_elements);
+      int_cpy(buff + 4, type | (enc << ENC_SHIFT));
+      int_cpy(buff + 8, meta_len);
+      if (type == CIST_BITMAP) {
+        meta_p = sorted_write(h, enc, buff + 12);
+      } else {
+        meta_p = priority_write(h, enc, min, buff + 12);
+      }
+      if (meta_len) {
+        memcpy(meta_p, meta, meta_len);
+      }
+
+      return meta_p + meta_len - buff;
+    }
+  }
+
   int_cpy(buff + 4, type);
   int_cpy(buff + 8, meta_len);
 
   switch (type) {
     case CIST_BITMAP:
     {
-      int elements;
-      uint32_t c_min, c_max;
+      int elements, bytes;
+      int c_min, c_max;
 
-      c_min = c_max = h->n_elements ? h->elements[0] : 0;
-      for (i = 1; i < h->n_elements; i++) {
-        if (h->elements[i] < c_min)
-          c_min = h->elements[i];
-        else if (h->elements[i] > c_max)
-          c_max = h->elements[i];
-      }
+      c_min = h->n_elements ? cist_bitmap_earliest(h) : 0;
+      c_max = h->n_elements ? cist_bitmap_latest(h) : 0;
       elements = h->n_elements ? c_max - c_min + 1 : 0;
       int_cpy(buff, elements);
-      elements = elements / 8 + (elements % 8 ? 1 : 0);
-      if (buff_len < elements + 16 + meta_len) {
+      bytes = elements / 8 + (elements % 8 ? 1 : 0);
+      if (buff_len < bytes + 16 + meta_len) {
         return -1;
       }
       int_cpy(buff + 12, c_min); //first value in the bitmap, i.e., base value
-      memset(buff + 16, 0, elements);
-      for (i = 0; i < h->n_elements; i++) {
-        buff[16 + (h->elements[i] - c_min) / 8] |= 1 << ((h->elements[i] - c_min) % 8);
-      }
-      meta_p = buff + 16 + elements;
+      cist_bitmap_export(h, buff + 16, c_min, elements);
+      meta_p = buff + 16 + bytes;
       break;
     }
     case CIST_PRIORITY:
@@ -78,62 +251,179 @@ int encodeChunkSignaling(const struct chunkID_set *h, const void *meta, int meta
   return meta_p + meta_len - buff;
 }
 
-struct chunkID_set *decodeChunkSignaling(void **meta, int *meta_len, const uint8_t *buff, int buff_len)
+static int sorted_read(struct chunkID_set *h, int enc, uint32_t n, int64_t base, const uint8_t *p, const uint8_t *end)
+{
+  int64_t id = base;
+  uint32_t i, v, run;
+  int len;
+
+  for (i = 0; i < n;) {
+    run = 1;
+    if (enc == ENC_SPARSE && i) {
+      if (end - p < 2) {
+        return -1;
+      }
+      id = base + int16_rcpy(p);
+      p += 2;
+    } else if (enc != ENC_SPARSE) {
+      /* id is the ID following the previous run */
+      if (i) {
+        len = varint_rcpy(p, end - p, &v);
+        if (len < 0 || (enc == ENC_RLE && v == 0)) {
+          return -1;
+        }
+        p += len;
+        id += v;
+      }
+      if (enc == ENC_RLE) {
+        len = varint_rcpy(p, end - p, &run);
+        if (len < 0 || run == 0 || run > n - i) {
+          return -1;
+        }
+        p += len;
+      }
+    }
+    if (id + run - 1 > INT_MAX || id + run - 1 - base >= CIST_BITMAP_MAX_SPAN) {
+      return -1;
+    }
+    for (; run; run--, i++) {
+      if (cist_bitmap_add(h, id++) <= 0) {
+        return -1;
+      }
+    }
+  }
+
+  return p == end ? 0 : -1;
+}
+
+static int priority_read(struct chunkID_set *h, int enc, uint32_t n, int64_t base, const uint8_t *p, const uint8_t *end)
+{
+  uint32_t i, v;
+  int len;
+
+  for (i = 0; i < n; i++) {
+    if (enc == ENC_SPARSE) {
+      if (end - p < 2 || base + int16_rcpy(p) > INT_MAX) {
+        return -1;
+      }
+      h->elements[i] = base + int16_rcpy(p);
+      p += 2;
+    } else if (i == 0) {
+      h->elements[i] = base;
+    } else {
+      len = varint_rcpy(p, end - p, &v);
+      if (len < 0) {
+        return -1;
+      }
+      p += len;
+      h->elements[i] = (uint32_t)h->elements[i - 1] + unzigzag(v);
+    }
+  }
+  h->n_elements = n;
+
+  return p == end ? 0 : -1;
+}
+
+/* Decode a set in one of the compact encodings, from len bytes */
+static int compact_decode(struct chunkID_set *h, uint32_t type, uint32_t n, const uint8_t *p, int len)
+{
+  int enc = type >> ENC_SHIFT;
+  int res;
+
+  type &= (1 << ENC_SHIFT) - 1;
+  if ((type != CIST_BITMAP && type != CIST_PRIORITY) || enc >= ENC_TYPES ||
+      (type == CIST_PRIORITY && enc == ENC_RLE)) {
+    fprintf(stderr, "Error in decoding chunkid set - wrong type %d\n", type | (enc << ENC_SHIFT));
+
+    return -1;
+  }
+  /* Every ID but the first takes at least one byte, unless run lengths are used */
+  if (len < 4 || n == 0 || (enc != ENC_RLE && n - 1 > (uint32_t)len - 4) ||
+      (type == CIST_BITMAP && n > CIST_BITMAP_MAX_SPAN)) {
+    fprintf(stderr, "Error in decoding chunkid set - wrong length\n");
+
+    return -1;
+  }
+  if (cist_reset(h, type, type == CIST_PRIORITY ? n : 0) < 0) {
+    fprintf(stderr, "Error in decoding chunkid set - not enough memory to create a chunkID set.\n");
+
+    return -1;
+  }
+
+  if (type == CIST_BITMAP) {
+    res = sorted_read(h, enc, n, (int32_t)int_rcpy(p), p + 4, p + len);
+  } else {
+    res = priority_read(h, enc, n, (int32_t)int_rcpy(p), p + 4, p + len);
+  }
+  if (res < 0) {
+    fprintf(stderr, "Error in decoding chunkid set - malformed set\n");
+    cist_reset(h, type, 0);
+
+    return -1;
+  }
+
+  return 0;
+}
+
+int decodeChunkSignalingInto(struct chunkID_set *h, const uint8_t **meta, int *meta_len, const uint8_t *buff, int buff_len)
 {
   int i;
   uint32_t size;
   uint32_t type;
-  struct chunkID_set *h;
   const uint8_t *meta_p;
 
+  *meta = NULL;
+  *meta_len = 0;
+  if (buff_len < 12) {
+    fprintf(stderr, "Error in decoding chunkid set - wrong length\n");
+
+    return -1;
+  }
   size = int_rcpy(buff);
   type = int_rcpy(buff + 4);
   *meta_len = int_rcpy(buff + 8);
+  if (*meta_len < 0 || *meta_len > buff_len - 12) {
+    fprintf(stderr, "Error in decoding chunkid set - wrong length\n");
+    *meta_len = 0;
 
-  if (type != -1) {
-    char cfg[32];
-
-    memset(cfg, 0, sizeof(cfg));
-    sprintf(cfg, "size=%d", size);
-    h = chunkID_set_init(cfg);
-    if (h == NULL) {
-      fprintf(stderr, "Error in decoding chunkid set - not enough memory to create a chunkID set.\n");
-
-      return NULL;
-    }
-    h->type = type;
-  } else {
-    h = NULL;
+    return -1;
   }
 
   switch (type) {
     case CIST_BITMAP:
     {
-      // uint8_t bitmap;
       int base;
       int byte_cnt;
 
       byte_cnt = size / 8 + (size % 8 ? 1 : 0);
-      if (buff_len < 16 + byte_cnt + *meta_len) {
+      if (size > CIST_BITMAP_MAX_SPAN || buff_len < 16 + byte_cnt + *meta_len) {
         fprintf(stderr, "Error in decoding chunkid set - wrong length\n");
-        chunkID_set_free(h);
+        *meta_len = 0;
 
-        return NULL;
+        return -1;
       }
       base = int_rcpy(buff + 12);
-      for (i = size - 1; i >= 0; i--) {
-        if (buff[16 + (i / 8)] & 1 << (i % 8))
-          h->elements[h->n_elements++] = base + i;
+      if (cist_reset(h, type, size) < 0 || cist_bitmap_import(h, buff + 16, base, size) < 0) {
+        fprintf(stderr, "Error in decoding chunkid set - not enough memory to create a chunkID set.\n");
+        *meta_len = 0;
+
+        return -1;
       }
       meta_p = buff + 16 + byte_cnt;
       break;
     }
     case CIST_PRIORITY:
-      if (buff_len != size * 4 + 12 + *meta_len) {
+      if (size > (buff_len - 12) / 4 || buff_len != size * 4 + 12 + *meta_len) {
         fprintf(stderr, "Error in decoding chunkid set - wrong length.\n");
-        chunkID_set_free(h);
+        *meta_len = 0;
 
-        return NULL;
+        return -1;
+      }
+      if (cist_reset(h, type, size) < 0) {
+        fprintf(stderr, "Error in decoding chunkid set - not enough memory to create a chunkID set.\n");
+        *meta_len = 0;
+
+        return -1;
       }
       for (i = 0; i < size; i++) {
         h->elements[i] = int_rcpy(buff + 12 + i * 4);
@@ -142,15 +432,53 @@ struct chunkID_set *decodeChunkSignaling(void **meta, int *meta_len, const uint8
       meta_p = buff + 12 + size * 4;
       break;
     case -1:
+      cist_reset(h, h->type, 0);
       meta_p = buff + 12;
       break;
     default:
-      fprintf(stderr, "Error in decoding chunkid set - wrong type %d\n", type);
-      chunkID_set_free(h);
+      if (type >> ENC_SHIFT == ENC_DENSE) {
+        fprintf(stderr, "Error in decoding chunkid set - wrong type %d\n", type);
+        *meta_len = 0;
 
-      return NULL;
+        return -1;
+      }
+      if (compact_decode(h, type, size, buff + 12, buff_len - 12 - *meta_len) < 0) {
+        *meta_len = 0;
+
+        return -1;
+      }
+      meta_p = buff + buff_len - *meta_len;
   }
 
+  if (*meta_len) {
+    *meta = meta_p;
+  }
+
+  return type != -1;
+}
+
+struct chunkID_set *decodeChunkSignaling(void **meta, int *meta_len, const uint8_t *buff, int buff_len)
+{
+  struct chunkID_set *h;
+  const uint8_t *meta_p;
+  int res;
+
+  *meta = NULL;
+  *meta_len = 0;
+  h = chunkID_set_init("size=0");
+  if (h == NULL) {
+    fprintf(stderr, "Error in decoding chunkid set - not enough memory to create a chunkID set.\n");
+
+    return NULL;
+  }
+  res = decodeChunkSignalingInto(h, &meta_p, meta_len, buff, buff_len);
+  if (res <= 0) {
+    chunkID_set_free(h);
+    h = NULL;
+    if (res < 0) {
+      return NULL;
+    }
+  }
   if (*meta_len) {
     *meta = malloc(*meta_len);
     if (*meta != NULL) {
@@ -158,8 +486,6 @@ struct chunkID_set *decodeChunkSignaling(void **meta, int *meta_len, const uint8
     } else {
       *meta_len = 0;
     }
-  } else {
-    *meta = NULL;
   }
 
   return h;
@@ -8,8 +8,19 @@
 #include <stdint.h>
 #include <assert.h>
 
+#include "chunkids_private.h"
 #include "chunkidset.h"
 
+/* Membership test, without computing the priority */
+static int contains(const struct chunkID_set *h, int chunk_id)
+{
+  if (h->type == CIST_BITMAP) {
+    return cist_bitmap_has(h, chunk_id);
+  }
+
+  return chunkID_set_check(h, chunk_id) >= 0;
+}
+
 uint32_t chunkID_set_get_earliest(const struct chunkID_set *h)
 {
   int i;
@@ -18,6 +29,9 @@ uint32_t chunkID_set_get_earliest(const struct chunkID_set *h)
   if (chunkID_set_size(h) == 0) {
     return CHUNKID_INVALID;
   }
+  if (h->type == CIST_BITMAP) {
+    return cist_bitmap_earliest(h);
+  }
   min = chunkID_set_get_chunk(h, 0);
   for (i = 1; i < chunkID_set_size(h); i++) {
     int c = chunkID_set_get_chunk(h, i);
@@ -36,6 +50,9 @@ uint32_t chunkID_set_get_latest(const struct chunkID_set *h)
   if (chunkID_set_size(h) == 0) {
     return CHUNKID_INVALID;
   }
+  if (h->type == CIST_BITMAP) {
+    return cist_bitmap_latest(h);
+  }
   max = chunkID_set_get_chunk(h, 0);
   for (i = 1; i < chunkID_set_size(h); i++) {
     int c = chunkID_set_get_chunk(h, i);
@@ -46,10 +63,14 @@ uint32_t chunkID_set_get_latest(const struct chunkID_set *h)
   return max;
 }
 
-int chunkID_set_union(struct chunkID_set *h, struct chunkID_set *a)
+int chunkID_set_union(struct chunkID_set *h, const struct chunkID_set *a)
 {
   int i;
 
+  if (h->type == CIST_BITMAP && a->type == CIST_BITMAP) {
+    return cist_bitmap_union(h, a);
+  }
+
   for (i = 0; i < chunkID_set_size(a); i++) {
     int ret = chunkID_set_add_chunk(h, chunkID_set_get_chunk(a, i));
     if (ret < 0) return ret;
@@ -57,3 +78,112 @@ int chunkID_set_union(struct chunkID_set *h, struct chunkID_set *a)
 
   return chunkID_set_size(h);
 }
+
+int chunkID_set_intersection(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int i;
+
+  if (h->type == CIST_BITMAP && a->type == CIST_BITMAP) {
+    cist_bitmap_intersection(h, a);
+
+    return chunkID_set_size(h);
+  }
+
+  for (i = chunkID_set_size(h) - 1; i >= 0; i--) {
+    int c = chunkID_set_get_chunk(h, i);
+
+    if (!contains(a, c)) {
+      chunkID_set_remove_chunk(h, c);
+    }
+  }
+
+  return chunkID_set_size(h);
+}
+
+int chunkID_set_difference(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int i;
+
+  if (h->type == CIST_BITMAP && a->type == CIST_BITMAP) {
+    cist_bitmap_difference(h, a);
+
+    return chunkID_set_size(h);
+  }
+
+  for (i = chunkID_set_size(h) - 1; i >= 0; i--) {
+    int c = chunkID_set_get_chunk(h, i);
+
+    if (contains(a, c)) {
+      chunkID_set_remove_chunk(h, c);
+    }
+  }
+
+  return chunkID_set_size(h);
+}
+
+int chunkID_set_symmetric_difference(struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int i;
+
+  if (h->type == CIST_BITMAP && a->type == CIST_BITMAP) {
+    return cist_bitmap_symmetric_difference(h, a);
+  }
+
+  for (i = 0; i < chunkID_set_size(a); i++) {
+    int c = chunkID_set_get_chunk(a, i);
+    int ret = contains(h, c) ? chunkID_set_remove_chunk(h, c) : chunkID_set_add_chunk(h, c);
+
+    if (ret < 0) return ret;
+  }
+
+  return chunkID_set_size(h);
+}
+
+int chunkID_set_intersection_size(const struct chunkID_set *h, const struct chunkID_set *a)
+{
+  int i, n = 0;
+
+  if (h->type == CIST_BITMAP && a->type == CIST_BITMAP) {
+    return cist_bitmap_count_common(h, a);
+  }
+  /* Scan the smaller set, preferably checking the IDs in a bitmap */
+  if (a->type != CIST_BITMAP && (h->type == CIST_BITMAP || chunkID_set_size(a) < chunkID_set_size(h))) {
+    const struct chunkID_set *tmp = h;
+
+    h = a;
+    a = tmp;
+  }
+  for (i = 0; i < chunkID_set_size(h); i++) {
+    if (contains(a, chunkID_set_get_chunk(h, i))) {
+      n++;
+    }
+  }
+
+  return n;
+}
+
+int chunkID_set_difference_size(const struct chunkID_set *h, const struct chunkID_set *a)
+{
+  return chunkID_set_size(h) - chunkID_set_intersection_size(h, a);
+}
+
+int chunkID_set_compact(const struct chunkID_set *h)
+{
+  return h->compact;
+}
+
+int chunkID_set_rank(const struct chunkID_set *h, int chunk_id)
+{
+  int i, n = 0;
+
+  if (h->type == CIST_BITMAP) {
+    return cist_bitmap_count_below(h, chunk_id);
+  }
+  for (i = 0; i < chunkID_set_size(h); i++) {
+    if (chunkID_set_get_chunk(h, i) < chunk_id) {
+      n++;
+    }
+  }
+
+  return n;
+}
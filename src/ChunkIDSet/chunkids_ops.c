@@ -27,7 +27,7 @@ struct chunkID_set *chunkID_set_init(const char *config)
   if (p == NULL) {
     return NULL;
   }
-  p->n_elements = 0;
+  memset(p, 0, sizeof(struct chunkID_set));
   cfg_tags = config_parse(config);
   if (!cfg_tags) {
     free(p);
@@ -37,14 +37,6 @@ struct chunkID_set *chunkID_set_init(const char *config)
   if (!res) {
     p->size = 0;
   }
-  if (p->size) {
-    p->elements = malloc(p->size * sizeof(int));
-    if (p->elements == NULL) {
-      p->size = 0;
-    }
-  } else {
-    p->elements = NULL;
-  }
   p->type = CIST_PRIORITY;
   type = config_value_str(cfg_tags, "type");
   if (type) {
@@ -59,73 +51,28 @@ struct chunkID_set *chunkID_set_init(const char *config)
       return NULL; 
     }
   }
-  free(cfg_tags);
-  assert(p->type == CIST_PRIORITY || p->type == CIST_BITMAP);
-
-  return p;
-}
+  type = config_value_str(cfg_tags, "encoding");
+  if (type && !strcmp(type, "compact")) {
+    p->compact = 1;
+  } else if (type && strcmp(type, "dense")) {
+    chunkID_set_free(p);
+    free(cfg_tags);
 
-static int int_cmp(const void *pa, const void *pb)
-{
-  return (*(const int *)pa - *(const int *)pb);
-}
-
-static int check_insert_pos(const struct chunkID_set *h, int id)
-{
-  int a, b, c, r;
-
-  if (! h->n_elements) {
-    return 0;
+    return NULL;
   }
+  free(cfg_tags);
+  assert(p->type == CIST_PRIORITY || p->type == CIST_BITMAP);
 
-  a = 0;
-  b = c = h->n_elements - 1;
-
-  while ((r = int_cmp(&id, &h->elements[b])) != 0) {
-    if (r > 0) {
-      if (b == c) {
-        return b + 1;
-      } else {
-        a = b + 1;
-      }
-    } else {
-      if (b == a) {
-        return b;
-      } else {
-        c = b;
-      }
+  if (p->type == CIST_BITMAP) {
+    cist_bitmap_init(p, p->size);
+  } else if (p->size) {
+    p->elements = malloc(p->size * sizeof(int));
+    if (p->elements == NULL) {
+      p->size = 0;
     }
-    b = (a + c) / 2;
-  }
-
-  return -1;
-}
-
-static int chunkID_set_add_chunk_set(struct chunkID_set *h, int chunk_id)
-{
-  int pos;
-
-  pos = check_insert_pos(h, chunk_id);
-  if (pos < 0){
-    return 0;
   }
 
-  if (h->n_elements == h->size) {
-    int *res;
-
-    res = realloc(h->elements, (h->size + DEFAULT_SIZE_INCREMENT) * sizeof(int));
-    if (res == NULL) {
-      return -1;
-    }
-    h->size += DEFAULT_SIZE_INCREMENT;
-    h->elements = res;
-  }
-
-  memmove(&h->elements[pos + 1], &h->elements[pos] , ((h->n_elements++) - pos) * sizeof(int));
-
-  h->elements[pos] = chunk_id;
-
-  return h->n_elements;
+  return p;
 }
 
 static int chunkID_set_add_chunk_list(struct chunkID_set *h, int chunk_id)
@@ -152,7 +99,7 @@ static int chunkID_set_add_chunk_list(struct chunkID_set *h, int chunk_id)
 int chunkID_set_add_chunk(struct chunkID_set *h, int chunk_id)
 {
   if (h->type == CIST_BITMAP) {
-    return chunkID_set_add_chunk_set(h, chunk_id);
+    return cist_bitmap_add(h, chunk_id);
   } else {
     return chunkID_set_add_chunk_list(h, chunk_id);
   }
@@ -166,6 +113,9 @@ int chunkID_set_size(const struct chunkID_set *h)
 
 int chunkID_set_get_chunk(const struct chunkID_set *h, int i)
 {
+  if (h->type == CIST_BITMAP) {
+    return cist_bitmap_get(h, i);
+  }
   if (i < h->n_elements) {
     return h->elements[i];
   }
@@ -173,14 +123,6 @@ int chunkID_set_get_chunk(const struct chunkID_set *h, int i)
   return -1;
 }
 
-static inline int chunkID_set_check_set(const struct chunkID_set *h, int chunk_id)
-{
-  int *p;
-
-  p = bsearch(&chunk_id, h->elements, (size_t) h->n_elements, sizeof(h->elements[0]), int_cmp);
-  return p ? p - h->elements : -1;
-}
-
 static inline int chunkID_set_check_list(const struct chunkID_set *h, int chunk_id)
 {
   int i;
@@ -197,14 +139,42 @@ static inline int chunkID_set_check_list(const struct chunkID_set *h, int chunk_
 int chunkID_set_check(const struct chunkID_set *h, int chunk_id)
 {
   if (h->type == CIST_BITMAP) {
-    return chunkID_set_check_set(h, chunk_id);
+    /* The IDs are sorted, so the priority is the rank */
+    return cist_bitmap_has(h, chunk_id) ? cist_bitmap_count_below(h, chunk_id) : -1;
   } else {
     return chunkID_set_check_list(h, chunk_id);
   }
 }
 
+int chunkID_set_remove_chunk(struct chunkID_set *h, int chunk_id)
+{
+  int pos;
+
+  if (h->type == CIST_BITMAP) {
+    return cist_bitmap_remove(h, chunk_id);
+  }
+  pos = chunkID_set_check(h, chunk_id);
+  if (pos < 0) {
+    return 0;
+  }
+  memmove(&h->elements[pos], &h->elements[pos + 1], ((--h->n_elements) - pos) * sizeof(int));
+
+  return 1;
+}
+
 void chunkID_set_clear(struct chunkID_set *h, int size)
 {
+  if (h->type == CIST_BITMAP) {
+    /* Keep the ring, unless the expected size changes */
+    if (size == h->size && size) {
+      cist_bitmap_clear(h);
+    } else {
+      h->size = size;
+      cist_bitmap_init(h, size);
+    }
+
+    return;
+  }
   h->n_elements = 0;
   h->size = size;
   h->elements = realloc(h->elements, size * sizeof(int));
@@ -213,6 +183,36 @@ void chunkID_set_clear(struct chunkID_set *h, int size)
   }
 }
 
+/* Empty h and make it a set of the given type, reusing its memory */
+int cist_reset(struct chunkID_set *h, uint32_t type, int size)
+{
+  if (h->type != type) {
+    free(h->elements);
+    h->elements = NULL;
+    cist_bitmap_init(h, 0);
+    h->type = type;
+    h->size = 0;
+  }
+  if (type == CIST_BITMAP) {
+    cist_bitmap_clear(h);
+    h->size = size;
+
+    return 0;
+  }
+  h->n_elements = 0;
+  if (size > h->size) {
+    int *res = realloc(h->elements, size * sizeof(int));
+
+    if (res == NULL) {
+      return -1;
+    }
+    h->elements = res;
+    h->size = size;
+  }
+
+  return 0;
+}
+
 void chunkID_set_free(struct chunkID_set *h)
 {
   chunkID_set_clear(h,0);
@@ -222,7 +222,9 @@ void chunkID_set_free(struct chunkID_set *h)
 
 void chunkID_set_trim(struct chunkID_set *h, int size)
 {
-  if (h->n_elements > size) {
+  if (h->type == CIST_BITMAP) {
+    cist_bitmap_trim(h, size);
+  } else if (h->n_elements > size) {
     memmove(h->elements, h->elements + h->n_elements - size, sizeof(h->elements[0]) * size);
     h->n_elements = size;
   }
@@ -4,11 +4,53 @@
 #define CIST_BITMAP 1
 #define CIST_PRIORITY 2
 
+/*
+ * Sliding bitmap: bit (id % 64) of word (id / 64) is set if id is in the
+ * set, and word w is stored in words[w % nwords] (nwords is a power of 2).
+ * All the words outside [lo, hi] are 0, and hi - lo < nwords, with
+ * hi - lo <= CIST_BITMAP_MAX_WORDS, so that any CIST_BITMAP_MAX_SPAN
+ * consecutive IDs fit (IDs too far from the others are refused).
+ */
+#define CIST_BITMAP_MAX_WORDS (1 << 14)	// 2^20 IDs
+/* No bitmap set can span (last - first + 1) more IDs than this */
+#define CIST_BITMAP_MAX_SPAN (CIST_BITMAP_MAX_WORDS * 64)
+
+struct cist_bitmap {
+  uint64_t cursor;	// get_chunk() cursor (see chunkids_bitmap.c)
+  uint32_t nwords;
+  uint64_t words[];
+};
+
 struct chunkID_set {
   uint32_t type;
   uint32_t size;
   uint32_t n_elements;
-  int *elements;
+  int *elements;		// CIST_PRIORITY only
+  struct cist_bitmap *bitmap;	// CIST_BITMAP only
+  int lo;			// first and last non-empty words of the bitmap
+  int hi;			// (meaningful if n_elements > 0)
+  int compact;			// encoded in the most compact encoding (see chunkids_encoding.c)
 };
 
+int cist_reset(struct chunkID_set *h, uint32_t type, int size);
+
+int cist_bitmap_init(struct chunkID_set *h, int size);
+void cist_bitmap_clear(struct chunkID_set *h);
+int cist_bitmap_add(struct chunkID_set *h, int id);
+int cist_bitmap_has(const struct chunkID_set *h, int id);
+int cist_bitmap_count_below(const struct chunkID_set *h, int id);
+int cist_bitmap_count_common(const struct chunkID_set *h, const struct chunkID_set *a);
+int cist_bitmap_get(const struct chunkID_set *h, int i);
+int cist_bitmap_remove(struct chunkID_set *h, int id);
+void cist_bitmap_trim(struct chunkID_set *h, int size);
+int cist_bitmap_earliest(const struct chunkID_set *h);
+int cist_bitmap_latest(const struct chunkID_set *h);
+int cist_bitmap_next(const struct chunkID_set *h, int id, int in);
+int cist_bitmap_union(struct chunkID_set *h, const struct chunkID_set *a);
+int cist_bitmap_symmetric_difference(struct chunkID_set *h, const struct chunkID_set *a);
+void cist_bitmap_intersection(struct chunkID_set *h, const struct chunkID_set *a);
+void cist_bitmap_difference(struct chunkID_set *h, const struct chunkID_set *a);
+void cist_bitmap_export(const struct chunkID_set *h, uint8_t *buff, int base, int bits);
+int cist_bitmap_import(struct chunkID_set *h, const uint8_t *buff, int base, int bits);
+
 #endif /* CHUNKID_SET_PRIVATE */
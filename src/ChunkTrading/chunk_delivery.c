@@ -6,15 +6,33 @@
  */
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "int_coding.h"
 #include "chunk.h"
+#include "chunkidset.h"
 #include "net_helper.h"
+#include "peer.h"
+#include "peerset.h"
 #include "trade_msg_la.h"
 #include "trade_msg_ha.h"
+#include "trade_sig_la.h"
+#include "trade_sig_ha.h"
+#include "trade_fec.h"
 #include "grapes_msg_types.h"
+#include "signaling_private.h"
+#include "config.h"
+
+#define TRAILER_META_LEN 3
+#define TRAILER_MAX_LEN 1024
 
 static struct nodeID *localID;
+//BufferMap trailers: 0 if disabled, otherwise maximum size in bytes
+static int trailer_max;
+//BufferMap received in a trailer
+static struct chunkID_set *trailer_bmap;
+//the chunks to send are reference counted: their payloads can be shared
+static int refcount;
 
 int parseChunkMsg(const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *transid)
 {
@@ -34,6 +52,143 @@ int parseChunkMsg(const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *
   return 1;
 }
 
+int parseChunkMsgView(uint8_t *buff, int buff_len, struct chunk *c, uint16_t *transid)
+{
+  int res;
+
+  if (c == NULL || buff_len < (int)sizeof(*transid)) {
+    return -1;
+  }
+
+  res = decodeChunkView(c, buff + sizeof(*transid), buff_len - sizeof(*transid));
+  if (res < 0) {
+    return -1;
+  }
+
+  *transid = int16_rcpy(buff);
+
+  return 1;
+}
+
+/*
+ * The BufferMap trailer of a chunk message is encoded as a signaling
+ * chunkID set, having the message type (MSG_SIG_BMSEQ or MSG_SIG_BMDELTA)
+ * and the sequence number as metadata.
+ */
+static void trailer_parse(struct peer *from, const uint8_t *buff, int buff_len, uint16_t transid)
+{
+  const uint8_t *meta;
+  int meta_len, res;
+
+  if (trailer_bmap == NULL) {
+    trailer_bmap = chunkID_set_init("type=bitmap");
+    if (trailer_bmap == NULL) {
+      return;
+    }
+  }
+  res = decodeChunkSignalingInto(trailer_bmap, &meta, &meta_len, buff, buff_len);
+  if (res <= 0 || meta_len != TRAILER_META_LEN ||
+      (meta[0] != MSG_SIG_BMSEQ && meta[0] != MSG_SIG_BMDELTA)) {
+    fprintf(stderr, "Invalid BufferMap trailer in chunk message\n");
+
+    return;
+  }
+  if (bmap_apply(from, meta[0], int16_rcpy(meta + 1), trailer_bmap) == 0) {
+    bmap_request(from, transid);
+  }
+}
+
+int parseChunkMsgPeerset(struct peerset *ps, const struct nodeID *from,
+                         const uint8_t *buff, int buff_len,
+                         struct chunk *c, uint16_t *transid)
+{
+  struct peer *p;
+  int res;
+
+  if (parseChunkMsg(buff, buff_len, c, transid) < 0) {
+    return -1;
+  }
+
+  res = sizeof(*transid) + CHUNK_HEADER_SIZE + c->size + c->attributes_size;
+  if (buff_len > res && (p = peerset_get_peer(ps, from)) != NULL) {
+    trailer_parse(p, buff + res, buff_len - res, *transid);
+  }
+
+  return 1;
+}
+
+int peekChunkId(const uint8_t *buff, int buff_len, int *id)
+{
+  if (buff_len < (int)sizeof(uint16_t) + 4) {
+    return -1;
+  }
+  *id = int_rcpy(buff + sizeof(uint16_t));
+
+  return 0;
+}
+
+int parseChunkMsgShared(uint8_t *block, const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *transid)
+{
+  int res;
+
+  if (c == NULL) {
+    return -1;
+  }
+
+  res = decodeChunkShared(c, block, buff + sizeof(*transid), buff_len - sizeof(*transid));
+  if (res < 0) {
+    return -1;
+  }
+
+  *transid = int16_rcpy(buff);
+
+  return 1;
+}
+
+/*
+ * Encode the message header of a chunk in hdr, and describe the whole
+ * message (header, payload, attributes) in iov. Returns the number of
+ * buffers, setting in shared the ones which are reference counted.
+ */
+static int chunk_iov(int type, const struct chunk *c, uint16_t transid, uint8_t *hdr, struct iovec *iov,
+                     unsigned int *shared)
+{
+  int n = 1;
+
+  *shared = 0;
+  /* Only the header is encoded: the payload is sent from the chunk */
+  hdr[0] = type;
+  int16_cpy(hdr + 1, transid);
+  encodeChunkHeader(c, hdr + 1 + sizeof(transid), CHUNK_HEADER_SIZE);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = 1 + sizeof(transid) + CHUNK_HEADER_SIZE;
+  if (c->size) {
+    iov[n].iov_base = c->data;
+    iov[n].iov_len = c->size;
+    *shared |= refcount << n;
+    n++;
+  }
+  if (c->attributes_size) {
+    iov[n].iov_base = c->attributes;
+    iov[n].iov_len = c->attributes_size;
+    *shared |= refcount << n;
+    n++;
+  }
+
+  return n;
+}
+
+static int chunk_send(struct nodeID *to, const struct iovec *iov, int n, unsigned int shared)
+{
+  int res;
+
+  if (send_to_peers_iov_shared(localID, &to, 1, iov, n, shared, &res) < 0) {
+    return -1;
+  }
+
+  return res;
+}
+
 /**
  * Send a Chunk to a target Peer
  *
@@ -43,28 +198,89 @@ int parseChunkMsg(const uint8_t *buff, int buff_len, struct chunk *c, uint16_t *
  * @param[in] c Chunk to send
  * @return 0 on success, <0 on error
  */
-//TO CHECK AND CORRECT
-//XXX Send data is in char while our buffer is in uint8
 int sendChunk(struct nodeID *to, const struct chunk *c, uint16_t transid)
 {
-  int buff_len;
-  uint8_t *buff;
-  int res;
+  uint8_t hdr[1 + sizeof(transid) + CHUNK_HEADER_SIZE];
+  struct iovec iov[3];
+  unsigned int shared;
+  int n;
+
+  n = chunk_iov(MSG_TYPE_CHUNK, c, transid, hdr, iov, &shared);
+  if (chunk_send(to, iov, n, shared) < 0) {
+    return -1;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int sendRepairChunk(struct nodeID *to, const struct chunk *repair, uint16_t transid)
+{
+  uint8_t hdr[1 + sizeof(transid) + CHUNK_HEADER_SIZE];
+  struct iovec iov[3];
+  unsigned int shared;
+  int n;
 
-  buff_len  = 20 + sizeof(transid) + c->size + c->attributes_size;
-  buff = malloc(buff_len + 1);
-  if (buff == NULL) {
-      return -1;
+  n = chunk_iov(MSG_TYPE_FEC, repair, transid, hdr, iov, &shared);
+  if (chunk_send(to, iov, n, shared) < 0) {
+    return -1;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int sendChunkPeer(struct peer *to, const struct chunk *c, uint16_t transid,
+                  const struct chunkID_set *bmap)
+{
+  uint8_t hdr[1 + sizeof(transid) + CHUNK_HEADER_SIZE];
+  uint8_t trailer[TRAILER_MAX_LEN];
+  uint8_t meta[TRAILER_META_LEN];
+  const struct chunkID_set *msg;
+  struct iovec iov[4];
+  unsigned int shared;
+  uint16_t seq;
+  int n, type = -1;
+
+  n = chunk_iov(MSG_TYPE_CHUNK, c, transid, hdr, iov, &shared);
+  if (trailer_max && bmap) {
+    type = bmap_prepare(to, bmap, &msg, &seq);
+  }
+  if (type >= 0) {
+    int len;
+
+    meta[0] = type;
+    int16_cpy(meta + 1, seq);
+    len = encodeChunkSignaling(msg, meta, sizeof(meta), trailer, trailer_max);
+    if (len > 0) {
+      iov[n].iov_base = trailer;
+      iov[n].iov_len = len;
+      n++;
+    } else {
+      /* Too large: send the BufferMap in a later message */
+      type = -1;
+    }
+  }
+  if (chunk_send(to->id, iov, n, shared) < 0) {
+    return -1;
+  }
+  if (type >= 0) {
+    bmap_commit(to, bmap, type, seq);
   }
-  buff[0] = MSG_TYPE_CHUNK;
-  int16_cpy(buff + 1, transid);
-  res = encodeChunk(c, buff + 1 + sizeof(transid), buff_len);
-  send_to_peer(localID, to, buff, buff_len + 1);
-  free(buff);
 
   return EXIT_SUCCESS;
 }
 
+int sendChunkToPeers(struct nodeID **to, int n, const struct chunk *c, uint16_t transid, int *res)
+{
+  uint8_t hdr[1 + sizeof(transid) + CHUNK_HEADER_SIZE];
+  struct iovec iov[3];
+  unsigned int shared;
+  int iovcnt;
+
+  iovcnt = chunk_iov(MSG_TYPE_CHUNK, c, transid, hdr, iov, &shared);
+
+  return send_to_peers_iov_shared(localID, to, n, iov, iovcnt, shared, res);
+}
+
 int chunkDeliveryInit(struct nodeID *myID)
 {
   localID = myID;
@@ -72,3 +288,27 @@ int chunkDeliveryInit(struct nodeID *myID)
   return 1;
 }
 
+int chunkDeliveryConfig(const char *config)
+{
+  struct tag *cfg_tags;
+  int piggyback;
+
+  cfg_tags = config_parse(config);
+  if (cfg_tags == NULL) {
+    return -1;
+  }
+  config_value_int_default(cfg_tags, "piggyback", &piggyback, 0);
+  config_value_int_default(cfg_tags, "piggyback_max", &trailer_max, 256);
+  config_value_int_default(cfg_tags, "refcount", &refcount, 0);
+  free(cfg_tags);
+  refcount = refcount != 0;
+  if (trailer_max > TRAILER_MAX_LEN) {
+    trailer_max = TRAILER_MAX_LEN;
+  }
+  if (!piggyback || trailer_max < 0) {
+    trailer_max = 0;
+  }
+
+  return 1;
+}
+
@@ -14,12 +14,11 @@
 #include "trade_msg_la.h"
 #include "int_coding.h"
 
-int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
+int encodeChunkHeader(const struct chunk *c, uint8_t *buff, int buff_len)
 {
   uint32_t half_ts;
 
-  if (buff_len < 20 + c->size + c->attributes_size) {
-    /* Not enough space... */
+  if (buff_len < CHUNK_HEADER_SIZE) {
     return -1;
   }
 
@@ -30,17 +29,29 @@ int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
   int_cpy(buff + 8, half_ts);
   int_cpy(buff + 12, c->size);
   int_cpy(buff + 16, c->attributes_size);
-  memcpy(buff + 20, c->data, c->size);
+
+  return CHUNK_HEADER_SIZE;
+}
+
+int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
+{
+  if (buff_len < CHUNK_HEADER_SIZE + c->size + c->attributes_size) {
+    /* Not enough space... */
+    return -1;
+  }
+
+  encodeChunkHeader(c, buff, buff_len);
+  memcpy(buff + CHUNK_HEADER_SIZE, c->data, c->size);
   if (c->attributes_size) {
-    memcpy(buff + 20 + c->size, c->attributes, c->attributes_size);
+    memcpy(buff + CHUNK_HEADER_SIZE + c->size, c->attributes, c->attributes_size);
   }
 
-  return 20 + c->size + c->attributes_size;
+  return CHUNK_HEADER_SIZE + c->size + c->attributes_size;
 }
 
-int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len)
+static int chunk_header_decode(struct chunk *c, const uint8_t *buff, int buff_len)
 {
-  if (buff_len < 20) {
+  if (buff_len < CHUNK_HEADER_SIZE) {
     return -1;
   }
   c->id = int_rcpy(buff);
@@ -50,25 +61,83 @@ int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len)
   c->size = int_rcpy(buff + 12);
   c->attributes_size = int_rcpy(buff + 16);
 
-  if (buff_len < c->size + 20) {
+  if (c->size < 0 || c->attributes_size < 0) {
+    return -2;
+  }
+  /* buff_len >= CHUNK_HEADER_SIZE here, so none of these can overflow */
+  if (c->size > buff_len - CHUNK_HEADER_SIZE) {
     return -2;
   }
+  if (c->attributes_size > buff_len - CHUNK_HEADER_SIZE - c->size) {
+    return -4;
+  }
+
+  return 0;
+}
+
+/* Point the payload and the attributes of c inside the encoded chunk */
+static int chunk_view(struct chunk *c, uint8_t *buff)
+{
+  c->data = buff + CHUNK_HEADER_SIZE;
+  c->attributes = c->attributes_size > 0 ? buff + CHUNK_HEADER_SIZE + c->size : NULL;
+
+  return CHUNK_HEADER_SIZE + c->size + c->attributes_size;
+}
+
+int decodeChunkView(struct chunk *c, uint8_t *buff, int buff_len)
+{
+  int res;
+
+  res = chunk_header_decode(c, buff, buff_len);
+  if (res < 0) {
+    return res;
+  }
+
+  return chunk_view(c, buff);
+}
+
+int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len)
+{
+  int res;
+
+  res = chunk_header_decode(c, buff, buff_len);
+  if (res < 0) {
+    return res;
+  }
   c->data = malloc(c->size);
   if (c->data == NULL) {
     return -3;
   }
-  memcpy(c->data, buff + 20, c->size);
+  memcpy(c->data, buff + CHUNK_HEADER_SIZE, c->size);
 
+  c->attributes = NULL;
   if (c->attributes_size > 0) {
-    if (buff_len < c->size + c->attributes_size) {
-      return -4;
-    }
     c->attributes = malloc(c->attributes_size);
     if (c->attributes == NULL) {
+      free(c->data);
+      c->data = NULL;
+
       return -5;
     }
-    memcpy(c->attributes, buff + 20 + c->size, c->attributes_size);
+    memcpy(c->attributes, buff + CHUNK_HEADER_SIZE + c->size, c->attributes_size);
+  }
+
+  return CHUNK_HEADER_SIZE + c->size + c->attributes_size;
+}
+
+int decodeChunkShared(struct chunk *c, uint8_t *block, const uint8_t *buff, int buff_len)
+{
+  int res;
+
+  res = chunk_header_decode(c, buff, buff_len);
+  if (res < 0) {
+    return res;
+  }
+  /* buff is inside block: get a writable pointer to it from block */
+  res = chunk_view(c, block + (buff - block));
+  if (chunk_adopt(c, block) < 0) {
+    return -3;
   }
 
-  return 20 + c->size + c->attributes_size;
+  return res;
 }
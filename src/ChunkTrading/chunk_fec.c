@@ -0,0 +1,629 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software;
+ *  see lgpl-2.1.txt
+ */
+
+/*
+ * Systematic Reed-Solomon code over groups of k chunks. Every chunk is
+ * protected as a block made of a header (sizes and timestamp), the
+ * payload and the attributes, zero padded to the size of the largest
+ * block in the group. Repair block j is sum_i C[j][i] * block_i, where
+ * C[j][i] = 1 / ((k + j) ^ i) is a Cauchy matrix: any k rows of the
+ * generator matrix (identity on top of C) are linearly independent.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "int_coding.h"
+#include "trade_fec.h"
+#include "fec_private.h"
+#include "config.h"
+
+#define BLOCK_HDR 16	// size, attributes size, timestamp
+#define REPAIR_HDR 8	// k, m, index, unused, block size
+
+struct fec_encoder {
+  int k, m;
+  int refcount;			// the user chunks are reference counted
+  gf256_kernel mul_add;
+  int base;			// ID of the first chunk of the group (-1 if none)
+  int n;			// chunks of the group already added
+  struct chunk *src;		// the chunks of the group (id < 0 if missing)
+  struct chunk *repair;
+  int n_repair;			// repair chunks not returned yet
+};
+
+struct fec_group {
+  int base;			// -1 if the slot is not used
+  int n;			// chunks received (source or repair)
+  int done;
+  int len;			// block size (0 if unknown)
+  struct chunk *src;		// id < 0 if missing
+  struct chunk *repair;		// data == NULL if missing
+};
+
+struct fec_decoder {
+  int k, m;
+  int refcount;
+  gf256_kernel mul_add;
+  int n_groups;
+  struct fec_group *groups;
+  uint8_t *matrix;		// k x k, for the inversion
+  uint8_t *inverse;
+  int *rows;
+  struct chunk *ready;		// rebuilt chunks, not returned yet
+  int n_ready;
+  int ready_size;
+};
+
+static int fec_config(const char *config, int *k, int *m, int *groups, int *refcount,
+                      gf256_kernel *mul_add)
+{
+  struct tag *cfg_tags;
+
+  cfg_tags = config_parse(config);
+  if (cfg_tags == NULL) {
+    return -1;
+  }
+  config_value_int_default(cfg_tags, "k", k, 8);
+  config_value_int_default(cfg_tags, "m", m, 2);
+  config_value_int_default(cfg_tags, "refcount", refcount, 0);
+  if (groups) {
+    config_value_int_default(cfg_tags, "groups", groups, 8);
+  }
+  *mul_add = gf256_kernel_select(config_value_str(cfg_tags, "kernel"));
+  free(cfg_tags);
+  if (*mul_add == NULL || *k < 1 || *m < 1 || *k + *m > 256 || (groups && *groups < 1)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static uint8_t coef(int k, int j, int i)
+{
+  return gf256_inv((k + j) ^ i);
+}
+
+static int block_len(const struct chunk *c)
+{
+  return BLOCK_HDR + c->size + c->attributes_size;
+}
+
+/* dst ^= coef * (block of c), without building the block */
+static void block_mul_add(gf256_kernel mul_add, uint8_t *dst, const struct chunk *c, uint8_t coef)
+{
+  uint8_t hdr[BLOCK_HDR];
+
+  int_cpy(hdr, c->size);
+  int_cpy(hdr + 4, c->attributes_size);
+  int_cpy(hdr + 8, c->timestamp >> 32);
+  int_cpy(hdr + 12, c->timestamp);
+  gf256_mul_add(mul_add, dst, hdr, coef, BLOCK_HDR);
+  gf256_mul_add(mul_add, dst + BLOCK_HDR, c->data, coef, c->size);
+  gf256_mul_add(mul_add, dst + BLOCK_HDR + c->size, c->attributes, coef, c->attributes_size);
+}
+
+/*
+ * Keep a chunk of the user: take references to it if it is reference
+ * counted, copy it otherwise (the kept chunks are always released with
+ * chunk_release())
+ */
+static int chunk_ref(struct chunk *dst, const struct chunk *c, int refcount)
+{
+  if (refcount) {
+    *dst = *c;
+    dst->data = chunk_data_ref(c->data);
+    dst->attributes = chunk_data_ref(c->attributes);
+
+    return 0;
+  }
+  if (chunk_alloc(dst, c->size, c->attributes_size) < 0) {
+    return -1;
+  }
+  memcpy(dst->data, c->data, c->size);
+  if (c->attributes_size > 0) {
+    memcpy(dst->attributes, c->attributes, c->attributes_size);
+  }
+  dst->id = c->id;
+  dst->timestamp = c->timestamp;
+
+  return 0;
+}
+
+/* Release a chunk allocated for the user (malloc()ed, unless refcount) */
+static void chunk_user_free(struct chunk *c, int refcount)
+{
+  if (refcount) {
+    chunk_release(c);
+  } else {
+    free(c->data);
+    c->data = NULL;
+    free(c->attributes);
+    c->attributes = NULL;
+  }
+}
+
+static void chunks_release(struct chunk *c, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (c[i].id >= 0) {
+      chunk_release(&c[i]);
+      c[i].id = -1;
+    }
+  }
+}
+
+struct fec_encoder *fecEncoderInit(const char *config)
+{
+  struct fec_encoder *e;
+  int k, m, refcount;
+  gf256_kernel mul_add;
+
+  if (fec_config(config, &k, &m, NULL, &refcount, &mul_add) < 0) {
+    return NULL;
+  }
+  e = malloc(sizeof(struct fec_encoder));
+  if (e == NULL) {
+    return NULL;
+  }
+  e->k = k;
+  e->m = m;
+  e->refcount = refcount;
+  e->mul_add = mul_add;
+  e->base = -1;
+  e->n = 0;
+  e->n_repair = 0;
+  e->src = malloc(k * sizeof(struct chunk));
+  e->repair = malloc(m * sizeof(struct chunk));
+  if (e->src == NULL || e->repair == NULL) {
+    free(e->src);
+    free(e->repair);
+    free(e);
+
+    return NULL;
+  }
+  for (k = 0; k < e->k; k++) {
+    e->src[k].id = -1;
+  }
+
+  return e;
+}
+
+static int repair_compute(struct fec_encoder *e)
+{
+  int i, j, len = 0;
+
+  for (i = 0; i < e->k; i++) {
+    if (block_len(&e->src[i]) > len) {
+      len = block_len(&e->src[i]);
+    }
+  }
+
+  for (j = 0; j < e->m; j++) {
+    struct chunk *r = &e->repair[j];
+
+    r->data = e->refcount ? chunk_data_alloc(REPAIR_HDR + len) : malloc(REPAIR_HDR + len);
+    if (r->data == NULL) {
+      while (j--) {
+        chunk_user_free(&e->repair[j], e->refcount);
+      }
+
+      return -1;
+    }
+    memset(r->data, 0, REPAIR_HDR + len);
+    r->data[0] = e->k;
+    r->data[1] = e->m;
+    r->data[2] = j;
+    int_cpy(r->data + 4, len);
+    r->id = e->base;
+    r->timestamp = e->src[e->k - 1].timestamp;
+    r->size = REPAIR_HDR + len;
+    r->attributes = NULL;
+    r->attributes_size = 0;
+  }
+  for (i = 0; i < e->k; i++) {
+    for (j = 0; j < e->m; j++) {
+      block_mul_add(e->mul_add, e->repair[j].data + REPAIR_HDR, &e->src[i], coef(e->k, j, i));
+    }
+  }
+
+  return e->m;
+}
+
+int fecEncode(struct fec_encoder *e, const struct chunk *c)
+{
+  int base, res;
+
+  if (c->id < 0) {
+    return -1;
+  }
+  base = c->id - c->id % e->k;
+  if (base != e->base) {
+    /* A new group: the current one (if any) is incomplete */
+    chunks_release(e->src, e->k);
+    e->base = base;
+    e->n = 0;
+  }
+  if (e->src[c->id - base].id >= 0) {
+    return 0;
+  }
+  if (chunk_ref(&e->src[c->id - base], c, e->refcount) < 0) {
+    return -1;
+  }
+  if (++e->n < e->k) {
+    return 0;
+  }
+
+  /* Repair chunks of the previous group which have not been fetched are lost */
+  while (e->n_repair) {
+    chunk_user_free(&e->repair[e->m - e->n_repair--], e->refcount);
+  }
+  res = repair_compute(e);
+  chunks_release(e->src, e->k);
+  e->base = -1;
+  if (res < 0) {
+    return res;
+  }
+  e->n_repair = e->m;
+
+  return e->n_repair;
+}
+
+int fecEncoderGet(struct fec_encoder *e, struct chunk *repair)
+{
+  if (e->n_repair == 0) {
+    return 0;
+  }
+  *repair = e->repair[e->m - e->n_repair--];
+
+  return 1;
+}
+
+void fecEncoderFree(struct fec_encoder *e)
+{
+  chunks_release(e->src, e->k);
+  while (e->n_repair) {
+    chunk_user_free(&e->repair[e->m - e->n_repair--], e->refcount);
+  }
+  free(e->src);
+  free(e->repair);
+  free(e);
+}
+
+static void group_reset(struct fec_decoder *d, struct fec_group *g, int base)
+{
+  int j;
+
+  chunks_release(g->src, d->k);
+  for (j = 0; j < d->m; j++) {
+    if (g->repair[j].data) {
+      chunk_release(&g->repair[j]);
+    }
+  }
+  g->base = base;
+  g->n = 0;
+  g->done = 0;
+  g->len = 0;
+}
+
+struct fec_decoder *fecDecoderInit(const char *config)
+{
+  struct fec_decoder *d;
+  int i, j, k, m, groups, refcount;
+  gf256_kernel mul_add;
+
+  if (fec_config(config, &k, &m, &groups, &refcount, &mul_add) < 0) {
+    return NULL;
+  }
+  d = malloc(sizeof(struct fec_decoder));
+  if (d == NULL) {
+    return NULL;
+  }
+  memset(d, 0, sizeof(struct fec_decoder));
+  d->k = k;
+  d->m = m;
+  d->refcount = refcount;
+  d->mul_add = mul_add;
+  d->n_groups = groups;
+  d->groups = calloc(groups, sizeof(struct fec_group));
+  d->matrix = malloc(k * k);
+  d->inverse = malloc(k * k);
+  d->rows = malloc(k * sizeof(int));
+  if (d->groups == NULL || d->matrix == NULL || d->inverse == NULL ||
+      d->rows == NULL) {
+    fecDecoderFree(d);
+
+    return NULL;
+  }
+  for (i = 0; i < groups; i++) {
+    struct fec_group *g = &d->groups[i];
+
+    g->base = -1;
+    g->src = calloc(k, sizeof(struct chunk));
+    g->repair = calloc(m, sizeof(struct chunk));
+    if (g->src == NULL || g->repair == NULL) {
+      fecDecoderFree(d);
+
+      return NULL;
+    }
+    for (j = 0; j < k; j++) {
+      g->src[j].id = -1;
+    }
+  }
+
+  return d;
+}
+
+/* Gauss-Jordan elimination of d->matrix in d->inverse */
+static int matrix_invert(struct fec_decoder *d)
+{
+  int k = d->k, r, c, i;
+  uint8_t *a = d->matrix, *b = d->inverse;
+
+  memset(b, 0, k * k);
+  for (r = 0; r < k; r++) {
+    b[r * k + r] = 1;
+  }
+  for (c = 0; c < k; c++) {
+    uint8_t f;
+
+    for (r = c; r < k && a[r * k + c] == 0; r++);
+    if (r == k) {
+      return -1;
+    }
+    if (r != c) {
+      for (i = 0; i < k; i++) {
+        uint8_t t = a[r * k + i];
+
+        a[r * k + i] = a[c * k + i];
+        a[c * k + i] = t;
+        t = b[r * k + i];
+        b[r * k + i] = b[c * k + i];
+        b[c * k + i] = t;
+      }
+    }
+    f = gf256_inv(a[c * k + c]);
+    for (i = 0; i < k; i++) {
+      a[c * k + i] = gf256_mul(a[c * k + i], f);
+      b[c * k + i] = gf256_mul(b[c * k + i], f);
+    }
+    for (r = 0; r < k; r++) {
+      if (r != c && a[r * k + c]) {
+        f = a[r * k + c];
+        for (i = 0; i < k; i++) {
+          a[r * k + i] ^= gf256_mul(a[c * k + i], f);
+          b[r * k + i] ^= gf256_mul(b[c * k + i], f);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Build the chunk from a decoded block */
+static int block_decode(struct fec_decoder *d, uint8_t *block, int len, int id)
+{
+  struct chunk *c = &d->ready[d->n_ready];
+
+  c->id = id;
+  c->size = int_rcpy(block);
+  c->attributes_size = int_rcpy(block + 4);
+  c->timestamp = int_rcpy(block + 8);
+  c->timestamp = c->timestamp << 32 | int_rcpy(block + 12);
+  if (c->size < 0 || c->attributes_size < 0 ||
+      c->size > len - BLOCK_HDR || c->attributes_size > len - BLOCK_HDR - c->size) {
+    return -1;
+  }
+  c->attributes = NULL;
+  if (c->attributes_size) {
+    c->attributes = d->refcount ? chunk_data_alloc(c->attributes_size) : malloc(c->attributes_size);
+    if (c->attributes == NULL) {
+      return -1;
+    }
+    memcpy(c->attributes, block + BLOCK_HDR + c->size, c->attributes_size);
+  }
+  if (d->refcount) {
+    /* The payload is not copied: it shares the block */
+    c->data = chunk_data_slice(block, BLOCK_HDR);
+  } else {
+    c->data = malloc(c->size);
+    if (c->data) {
+      memcpy(c->data, block + BLOCK_HDR, c->size);
+    }
+  }
+  if (c->data == NULL) {
+    chunk_user_free(c, d->refcount);
+
+    return -1;
+  }
+  d->n_ready++;
+
+  return 0;
+}
+
+static int group_decode(struct fec_decoder *d, struct fec_group *g)
+{
+  int i, j, t, n = 0, k = d->k;
+
+  /* Use the received chunks, and enough repair chunks to have k rows */
+  for (i = 0; i < k; i++) {
+    if (g->src[i].id >= 0) {
+      d->rows[n++] = i;
+    }
+  }
+  for (j = 0; j < d->m && n < k; j++) {
+    if (g->repair[j].data) {
+      d->rows[n++] = k + j;
+    }
+  }
+  for (t = 0; t < k; t++) {
+    for (i = 0; i < k; i++) {
+      d->matrix[t * k + i] = d->rows[t] < k ? d->rows[t] == i : coef(k, d->rows[t] - k, i);
+    }
+  }
+  if (matrix_invert(d) < 0) {
+    return -1;
+  }
+  if (d->n_ready + k > d->ready_size) {
+    struct chunk *r = realloc(d->ready, (d->n_ready + k) * sizeof(struct chunk));
+
+    if (r == NULL) {
+      return -1;
+    }
+    d->ready = r;
+    d->ready_size = d->n_ready + k;
+  }
+
+  for (i = 0; i < k; i++) {
+    uint8_t *block;
+
+    if (g->src[i].id >= 0) {
+      continue;
+    }
+    block = chunk_data_alloc(g->len);
+    if (block == NULL) {
+      return -1;
+    }
+    memset(block, 0, g->len);
+    for (t = 0; t < k; t++) {
+      uint8_t f = d->inverse[i * k + t];
+
+      if (d->rows[t] < k) {
+        block_mul_add(d->mul_add, block, &g->src[d->rows[t]], f);
+      } else {
+        gf256_mul_add(d->mul_add, block, g->repair[d->rows[t] - k].data + REPAIR_HDR, f, g->len);
+      }
+    }
+    if (block_decode(d, block, g->len, g->base + i) < 0) {
+      chunk_data_unref(block);
+
+      return -1;
+    }
+    chunk_data_unref(block);
+  }
+
+  return 0;
+}
+
+int fecDecode(struct fec_decoder *d, const struct chunk *c, int repair)
+{
+  struct fec_group *g;
+  struct chunk *slot;
+  int base, pos, i;
+
+  if (c->id < 0) {
+    return -1;
+  }
+  if (repair) {
+    if (c->size < REPAIR_HDR || c->data[0] != d->k || c->data[1] != d->m ||
+        c->data[2] >= d->m || c->id % d->k || int_rcpy(c->data + 4) != c->size - REPAIR_HDR) {
+      return -1;
+    }
+    base = c->id;
+    pos = c->data[2];
+  } else {
+    base = c->id - c->id % d->k;
+    pos = c->id - base;
+  }
+
+  g = &d->groups[(base / d->k) % d->n_groups];
+  if (g->base != base) {
+    if (g->base > base) {
+      /* Too old */
+      return d->n_ready;
+    }
+    group_reset(d, g, base);
+  }
+  if (g->done) {
+    return d->n_ready;
+  }
+
+  if (repair) {
+    slot = &g->repair[pos];
+    if (slot->data) {
+      return d->n_ready;
+    }
+    if (g->len && g->len != c->size - REPAIR_HDR) {
+      return -1;
+    }
+    if (g->len == 0) {
+      /* The blocks of the sources received so far must fit */
+      for (i = 0; i < d->k; i++) {
+        if (g->src[i].id >= 0 && block_len(&g->src[i]) > c->size - REPAIR_HDR) {
+          return -1;
+        }
+      }
+    }
+    g->len = c->size - REPAIR_HDR;
+  } else {
+    slot = &g->src[pos];
+    if (slot->id >= 0) {
+      return d->n_ready;
+    }
+    if (g->len && block_len(c) > g->len) {
+      return -1;
+    }
+  }
+  if (chunk_ref(slot, c, d->refcount) < 0) {
+    return -1;
+  }
+  if (++g->n < d->k) {
+    return d->n_ready;
+  }
+
+  /* Enough chunks: rebuild the missing ones */
+  g->done = 1;
+  if (g->len && group_decode(d, g) < 0) {
+    return -1;
+  }
+  group_reset(d, g, base);
+  g->done = 1;
+
+  return d->n_ready;
+}
+
+int fecDecoderGet(struct fec_decoder *d, struct chunk *c)
+{
+  if (d->n_ready == 0) {
+    return 0;
+  }
+  *c = d->ready[0];
+  memmove(&d->ready[0], &d->ready[1], --d->n_ready * sizeof(struct chunk));
+
+  return 1;
+}
+
+void fecDecoderFree(struct fec_decoder *d)
+{
+  int i;
+
+  if (d->groups) {
+    for (i = 0; i < d->n_groups; i++) {
+      struct fec_group *g = &d->groups[i];
+
+      if (g->src && g->repair) {
+        group_reset(d, g, -1);
+      }
+      free(g->src);
+      free(g->repair);
+    }
+  }
+  while (d->n_ready) {
+    chunk_user_free(&d->ready[--d->n_ready], d->refcount);
+  }
+  free(d->groups);
+  free(d->matrix);
+  free(d->inverse);
+  free(d->rows);
+  free(d->ready);
+  free(d);
+}
@@ -0,0 +1,405 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software;
+ *  see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "net_helper.h"
+#include "chunkidset.h"
+#include "trade_sig_ha.h"
+#include "trade_pull.h"
+#include "config.h"
+#include "rtt_private.h"
+
+#define DEFAULT_SIZE_INCREMENT 16
+#define RATE_INTERVAL_MIN 100000	// us
+
+struct pull_peer {
+  struct nodeID *id;
+  double window;
+  double ssthresh;
+  int outstanding;
+  int srtt;			// request -> chunk time, in us (0 if unknown)
+  int rttvar;
+  double rate;			// delivered chunks per second (0 if unknown)
+  int rate_count;
+  struct timeval rate_start;
+  struct timeval last_decrease;
+};
+
+struct pull_request {
+  int chunk;
+  int peer;			// index in peers
+  struct timeval sent;
+  struct timeval timeout;
+  struct timeval deadline;	// not set if there is no deadline
+};
+
+struct pull_engine {
+  double window_init;
+  double window_max;
+  int rto_init;			// timeouts, in us
+  int rto_min;
+  int rto_max;
+  uint16_t trans_id;
+  int n_peers, peers_size;
+  struct pull_peer *peers;
+  int n_requests, requests_size;
+  struct pull_request *requests;
+  struct chunkID_set *scratch;
+};
+
+static void *grow(void *array, int *size, int element_size)
+{
+  void *res = realloc(array, (*size + DEFAULT_SIZE_INCREMENT) * element_size);
+
+  if (res) {
+    *size += DEFAULT_SIZE_INCREMENT;
+  }
+
+  return res;
+}
+
+static int peer_find(const struct pull_engine *pe, const struct nodeID *id)
+{
+  int i;
+
+  for (i = 0; i < pe->n_peers; i++) {
+    if (nodeid_equal(pe->peers[i].id, id)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int peer_get(struct pull_engine *pe, struct nodeID *id)
+{
+  struct pull_peer *p;
+  int i = peer_find(pe, id);
+
+  if (i >= 0) {
+    return i;
+  }
+  if (pe->n_peers == pe->peers_size) {
+    struct pull_peer *e = grow(pe->peers, &pe->peers_size, sizeof(struct pull_peer));
+
+    if (e == NULL) {
+      return -1;
+    }
+    pe->peers = e;
+  }
+  p = &pe->peers[pe->n_peers];
+  memset(p, 0, sizeof(struct pull_peer));
+  p->id = nodeid_dup(id);
+  if (p->id == NULL) {
+    return -1;
+  }
+  p->window = pe->window_init;
+  p->ssthresh = pe->window_max;
+  gettimeofday(&p->rate_start, NULL);
+
+  return pe->n_peers++;
+}
+
+static int peer_rto(const struct pull_engine *pe, const struct pull_peer *p)
+{
+  return rtt_rto(p->srtt, p->rttvar, pe->rto_init, pe->rto_min, pe->rto_max);
+}
+
+/* Largest useful window: twice the bandwidth-delay product */
+static double peer_window_max(const struct pull_engine *pe, const struct pull_peer *p)
+{
+  double bdp;
+
+  if (p->rate == 0 || p->srtt == 0) {
+    return pe->window_max;
+  }
+  bdp = 2 * p->rate * p->srtt / 1000000.0 + 1;
+  if (bdp < pe->window_init) {
+    return pe->window_init;
+  }
+
+  return bdp > pe->window_max ? pe->window_max : bdp;
+}
+
+static void peer_delivered(struct pull_engine *pe, struct pull_peer *p, int64_t rtt, const struct timeval *now)
+{
+  int64_t interval;
+  double max;
+
+  rtt_sample(&p->srtt, &p->rttvar, rtt);
+
+  /* Delivery rate, measured over (at least) one round trip */
+  p->rate_count++;
+  interval = tv_diff(now, &p->rate_start);
+  if (interval >= p->srtt && interval >= RATE_INTERVAL_MIN) {
+    double rate = p->rate_count * 1000000.0 / interval;
+
+    p->rate = p->rate ? 0.75 * p->rate + 0.25 * rate : rate;
+    p->rate_count = 0;
+    p->rate_start = *now;
+  }
+
+  /* Additive increase */
+  p->window += p->window < p->ssthresh ? 1 : 1 / p->window;
+  max = peer_window_max(pe, p);
+  if (p->window > max) {
+    p->window = max;
+  }
+}
+
+/*
+ * Multiplicative decrease, at most once per round trip: the requests sent
+ * before the last decrease do not shrink the window again
+ */
+static void peer_lost(struct pull_engine *pe, struct pull_peer *p, const struct timeval *sent,
+                      const struct timeval *now)
+{
+  if (timerisset(&p->last_decrease) && (timercmp(sent, &p->last_decrease, <) ||
+      tv_diff(now, &p->last_decrease) < p->srtt)) {
+    return;
+  }
+  p->window /= 2;
+  if (p->window < 1) {
+    p->window = 1;
+  }
+  p->ssthresh = p->window;
+  p->last_decrease = *now;
+}
+
+static void request_remove(struct pull_engine *pe, int i)
+{
+  pe->peers[pe->requests[i].peer].outstanding--;
+  pe->requests[i] = pe->requests[--pe->n_requests];
+}
+
+static int request_find(const struct pull_engine *pe, int chunk)
+{
+  int i;
+
+  for (i = 0; i < pe->n_requests; i++) {
+    if (pe->requests[i].chunk == chunk) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+struct pull_engine *pullInit(const char *config)
+{
+  struct pull_engine *pe;
+  struct tag *cfg_tags;
+  int window, window_max;
+
+  cfg_tags = config_parse(config);
+  if (cfg_tags == NULL) {
+    return NULL;
+  }
+  pe = malloc(sizeof(struct pull_engine));
+  if (pe == NULL) {
+    free(cfg_tags);
+
+    return NULL;
+  }
+  memset(pe, 0, sizeof(struct pull_engine));
+  config_value_int_default(cfg_tags, "window", &window, 2);
+  config_value_int_default(cfg_tags, "window_max", &window_max, 64);
+  config_value_int_default(cfg_tags, "rto", &pe->rto_init, 500);
+  config_value_int_default(cfg_tags, "rto_min", &pe->rto_min, 50);
+  config_value_int_default(cfg_tags, "rto_max", &pe->rto_max, 4000);
+  free(cfg_tags);
+  pe->scratch = chunkID_set_init("size=0");
+  /* Timeouts are kept in us: they must not overflow */
+  if (pe->scratch == NULL || window < 1 || window_max < window ||
+      pe->rto_init <= 0 || pe->rto_min <= 0 || pe->rto_max < pe->rto_min ||
+      pe->rto_init > INT_MAX / 1000 || pe->rto_max > INT_MAX / 1000) {
+    if (pe->scratch) {
+      chunkID_set_free(pe->scratch);
+    }
+    free(pe);
+
+    return NULL;
+  }
+  pe->window_init = window;
+  pe->window_max = window_max;
+  pe->rto_init *= 1000;
+  pe->rto_min *= 1000;
+  pe->rto_max *= 1000;
+
+  return pe;
+}
+
+int pullWindow(struct pull_engine *pe, const struct nodeID *to)
+{
+  int i = peer_find(pe, to);
+
+  if (i < 0) {
+    return pe->window_init;
+  }
+
+  return (int)pe->peers[i].window > pe->peers[i].outstanding ? (int)pe->peers[i].window - pe->peers[i].outstanding : 0;
+}
+
+int pullRequest(struct pull_engine *pe, struct nodeID *to, const struct chunkID_set *cset,
+                const struct timeval *deadline)
+{
+  struct timeval now;
+  int i, p, n, rto, free_slots, size;
+
+  p = peer_get(pe, to);
+  if (p < 0) {
+    return -1;
+  }
+  free_slots = pullWindow(pe, to);
+  size = chunkID_set_size(cset);
+  chunkID_set_trim(pe->scratch, 0);
+  for (i = 0, n = 0; i < size && n < free_slots; i++) {
+    int chunk = chunkID_set_get_chunk(cset, i);
+
+    if (chunk >= 0 && request_find(pe, chunk) < 0 &&
+        chunkID_set_add_chunk(pe->scratch, chunk) >= 0) {
+      n++;
+    }
+  }
+  if (n == 0) {
+    return 0;
+  }
+  if (pe->n_requests + n > pe->requests_size) {
+    struct pull_request *r = realloc(pe->requests, (pe->n_requests + n + DEFAULT_SIZE_INCREMENT) * sizeof(struct pull_request));
+
+    if (r == NULL) {
+      return -1;
+    }
+    pe->requests = r;
+    pe->requests_size = pe->n_requests + n + DEFAULT_SIZE_INCREMENT;
+  }
+  if (requestChunks(to, pe->scratch, n, pe->trans_id++) < 0) {
+    return -1;
+  }
+
+  gettimeofday(&now, NULL);
+  rto = peer_rto(pe, &pe->peers[p]);
+  for (i = 0; i < n; i++) {
+    struct pull_request *r = &pe->requests[pe->n_requests++];
+
+    r->chunk = chunkID_set_get_chunk(pe->scratch, i);
+    r->peer = p;
+    r->sent = now;
+    tv_add(&r->timeout, &now, rto);
+    if (deadline) {
+      r->deadline = *deadline;
+    } else {
+      timerclear(&r->deadline);
+    }
+  }
+  pe->peers[p].outstanding += n;
+
+  return n;
+}
+
+int pullReceived(struct pull_engine *pe, const struct nodeID *from, int chunk_id)
+{
+  struct timeval now;
+  struct pull_request *r;
+  int i;
+
+  i = request_find(pe, chunk_id);
+  if (i < 0) {
+    return 0;
+  }
+  r = &pe->requests[i];
+  if (!nodeid_equal(pe->peers[r->peer].id, from)) {
+    /* Received from someone else: the request is useless */
+    request_remove(pe, i);
+
+    return 0;
+  }
+  gettimeofday(&now, NULL);
+  peer_delivered(pe, &pe->peers[r->peer], tv_diff(&now, &r->sent), &now);
+  request_remove(pe, i);
+
+  return 1;
+}
+
+int pullCheck(struct pull_engine *pe, struct chunkID_set *retry)
+{
+  struct timeval now;
+  int i, n = 0;
+
+  gettimeofday(&now, NULL);
+  for (i = pe->n_requests - 1; i >= 0; i--) {
+    struct pull_request *r = &pe->requests[i];
+    int late = timerisset(&r->deadline) && timercmp(&r->deadline, &now, <);
+
+    if (late) {
+      request_remove(pe, i);
+      n++;
+    } else if (timercmp(&r->timeout, &now, <)) {
+      peer_lost(pe, &pe->peers[r->peer], &r->sent, &now);
+      if (retry) {
+        chunkID_set_add_chunk(retry, r->chunk);
+      }
+      request_remove(pe, i);
+      n++;
+    }
+  }
+
+  return n;
+}
+
+int pullRemovePeer(struct pull_engine *pe, const struct nodeID *id, struct chunkID_set *retry)
+{
+  struct timeval now;
+  int i, p, n = 0;
+
+  p = peer_find(pe, id);
+  if (p < 0) {
+    return 0;
+  }
+  gettimeofday(&now, NULL);
+  for (i = pe->n_requests - 1; i >= 0; i--) {
+    struct pull_request *r = &pe->requests[i];
+
+    if (r->peer != p) {
+      continue;
+    }
+    if (retry && !(timerisset(&r->deadline) && timercmp(&r->deadline, &now, <))) {
+      chunkID_set_add_chunk(retry, r->chunk);
+    }
+    request_remove(pe, i);
+    n++;
+  }
+
+  /* Move the last peer in the hole */
+  nodeid_free(pe->peers[p].id);
+  pe->peers[p] = pe->peers[--pe->n_peers];
+  for (i = 0; i < pe->n_requests; i++) {
+    if (pe->requests[i].peer == pe->n_peers) {
+      pe->requests[i].peer = p;
+    }
+  }
+
+  return n;
+}
+
+void pullDestroy(struct pull_engine *pe)
+{
+  int i;
+
+  for (i = 0; i < pe->n_peers; i++) {
+    nodeid_free(pe->peers[i].id);
+  }
+  free(pe->peers);
+  free(pe->requests);
+  chunkID_set_free(pe->scratch);
+  free(pe);
+}
@@ -17,11 +17,13 @@
 #include <stdlib.h>
 
 #include "chunk.h"
+#include "peer.h"
 #include "grapes_msg_types.h"
 #include "chunkidset.h"
 #include "trade_sig_la.h"
 #include "trade_sig_ha.h"
 #include "int_coding.h"
+#include "signaling_private.h"
 
 //Type of signaling message
 //Request a ChunkIDSet
@@ -39,6 +41,9 @@
 //Request the BufferMap
 #define MSG_SIG_BMREQ 12
 
+/* Timeout of a BufferMap request, if the RTT of the peer is not known */
+#define BMREQ_TIMEOUT 1000000	// us
+
 #define SIG_META_LEN 1024
 #define SIG_BUF_LEN 2048
 
@@ -52,6 +57,14 @@ struct sig_nal {
 
 //set the local node ID
 static struct nodeID *localID;
+//changes to the BufferMap being sent
+static struct chunkID_set *bmap_delta;
+
+/* Sequence numbers of the BufferMaps sent to a peer: 0 is never used */
+static uint16_t next_seq(uint16_t seq)
+{
+  return seq == 0xffff ? 1 : seq + 1;
+}
 
 int chunkSignalingInit(struct nodeID *myID)
 {
@@ -62,98 +75,231 @@ int chunkSignalingInit(struct nodeID *myID)
   return 1;
 }
 
+/* Parse the metadata of a signaling message (a view in the receive buffer) */
+static int parse_meta(const uint8_t *meta, int meta_len, struct nodeID **owner_id,
+                      int *max_deliver, uint16_t *trans_id,
+                      enum signaling_type *sig_type, uint16_t *seq)
+{
+  struct sig_nal signal;
+  int dummy;
+
+  if (meta_len < sizeof(signal) - 1) {
+    return -1;
+  }
+  memcpy(&signal, meta, sizeof(signal) - 1);
+  switch (signal.type) {
+    case MSG_SIG_OFF:
+      *sig_type = sig_offer;
+      break;
+    case MSG_SIG_ACC:
+      *sig_type = sig_accept;
+      break;
+    case MSG_SIG_REQ:
+      *sig_type = sig_request;
+      break;
+    case MSG_SIG_DEL:
+      *sig_type = sig_deliver;
+      break;
+    case MSG_SIG_BMOFF:
+      *sig_type = sig_send_buffermap;
+      break;
+    case MSG_SIG_ACK:
+      *sig_type = sig_ack;
+      break;
+    case MSG_SIG_BMREQ:
+      *sig_type = sig_request_buffermap;
+      break;
+    case MSG_SIG_BMSEQ:
+    case MSG_SIG_BMDELTA:
+      /* The BufferMap of the sender, and its sequence number instead of the owner */
+      if (meta_len < sizeof(signal) + 1) {
+        return -1;
+      }
+      *sig_type = signal.type == MSG_SIG_BMSEQ ? sig_send_buffermap : sig_send_buffermap_delta;
+      *max_deliver = signal.max_deliver;
+      *trans_id = signal.trans_id;
+      *owner_id = NULL;
+      *seq = int16_rcpy(meta + sizeof(signal) - 1);
+
+      return 1;
+    default:
+      fprintf(stderr, "Error invalid signaling message: type %d\n", signal.type);
+      return -1;
+  }
+  *max_deliver = signal.max_deliver;
+  *trans_id = signal.trans_id;
+  *owner_id = (meta_len > sizeof(signal) - 1 ? nodeid_undump(meta + sizeof(signal) - 1, &dummy) : NULL);
+
+  return 1;
+}
+
 int parseSignaling(uint8_t *buff, int buff_len, struct nodeID **owner_id,
                    struct chunkID_set **cset, int *max_deliver, uint16_t *trans_id,
                    enum signaling_type *sig_type)
 {
-  int meta_len = 0;
-  void *meta;
-
-  *cset = decodeChunkSignaling(&meta, &meta_len, buff, buff_len);
-  if (meta_len) {
-    struct sig_nal *signal = meta;
-    int dummy;
-
-    switch (signal->type) {
-      case MSG_SIG_OFF:
-        *sig_type = sig_offer;
-        break;
-      case MSG_SIG_ACC:
-        *sig_type = sig_accept;
-        break;
-      case MSG_SIG_REQ:
-        *sig_type = sig_request;
-        break;
-      case MSG_SIG_DEL:
-        *sig_type = sig_deliver;
-        break;
-      case MSG_SIG_BMOFF:
-        *sig_type = sig_send_buffermap;
-        break;
-      case MSG_SIG_ACK:
-        *sig_type = sig_ack;
-        break;
-      case MSG_SIG_BMREQ:
-        *sig_type = sig_request_buffermap;
-        break;
-      default:
-        fprintf(stderr, "Error invalid signaling message: type %d\n", signal->type);
-        return -1;
+  const uint8_t *meta;
+  int meta_len, res;
+  uint16_t seq;
+
+  *cset = chunkID_set_init("size=0");
+  if (*cset == NULL) {
+    return -1;
+  }
+  res = decodeChunkSignalingInto(*cset, &meta, &meta_len, buff, buff_len);
+  if (res > 0) {
+    res = parse_meta(meta, meta_len, owner_id, max_deliver, trans_id, sig_type, &seq);
+    if (res > 0) {
+      return res;
+    }
+  } else if (res == 0) {
+    chunkID_set_free(*cset);
+    *cset = NULL;
+
+    return parse_meta(meta, meta_len, owner_id, max_deliver, trans_id, sig_type, &seq);
+  }
+  chunkID_set_free(*cset);
+  *cset = NULL;
+
+  return -1;
+}
+
+int parseSignalingInto(const uint8_t *buff, int buff_len, struct nodeID **owner_id,
+                       struct chunkID_set *cset, int *max_deliver, uint16_t *trans_id,
+                       enum signaling_type *sig_type)
+{
+  const uint8_t *meta;
+  int meta_len;
+  uint16_t seq;
+
+  if (decodeChunkSignalingInto(cset, &meta, &meta_len, buff, buff_len) < 0) {
+    return -1;
+  }
+
+  return parse_meta(meta, meta_len, owner_id, max_deliver, trans_id, sig_type, &seq);
+}
+
+int parseSignalingPeer(const uint8_t *buff, int buff_len, struct peer *from,
+                       struct nodeID **owner_id, struct chunkID_set *cset,
+                       int *max_deliver, uint16_t *trans_id,
+                       enum signaling_type *sig_type)
+{
+  const uint8_t *meta;
+  int meta_len, res;
+  uint16_t seq;
+
+  if (decodeChunkSignalingInto(cset, &meta, &meta_len, buff, buff_len) < 0) {
+    return -1;
+  }
+  res = parse_meta(meta, meta_len, owner_id, max_deliver, trans_id, sig_type, &seq);
+  if (res < 0) {
+    return res;
+  }
+
+  switch (meta[0]) {
+    case MSG_SIG_BMREQ:
+      /* The peer does not know our BufferMap: send it whole */
+      from->bmap_sent_seq = 0;
+
+      return res;
+    case MSG_SIG_BMSEQ:
+    case MSG_SIG_BMDELTA:
+      res = bmap_apply(from, meta[0], seq, cset);
+      if (res == 0) {
+        /* Lost (or reordered) message: ask for the whole BufferMap */
+        bmap_request(from, *trans_id);
+      }
+      *sig_type = sig_send_buffermap;
+
+      return res;
+    default:
+      return res;
+  }
+}
+
+int bmap_apply(struct peer *from, int type, uint16_t seq, const struct chunkID_set *cset)
+{
+  int res;
+
+  if (type == MSG_SIG_BMDELTA) {
+    if (from->bmap_seq == 0 || seq != next_seq(from->bmap_seq)) {
+      from->bmap_seq = 0;
+
+      return 0;
     }
-    *max_deliver = signal->max_deliver;
-    *trans_id = signal->trans_id;
-    *owner_id = (meta_len > sizeof(struct sig_nal) - 1 ? nodeid_undump(&(signal->third_peer), &dummy) : NULL);
-    free(meta);
+    res = chunkID_set_symmetric_difference(from->bmap, cset);
   } else {
+    chunkID_set_trim(from->bmap, 0);
+    res = chunkID_set_union(from->bmap, cset);
+  }
+  if (res < 0) {
+    from->bmap_seq = 0;
+
+    return -1;
+  }
+  from->bmap_seq = seq;
+  gettimeofday(&from->bmap_timestamp, NULL);
+  if (type != MSG_SIG_BMDELTA) {
+    timerclear(&from->bmap_req_timestamp);
+  }
+
+  return 1;
+}
+
+int bmap_request(struct peer *from, uint16_t trans_id)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  if (timerisset(&from->bmap_req_timestamp)) {
+    int64_t elapsed, timeout;
+
+    elapsed = (now.tv_sec - from->bmap_req_timestamp.tv_sec) * 1000000LL +
+              now.tv_usec - from->bmap_req_timestamp.tv_usec;
+    timeout = from->srtt ? from->srtt + 4 * from->rttvar : BMREQ_TIMEOUT;
+    if (elapsed >= 0 && elapsed < timeout) {
+      return 0;
+    }
+  }
+  if (requestBufferMap(from->id, NULL, trans_id) < 0) {
     return -1;
   }
+  from->bmap_req_timestamp = now;
 
   return 1;
 }
 
+/* Messages are encoded in buffers on the stack: no memory is allocated */
 static int sendSignaling(int type, struct nodeID *to_id,
                          const struct nodeID *owner_id,
                          const struct chunkID_set *cset, int max_deliver,
-                         uint16_t trans_id)
+                         uint16_t trans_id, uint16_t seq)
 {
   int meta_len, msg_len;
-  uint8_t *buff;
-  struct sig_nal *sigmex;
-
-  sigmex = malloc(SIG_META_LEN);
-  if (!sigmex) {
-    fprintf(stderr, "Error allocating meta-buffer\n");
+  uint8_t buff[SIG_BUF_LEN];
+  uint8_t meta[SIG_META_LEN];
+  struct sig_nal *sigmex = (struct sig_nal *)meta;
 
-    return -1;
-  }
   sigmex->type = type;
   sigmex->max_deliver = max_deliver;    
   sigmex->trans_id = trans_id;
   sigmex->third_peer = 0;
   meta_len = sizeof(*sigmex) - 1;
-  if (owner_id) {
+  if (type == MSG_SIG_BMSEQ || type == MSG_SIG_BMDELTA) {
+    int16_cpy(&sigmex->third_peer, seq);
+    meta_len += 2;
+  } else if (owner_id) {
     meta_len += nodeid_dump(&sigmex->third_peer, owner_id, SIG_META_LEN - meta_len);
   }
-  buff = malloc(SIG_BUF_LEN);
-  if (!buff) {
-    fprintf(stderr, "Error allocating buffer\n");
-    free(sigmex);
-
-    return -1;
-  }
 
   buff[0] = MSG_TYPE_SIGNALLING;
   msg_len = 1 + encodeChunkSignaling(cset, sigmex, meta_len, buff+1, SIG_BUF_LEN-1);
-  free(sigmex);
   if (msg_len <= 0) {
     fprintf(stderr, "Error in encoding chunk set for sending a buffermap\n");
-    free(buff);
 
     return -1;
   } else {
     send_to_peer(localID, to_id, buff, msg_len);
   }    
-  free(buff);
 
   return 1;
 }
@@ -161,40 +307,112 @@ static int sendSignaling(int type, struct nodeID *to_id,
 int requestChunks(struct nodeID *to, const ChunkIDSet *cset,
                   int max_deliver, uint16_t trans_id)
 {
-  return sendSignaling(MSG_SIG_REQ, to, NULL, cset, max_deliver, trans_id);
+  return sendSignaling(MSG_SIG_REQ, to, NULL, cset, max_deliver, trans_id, 0);
 }
 
 int deliverChunks(struct nodeID *to, ChunkIDSet *cset, uint16_t trans_id)
 {
-  return sendSignaling(MSG_SIG_DEL, to, NULL, cset, 0, trans_id);
+  return sendSignaling(MSG_SIG_DEL, to, NULL, cset, 0, trans_id, 0);
 }
 
 int offerChunks(struct nodeID *to, struct chunkID_set *cset,
                 int max_deliver, uint16_t trans_id)
 {
-  return sendSignaling(MSG_SIG_OFF, to, NULL, cset, max_deliver, trans_id);
+  return sendSignaling(MSG_SIG_OFF, to, NULL, cset, max_deliver, trans_id, 0);
 }
 
 int acceptChunks(struct nodeID *to, struct chunkID_set *cset, uint16_t trans_id)
 {
-  return sendSignaling(MSG_SIG_ACC, to, NULL, cset, 0, trans_id);
+  return sendSignaling(MSG_SIG_ACC, to, NULL, cset, 0, trans_id, 0);
 }
 
 int sendBufferMap(struct nodeID *to, const struct nodeID *owner,
-                  struct chunkID_set *bmap, int cb_size, uint16_t trans_id)
+                  const struct chunkID_set *bmap, int cb_size, uint16_t trans_id)
 {
   return sendSignaling(MSG_SIG_BMOFF, to, (!owner ? localID : owner), bmap,
-                       cb_size, trans_id);
+                       cb_size, trans_id, 0);
+}
+
+int bmap_prepare(struct peer *to, const struct chunkID_set *bmap,
+                 const struct chunkID_set **msg, uint16_t *seq)
+{
+  int type = MSG_SIG_BMSEQ;
+
+  if (to->bmap_sent == NULL) {
+    to->bmap_sent = chunkID_set_init("type=bitmap");
+    to->bmap_sent_seq = 0;
+  }
+  /* The delta goes to the same peers as the BufferMap: use its encoding */
+  if (bmap_delta && chunkID_set_compact(bmap_delta) != chunkID_set_compact(bmap)) {
+    chunkID_set_free(bmap_delta);
+    bmap_delta = NULL;
+  }
+  if (bmap_delta == NULL) {
+    bmap_delta = chunkID_set_init(chunkID_set_compact(bmap) ? "type=bitmap,encoding=compact" : "type=bitmap");
+  }
+  if (to->bmap_sent == NULL || bmap_delta == NULL) {
+    return -1;
+  }
+
+  /* Send the changes from the last BufferMap, if the peer has it and they are fewer */
+  *msg = bmap;
+  if (to->bmap_sent_seq) {
+    chunkID_set_trim(bmap_delta, 0);
+    if (chunkID_set_union(bmap_delta, bmap) < 0 ||
+        chunkID_set_symmetric_difference(bmap_delta, to->bmap_sent) < 0) {
+      return -1;
+    }
+    if (chunkID_set_size(bmap_delta) < chunkID_set_size(bmap)) {
+      type = MSG_SIG_BMDELTA;
+      *msg = bmap_delta;
+    }
+  }
+  *seq = next_seq(to->bmap_sent_seq);
+
+  return type;
+}
+
+void bmap_commit(struct peer *to, const struct chunkID_set *bmap, int type, uint16_t seq)
+{
+  int res;
+
+  if (type == MSG_SIG_BMDELTA) {
+    res = chunkID_set_symmetric_difference(to->bmap_sent, bmap_delta);
+  } else {
+    chunkID_set_trim(to->bmap_sent, 0);
+    res = chunkID_set_union(to->bmap_sent, bmap);
+  }
+  to->bmap_sent_seq = res < 0 ? 0 : seq;
+}
+
+int sendBufferMapDelta(struct peer *to, const struct chunkID_set *bmap,
+                       int cb_size, uint16_t trans_id)
+{
+  const struct chunkID_set *msg;
+  uint16_t seq;
+  int type, res;
+
+  type = bmap_prepare(to, bmap, &msg, &seq);
+  if (type < 0) {
+    return type;
+  }
+  res = sendSignaling(type, to->id, NULL, msg, cb_size, trans_id, seq);
+  if (res < 0) {
+    return res;
+  }
+  bmap_commit(to, bmap, type, seq);
+
+  return 1;
 }
 
 int sendAck(struct nodeID *to, struct chunkID_set *cset, uint16_t trans_id)
 {
-    return sendSignaling(MSG_SIG_ACK, to, NULL, cset, 0, trans_id);
+    return sendSignaling(MSG_SIG_ACK, to, NULL, cset, 0, trans_id, 0);
 }
 
 int requestBufferMap(struct nodeID *to, const struct nodeID *owner,
                      uint16_t trans_id)
 {
   return sendSignaling(MSG_SIG_BMREQ, to, (!owner?localID:owner), NULL,
-                       0, trans_id);
+                       0, trans_id, 0);
 }
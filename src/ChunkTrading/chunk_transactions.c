@@ -0,0 +1,335 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software;
+ *  see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "net_helper.h"
+#include "peer.h"
+#include "peerset.h"
+#include "chunkidset.h"
+#include "trade_sig_ha.h"
+#include "trade_trans.h"
+#include "config.h"
+#include "rtt_private.h"
+
+#define DEFAULT_SIZE_INCREMENT 16
+
+struct transaction {
+  uint16_t id;
+  enum signaling_type type;
+  struct nodeID *to;
+  struct chunkID_set *cset;
+  int max_deliver;
+  void *opaque;
+  struct timeval sent;		// first transmission to this peer
+  struct timeval deadline;
+  int rto;			// current timeout, in us
+  int retries;			// retransmissions left
+  int retransmitted;		// the reply cannot be used as an RTT sample
+};
+
+struct trans_table {
+  struct peerset *ps;
+  transTimeoutCallback cb;
+  int rto_init;			// timeouts, in us
+  int rto_min;
+  int rto_max;
+  int max_retries;
+  uint16_t next_id;
+  int size;
+  int n_elements;
+  struct transaction *elements;
+};
+
+static int peer_rto(const struct trans_table *t, const struct nodeID *id)
+{
+  struct peer *p = t->ps ? peerset_get_peer(t->ps, id) : NULL;
+
+  if (p == NULL) {
+    return t->rto_init;
+  }
+
+  return rtt_rto(p->srtt, p->rttvar, t->rto_init, t->rto_min, t->rto_max);
+}
+
+static int trans_find(const struct trans_table *t, uint16_t id)
+{
+  int i;
+
+  for (i = 0; i < t->n_elements; i++) {
+    if (t->elements[i].id == id) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void trans_remove(struct trans_table *t, int i)
+{
+  memmove(&t->elements[i], &t->elements[i + 1], (t->n_elements - i - 1) * sizeof(struct transaction));
+  t->n_elements--;
+}
+
+static void trans_free(struct transaction *tr)
+{
+  nodeid_free(tr->to);
+  chunkID_set_free(tr->cset);
+}
+
+static int trans_append(struct trans_table *t, const struct transaction *tr)
+{
+  if (t->n_elements == t->size) {
+    struct transaction *e;
+
+    e = realloc(t->elements, (t->size + DEFAULT_SIZE_INCREMENT) * sizeof(struct transaction));
+    if (e == NULL) {
+      return -1;
+    }
+    t->elements = e;
+    t->size += DEFAULT_SIZE_INCREMENT;
+  }
+  t->elements[t->n_elements++] = *tr;
+
+  return 0;
+}
+
+static int trans_transmit(struct transaction *tr)
+{
+  switch (tr->type) {
+    case sig_request:
+      return requestChunks(tr->to, tr->cset, tr->max_deliver, tr->id);
+    case sig_offer:
+      return offerChunks(tr->to, tr->cset, tr->max_deliver, tr->id);
+    case sig_accept:
+      return acceptChunks(tr->to, tr->cset, tr->id);
+    case sig_send_buffermap:
+      return sendBufferMap(tr->to, NULL, tr->cset, tr->max_deliver, tr->id);
+    default:
+      return -1;
+  }
+}
+
+/* (Re)start a transaction with a peer */
+static int trans_start(const struct trans_table *t, struct transaction *tr, const struct timeval *now)
+{
+  tr->sent = *now;
+  tr->rto = peer_rto(t, tr->to);
+  tv_add(&tr->deadline, now, tr->rto);
+  tr->retries = t->max_retries;
+  tr->retransmitted = 0;
+
+  return trans_transmit(tr);
+}
+
+struct trans_table *transInit(struct peerset *ps, const char *config, transTimeoutCallback cb)
+{
+  struct trans_table *t;
+  struct tag *cfg_tags;
+
+  cfg_tags = config_parse(config);
+  if (cfg_tags == NULL) {
+    return NULL;
+  }
+  t = malloc(sizeof(struct trans_table));
+  if (t == NULL) {
+    free(cfg_tags);
+
+    return NULL;
+  }
+  memset(t, 0, sizeof(struct trans_table));
+  t->ps = ps;
+  t->cb = cb;
+  config_value_int_default(cfg_tags, "rto", &t->rto_init, 500);
+  config_value_int_default(cfg_tags, "rto_min", &t->rto_min, 50);
+  config_value_int_default(cfg_tags, "rto_max", &t->rto_max, 4000);
+  config_value_int_default(cfg_tags, "retries", &t->max_retries, 2);
+  free(cfg_tags);
+  /* Timeouts are kept in us: they must not overflow */
+  if (t->rto_init <= 0 || t->rto_min <= 0 || t->rto_max < t->rto_min ||
+      t->rto_init > INT_MAX / 1000 || t->rto_max > INT_MAX / 1000 || t->max_retries < 0) {
+    free(t);
+
+    return NULL;
+  }
+  t->rto_init *= 1000;
+  t->rto_min *= 1000;
+  t->rto_max *= 1000;
+  t->next_id = 1;
+
+  return t;
+}
+
+int transSend(struct trans_table *t, enum signaling_type type, struct nodeID *to,
+              const struct chunkID_set *cset, int max_deliver, void *opaque)
+{
+  struct transaction tr;
+  struct timeval now;
+
+  if (t->n_elements >= 0xffff) {
+    return -1;
+  }
+  /* 0 is never used, and pending IDs are skipped */
+  do {
+    tr.id = t->next_id++;
+    if (t->next_id == 0) {
+      t->next_id = 1;
+    }
+  } while (trans_find(t, tr.id) >= 0);
+  tr.type = type;
+  tr.max_deliver = max_deliver;
+  tr.opaque = opaque;
+  tr.to = nodeid_dup(to);
+  tr.cset = chunkID_set_init("size=0");
+  if (tr.to == NULL || tr.cset == NULL || (cset && chunkID_set_union(tr.cset, cset) < 0)) {
+    if (tr.to) {
+      nodeid_free(tr.to);
+    }
+    if (tr.cset) {
+      chunkID_set_free(tr.cset);
+    }
+
+    return -1;
+  }
+
+  gettimeofday(&now, NULL);
+  if (trans_start(t, &tr, &now) < 0 || trans_append(t, &tr) < 0) {
+    trans_free(&tr);
+
+    return -1;
+  }
+
+  return tr.id;
+}
+
+int transComplete(struct trans_table *t, const struct nodeID *from, uint16_t trans_id, void **opaque)
+{
+  struct transaction *tr;
+  struct timeval now;
+  int i;
+
+  i = trans_find(t, trans_id);
+  if (i < 0 || !nodeid_equal(t->elements[i].to, from)) {
+    return 0;
+  }
+  tr = &t->elements[i];
+  if (!tr->retransmitted && t->ps) {
+    struct peer *p = peerset_get_peer(t->ps, from);
+
+    gettimeofday(&now, NULL);
+    if (p) {
+      rtt_sample(&p->srtt, &p->rttvar, tv_diff(&now, &tr->sent));
+    }
+  }
+  if (opaque) {
+    *opaque = tr->opaque;
+  }
+  trans_free(tr);
+  trans_remove(t, i);
+
+  return 1;
+}
+
+int transCheck(struct trans_table *t)
+{
+  struct timeval now;
+  int i, expired = 0;
+
+  gettimeofday(&now, NULL);
+  for (i = 0; i < t->n_elements; i++) {
+    struct transaction *tr = &t->elements[i];
+    struct transaction old;
+    struct nodeID *to;
+
+    if (timercmp(&tr->deadline, &now, >)) {
+      continue;
+    }
+    if (tr->retries) {
+      /* Exponential backoff */
+      tr->retries--;
+      tr->rto = tr->rto > t->rto_max / 2 ? t->rto_max : tr->rto * 2;
+      tr->retransmitted = 1;
+      tv_add(&tr->deadline, &now, tr->rto);
+      trans_transmit(tr);
+      continue;
+    }
+
+    /* The callback can start other transactions: remove this one first */
+    expired++;
+    old = *tr;
+    trans_remove(t, i--);
+    to = t->cb ? t->cb(old.to, old.id, old.type, old.cset, old.opaque) : NULL;
+    if (to) {
+      nodeid_free(old.to);
+      old.to = nodeid_dup(to);
+      if (old.to && trans_start(t, &old, &now) >= 0 && trans_append(t, &old) >= 0) {
+        continue;
+      }
+      if (old.to == NULL) {
+        chunkID_set_free(old.cset);
+        continue;
+      }
+    }
+    trans_free(&old);
+  }
+
+  return expired;
+}
+
+int transNextTimeout(const struct trans_table *t, struct timeval *tv)
+{
+  const struct timeval *first;
+  struct timeval now;
+  int i;
+
+  if (t->n_elements == 0) {
+    return 0;
+  }
+  first = &t->elements[0].deadline;
+  for (i = 1; i < t->n_elements; i++) {
+    if (timercmp(&t->elements[i].deadline, first, <)) {
+      first = &t->elements[i].deadline;
+    }
+  }
+  gettimeofday(&now, NULL);
+  if (timercmp(first, &now, <)) {
+    timerclear(tv);
+  } else {
+    timersub(first, &now, tv);
+  }
+
+  return 1;
+}
+
+int transPending(const struct trans_table *t)
+{
+  return t->n_elements;
+}
+
+double transEvaluateRTT(struct peer **p)
+{
+  if ((*p)->srtt == 0) {
+    return 1.0;
+  }
+
+  return 1000000.0 / ((*p)->srtt + 4 * (*p)->rttvar);
+}
+
+void transDestroy(struct trans_table *t)
+{
+  int i;
+
+  for (i = 0; i < t->n_elements; i++) {
+    trans_free(&t->elements[i]);
+  }
+  free(t->elements);
+  free(t);
+}
@@ -0,0 +1,21 @@
+#ifndef FEC_PRIVATE
+#define FEC_PRIVATE
+
+/*
+ * GF(2^8) arithmetic (polynomial x^8 + x^4 + x^3 + x^2 + 1). The bulk
+ * operation uses SIMD instructions when the CPU supports them: each
+ * encoder or decoder selects its kernel, and there is no global state.
+ */
+typedef void (*gf256_kernel)(uint8_t *dst, const uint8_t *src, uint8_t c, int len);
+
+/*
+ * Kernel "scalar", "ssse3", "avx2" or "auto" (the fastest one supported
+ * by the CPU, also if name is NULL); NULL if unknown or not supported
+ */
+gf256_kernel gf256_kernel_select(const char *name);
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a);
+/* dst ^= c * src */
+void gf256_mul_add(gf256_kernel kernel, uint8_t *dst, const uint8_t *src, uint8_t c, int len);
+
+#endif /* FEC_PRIVATE */
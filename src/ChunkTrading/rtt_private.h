@@ -0,0 +1,59 @@
+#ifndef RTT_PRIVATE
+#define RTT_PRIVATE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// Larger RTT samples are clamped, so that the estimations cannot overflow
+#define RTT_SAMPLE_MAX 60000000	// us
+
+/* a - b, in us */
+static inline int64_t tv_diff(const struct timeval *a, const struct timeval *b)
+{
+  return (int64_t)(a->tv_sec - b->tv_sec) * 1000000 + (a->tv_usec - b->tv_usec);
+}
+
+static inline void tv_add(struct timeval *tv, const struct timeval *base, int us)
+{
+  struct timeval d;
+
+  d.tv_sec = us / 1000000;
+  d.tv_usec = us % 1000000;
+  timeradd(base, &d, tv);
+}
+
+/* RFC 6298: update the smoothed RTT and its variation with a sample (in us) */
+static inline void rtt_sample(int *srtt, int *rttvar, int64_t sample)
+{
+  int r = sample < 0 ? 0 : sample > RTT_SAMPLE_MAX ? RTT_SAMPLE_MAX : sample;
+
+  if (*srtt == 0) {
+    *srtt = r;
+    *rttvar = r / 2;
+  } else {
+    *rttvar = (3 * *rttvar + abs(*srtt - r)) / 4;
+    *srtt = (7 * *srtt + r) / 8;
+  }
+  if (*srtt == 0) {
+    *srtt = 1;
+  }
+}
+
+/* RFC 6298: RTO = SRTT + 4 * RTTVAR, bounded (rto_init if there is no estimation) */
+static inline int rtt_rto(int srtt, int rttvar, int rto_init, int rto_min, int rto_max)
+{
+  int rto;
+
+  if (srtt == 0) {
+    return rto_init;
+  }
+  rto = srtt + 4 * rttvar;
+  if (rto < rto_min) {
+    return rto_min;
+  }
+
+  return rto > rto_max ? rto_max : rto;
+}
+
+#endif /* RTT_PRIVATE */
@@ -0,0 +1,37 @@
+#ifndef SIGNALING_PRIVATE
+#define SIGNALING_PRIVATE
+
+//Receive the BufferMap, with a sequence number (base for the next deltas)
+#define MSG_SIG_BMSEQ 13
+//Receive the changes to the BufferMap with the previous sequence number
+#define MSG_SIG_BMDELTA 14
+
+struct peer;
+struct chunkID_set;
+
+/*
+ * Choose how to send bmap to a peer: returns MSG_SIG_BMDELTA (msg are the
+ * changes from the last BufferMap the peer has) or MSG_SIG_BMSEQ (msg is
+ * bmap), and the sequence number to use. If the message is actually sent,
+ * bmap_commit() must be called.
+ */
+int bmap_prepare(struct peer *to, const struct chunkID_set *bmap,
+                 const struct chunkID_set **msg, uint16_t *seq);
+void bmap_commit(struct peer *to, const struct chunkID_set *bmap, int type, uint16_t seq);
+
+/*
+ * Update the BufferMap of a peer with a received MSG_SIG_BMSEQ or
+ * MSG_SIG_BMDELTA. Returns 0 if a delta cannot be applied (a message has
+ * been lost, and the whole BufferMap must be requested).
+ */
+int bmap_apply(struct peer *from, int type, uint16_t seq, const struct chunkID_set *cset);
+
+/*
+ * Request the whole BufferMap of a peer, after bmap_apply() returned 0.
+ * Only one request is outstanding: it is repeated only if the BufferMap
+ * does not arrive within a timeout. Returns 1 if the request is sent, 0
+ * if one is pending, < 0 on error.
+ */
+int bmap_request(struct peer *from, uint16_t trans_id);
+
+#endif /* SIGNALING_PRIVATE */
@@ -4,14 +4,14 @@
  
 #include "chunkiser_attrib.h"
 
-inline void chunk_attributes_chunker_init(struct chunk_attributes_chunker *ca)
+void chunk_attributes_chunker_init(struct chunk_attributes_chunker *ca)
 {
   ca->magic = 0x11;
 }
 
-inline int chunk_attributes_chunker_verify(void *attr, int attr_size)
+int chunk_attributes_chunker_verify(const void *attr, int attr_size)
 {
-  struct chunk_attributes_chunker *ca = attr;
+  const struct chunk_attributes_chunker *ca = attr;
 
   if (attr_size != sizeof(*ca)) {
     return 0;
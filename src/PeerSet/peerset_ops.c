@@ -81,6 +81,12 @@ int peerset_add_peer(struct peerset *h, struct nodeID *id)
   gettimeofday(&e->creation_timestamp,NULL);
   e->bmap = chunkID_set_init("type=bitmap");
   timerclear(&e->bmap_timestamp);
+  e->bmap_seq = 0;
+  timerclear(&e->bmap_req_timestamp);
+  e->bmap_sent = NULL;
+  e->bmap_sent_seq = 0;
+  e->srtt = 0;
+  e->rttvar = 0;
   e->cb_size = INT_MAX;
 
   return h->n_elements;
@@ -117,6 +123,9 @@ int peerset_remove_peer(struct peerset *h, const struct nodeID *id){
     struct peer *e = h->elements + i;
     nodeid_free(e->id);
     chunkID_set_free(e->bmap);
+    if (e->bmap_sent) {
+      chunkID_set_free(e->bmap_sent);
+    }
     memmove(e, e + 1, ((h->n_elements--) - (i+1)) * sizeof(struct peer));
     return i;
   }
@@ -176,6 +185,9 @@ void peerset_clear(struct peerset *h, int size)
     struct peer *e = h->elements + i;
     nodeid_free(e->id);
     chunkID_set_free(e->bmap);
+    if (e->bmap_sent) {
+      chunkID_set_free(e->bmap_sent);
+    }
   }
 
   h->n_elements = 0;
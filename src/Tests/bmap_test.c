@@ -0,0 +1,265 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "net_helper.h"
+#include "peer.h"
+#include "peerset.h"
+#include "chunk.h"
+#include "chunkidset.h"
+#include "grapes_msg_types.h"
+#include "trade_sig_ha.h"
+#include "trade_msg_ha.h"
+
+#define BUFFSIZE 4096
+
+/* Not provided by the library (usually defined by the application) */
+void reg_message_send(int size, uint8_t type)
+{
+}
+
+void reg_message_recv(int size, uint8_t type)
+{
+}
+
+static struct nodeID *a, *b;		// a sends its BufferMap to b
+static struct peerset *ps_a, *ps_b;	// b in the peerset of a, and a in the one of b
+static struct chunkID_set *bmap;	// the BufferMap of a
+
+/* Receive a message, waiting at most 100ms */
+static int receive(struct nodeID *n, uint8_t *buff)
+{
+  struct nodeID *from;
+  struct timeval tv = {0, 100000};
+  int len;
+
+  if (wait4data(n, &tv, NULL) <= 0) {
+    return -1;
+  }
+  len = recv_from_peer(n, &from, buff, BUFFSIZE);
+  nodeid_free(from);
+
+  return len;
+}
+
+/* b receives a signaling message from a */
+static int signaling_receive(void)
+{
+  struct peer *p = peerset_get_peer(ps_b, a);
+  static struct chunkID_set *cset;
+  struct nodeID *owner = NULL;
+  uint8_t buff[BUFFSIZE];
+  enum signaling_type type;
+  int len, max_deliver, res;
+  uint16_t trans_id;
+
+  if (cset == NULL) {
+    cset = chunkID_set_init("type=bitmap");
+  }
+  len = receive(b, buff);
+  if (len <= 0 || buff[0] != MSG_TYPE_SIGNALLING) {
+    return -1;
+  }
+  res = parseSignalingPeer(buff + 1, len - 1, p, &owner, cset, &max_deliver, &trans_id, &type);
+  if (owner) {
+    nodeid_free(owner);
+  }
+
+  return res;
+}
+
+/* a handles the BufferMap requests of b */
+static void request_receive(void)
+{
+  struct peer *p = peerset_get_peer(ps_a, b);
+  struct chunkID_set *cset = chunkID_set_init("size=0");
+  struct nodeID *owner = NULL;
+  uint8_t buff[BUFFSIZE];
+  enum signaling_type type;
+  int len, max_deliver, res = -1;
+  uint16_t trans_id;
+
+  len = receive(a, buff);
+  if (len > 0 && buff[0] == MSG_TYPE_SIGNALLING) {
+    res = parseSignalingPeer(buff + 1, len - 1, p, &owner, cset, &max_deliver, &trans_id, &type);
+  }
+  printf("a received %s\n", res > 0 && type == sig_request_buffermap ? "a BufferMap request" : "nothing");
+  if (owner) {
+    nodeid_free(owner);
+  }
+  chunkID_set_free(cset);
+}
+
+static int bmap_same(const struct chunkID_set *x, const struct chunkID_set *y)
+{
+  int i;
+
+  if (chunkID_set_size(x) != chunkID_set_size(y)) {
+    return 0;
+  }
+  for (i = 0; i < chunkID_set_size(x); i++) {
+    if (chunkID_set_check(y, chunkID_set_get_chunk(x, i)) < 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void bmap_print(const char *what, int res)
+{
+  const struct peer *p = peerset_get_peer(ps_b, a);
+
+  printf("%s: %d, seq %d, %d chunks (%d ... %d), %s\n", what, res, p->bmap_seq,
+         chunkID_set_size(p->bmap), chunkID_set_get_earliest(p->bmap),
+         chunkID_set_get_latest(p->bmap), bmap_same(p->bmap, bmap) ? "up to date" : "out of date");
+}
+
+/* b receives a chunk message from a */
+static int chunk_receive(void)
+{
+  uint8_t buff[BUFFSIZE];
+  struct chunk c;
+  uint16_t trans_id;
+  int len, res;
+
+  len = receive(b, buff);
+  if (len <= 0 || buff[0] != MSG_TYPE_CHUNK) {
+    return -1;
+  }
+  res = parseChunkMsgPeerset(ps_b, a, buff + 1, len - 1, &c, &trans_id);
+  if (res > 0) {
+    free(c.data);
+    free(c.attributes);
+  }
+
+  return res;
+}
+
+static void signaling_test(void)
+{
+  struct peer *to = peerset_get_peer(ps_a, b);
+  uint8_t lost[BUFFSIZE];
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    chunkID_set_add_chunk(bmap, i);
+  }
+  sendBufferMapDelta(to, bmap, 100, 1);
+  bmap_print("Whole BufferMap", signaling_receive());
+
+  chunkID_set_remove_chunk(bmap, 0);
+  chunkID_set_remove_chunk(bmap, 1);
+  chunkID_set_add_chunk(bmap, 100);
+  chunkID_set_add_chunk(bmap, 101);
+  chunkID_set_add_chunk(bmap, 102);
+  sendBufferMapDelta(to, bmap, 100, 2);
+  bmap_print("Delta", signaling_receive());
+
+  /* A delta is lost: the next one cannot be applied */
+  chunkID_set_add_chunk(bmap, 103);
+  sendBufferMapDelta(to, bmap, 100, 3);
+  receive(b, lost);
+  chunkID_set_remove_chunk(bmap, 2);
+  chunkID_set_add_chunk(bmap, 104);
+  sendBufferMapDelta(to, bmap, 100, 4);
+  bmap_print("Delta after a lost one", signaling_receive());
+  /* Only one request for the whole BufferMap is sent */
+  chunkID_set_remove_chunk(bmap, 3);
+  sendBufferMapDelta(to, bmap, 100, 5);
+  bmap_print("Another delta", signaling_receive());
+  request_receive();
+  request_receive();
+  chunkID_set_add_chunk(bmap, 105);
+  sendBufferMapDelta(to, bmap, 100, 6);
+  bmap_print("Resync", signaling_receive());
+  chunkID_set_add_chunk(bmap, 106);
+  sendBufferMapDelta(to, bmap, 100, 7);
+  bmap_print("Delta", signaling_receive());
+}
+
+/* The BufferMap travels in the trailers of the chunk messages */
+static void trailer_test(void)
+{
+  struct peer *to = peerset_get_peer(ps_a, b);
+  uint8_t lost[BUFFSIZE];
+  struct chunk c;
+  int i;
+
+  chunkDeliveryInit(a);
+  chunkDeliveryConfig("piggyback=1");
+  c.size = 100;
+  c.data = calloc(1, c.size);
+  c.attributes = NULL;
+  c.attributes_size = 0;
+  c.timestamp = 0;
+
+  for (i = 107; i < 110; i++) {
+    c.id = i;
+    chunkID_set_add_chunk(bmap, i);
+    sendChunkPeer(to, &c, i, bmap);
+    bmap_print("Chunk with a trailer", chunk_receive());
+  }
+
+  /* A chunk message is lost */
+  c.id = i;
+  chunkID_set_add_chunk(bmap, i++);
+  sendChunkPeer(to, &c, i, bmap);
+  receive(b, lost);
+  c.id = i;
+  chunkID_set_add_chunk(bmap, i++);
+  sendChunkPeer(to, &c, i, bmap);
+  bmap_print("Chunk after a lost one", chunk_receive());
+  /* Only one request for the whole BufferMap is sent */
+  c.id = i;
+  chunkID_set_add_chunk(bmap, i++);
+  sendChunkPeer(to, &c, i, bmap);
+  bmap_print("Another chunk", chunk_receive());
+  request_receive();
+  request_receive();
+  c.id = i;
+  chunkID_set_add_chunk(bmap, i++);
+  sendChunkPeer(to, &c, i, bmap);
+  bmap_print("Resync", chunk_receive());
+
+  /* Without trailers, nothing changes */
+  chunkDeliveryConfig("");
+  c.id = i;
+  chunkID_set_add_chunk(bmap, i++);
+  sendChunkPeer(to, &c, i, bmap);
+  bmap_print("Chunk without a trailer", chunk_receive());
+
+  free(c.data);
+}
+
+int main(int argc, char *argv[])
+{
+  a = net_helper_init("127.0.0.1", 6680, "");
+  b = net_helper_init("127.0.0.1", 6681, "");
+  if (a == NULL || b == NULL) {
+    fprintf(stderr, "Error creating the sockets\n");
+
+    return -1;
+  }
+  chunkSignalingInit(a);
+  ps_a = peerset_init("");
+  ps_b = peerset_init("");
+  peerset_add_peer(ps_a, b);
+  peerset_add_peer(ps_b, a);
+  bmap = chunkID_set_init("type=bitmap");
+
+  signaling_test();
+  trailer_test();
+
+  chunkID_set_free(bmap);
+
+  return 0;
+}
@@ -5,12 +5,16 @@
  *  This is free software; see gpl-3.0.txt
  */
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include "chunk.h"
 #include "chunkbuffer.h"
+#include "chunkidset.h"
+#include "chunkiser_attrib.h"
+#include "trade_msg_la.h"
 
 static struct chunk *chunk_forge(int id)
 {
@@ -32,17 +36,32 @@ static struct chunk *chunk_forge(int id)
   return c;
 }
 
-static void chunk_add(struct chunk_buffer *cb, int id)
+static void chunk_add_prio(struct chunk_buffer *cb, int id, int prio)
 {
   struct chunk *c;
   int res;
 
   printf("Inserting %d... ", id);
   c = chunk_forge(id);
+  if (c && prio) {
+    struct chunk_attributes_chunker *ca;
+
+    ca = malloc(sizeof(*ca));
+    chunk_attributes_chunker_init(ca);
+    ca->priority = prio;
+    c->attributes = ca;
+    c->attributes_size = sizeof(*ca);
+  }
   if (c) {
     res = cb_add_chunk(cb, c);
-    if (res < 0) {
+    if (res == E_CB_DUPLICATE) {
+      printf("not inserted (duplicate)");
+    } else if (res == E_CB_FULL) {
+      printf("not inserted (no room)");
+    } else if (res < 0) {
       printf("not inserted (out of window)");
+    }
+    if (res < 0) {
       free(c->data);
       free(c->attributes);
     }
@@ -53,6 +72,55 @@ static void chunk_add(struct chunk_buffer *cb, int id)
   free(c);
 }
 
+static void chunk_add(struct chunk_buffer *cb, int id)
+{
+  chunk_add_prio(cb, id, 0);
+}
+
+static void chunk_add_view(struct chunk_buffer *cb, int id)
+{
+  struct chunk *c, view;
+  uint8_t *block;
+  int res, len;
+
+  printf("Inserting view of %d... ", id);
+  c = chunk_forge(id);
+  len = CHUNK_HEADER_SIZE + c->size;
+  block = malloc(len);
+  encodeChunk(c, block, len);
+  free(c->data);
+  free(c);
+  decodeChunkView(&view, block, len);
+  res = cb_add_chunk_view(cb, &view, NULL);
+  printf("%s\n", res == E_CB_DUPLICATE ? "duplicate" : res == E_CB_OLD ? "old" : res < 0 ? "failed" : "done");
+  free(block);
+}
+
+/* Add a reference counted chunk, keeping a reference to its payload */
+static void chunk_add_shared(struct chunk_buffer *cb, int id)
+{
+  struct chunk c;
+  uint8_t *data;
+  char buff[64];
+  int res;
+
+  printf("Inserting shared %d... ", id);
+  sprintf(buff, "Chunk %d", id);
+  c.id = id;
+  c.timestamp = 40 * id;
+  chunk_alloc(&c, strlen(buff) + 1, 0);
+  memcpy(c.data, buff, c.size);
+  data = chunk_data_ref(c.data);
+  res = cb_add_chunk(cb, &c);
+  if (res < 0) {
+    printf("not inserted\n");
+    chunk_release(&c);
+  } else {
+    printf("done, %d references\n", chunk_data_refcount(data));
+  }
+  chunk_data_unref(data);
+}
+
 static void cb_print(const struct chunk_buffer *cb)
 {
   struct chunk *buff;
@@ -62,11 +130,41 @@ static void cb_print(const struct chunk_buffer *cb)
   for (i = 0; i < size; i++) {
     printf("C[%d]: %s %d\n", i, buff[i].data, buff[i].id);
   }
+  printf("Resident bytes: %zu\n", cb_get_bytes(cb));
+}
+
+static void chunk_check(const struct chunk_buffer *cb, int id)
+{
+  const struct chunk *c;
+
+  c = cb_get_chunk(cb, id);
+  if (c) {
+    printf("Chunk %d found: %s\n", id, c->data);
+  } else {
+    printf("Chunk %d not found\n", id);
+  }
+}
+
+static void cset_print(const char *name, const struct chunkID_set *cset)
+{
+  int i;
+
+  printf("%s:", name);
+  for (i = 0; i < chunkID_set_size(cset); i++) {
+    printf(" %d", chunkID_set_get_chunk(cset, i));
+  }
+  printf("\n");
 }
 
 int main(int argc, char *argv[])
 {
+  static const char *bytes_cfg[] = {"size=8,bytes=64K", "bytes=1g", "bytes=", "bytes=K", "bytes=-1",
+                                    "bytes=12X", "bytes=12MB", "bytes=99999999999999999999",
+                                    "bytes=17179869184G", "store=mmap,size=8,segment=lots"};
   struct chunk_buffer *b;
+  unsigned int i;
+  struct chunkID_set *missing;
+  struct chunk_data_stats stats;
 
   b = cb_init("size=8,time=now");
   if (b == NULL) {
@@ -78,31 +176,148 @@ int main(int argc, char *argv[])
   chunk_add(b, 5);
   chunk_add(b, 12);
   chunk_add(b, 12);
-  chunk_add(b, 40);
+  chunk_add(b, 8);
   cb_print(b);
 
-  chunk_add(b, 51);
-  chunk_add(b, 2);
   chunk_add(b, 13);
   chunk_add(b, 11);
+  chunk_add(b, 9);
+  cb_print(b);
+
+  chunk_add(b, 14);
+  cb_print(b);
+  chunk_add(b, 6);
+  cb_print(b);
+  chunk_add(b, 20);
+  chunk_add(b, 17);
+  chunk_add(b, 18);
   cb_print(b);
+  chunk_add(b, 40);
+  chunk_add(b, 36);
+  chunk_add(b, 33);
+  chunk_add(b, 32);
+  cb_print(b);
+  chunk_check(b, 36);
+  chunk_check(b, 35);
+  cset_print("Buffermap", cb_get_bmap(b));
+  missing = cb_get_missing(b, 30, 40);
+  cset_print("Missing in [30, 40]", missing);
+  printf("Missing in [25, 45]: %d\n", cb_get_missingInto(b, missing, 25, 45));
+  cset_print("Same set, reused", missing);
+  printf("Missing in [INT_MAX - 2, INT_MAX]: %d\n", cb_get_missingInto(b, missing, INT_MAX - 2, INT_MAX));
+  printf("Missing in [0, INT_MAX]: %d\n", cb_get_missingInto(b, missing, 0, INT_MAX));
+  chunkID_set_free(missing);
+
+  cb_destroy(b);
+
+  b = cb_init("bytes=40,policy=priority");
+  if (b == NULL) {
+    printf("Error initialising the Chunk Buffer\n");
 
-  chunk_add(b, 26);
+    return -1;
+  }
+  chunk_add_prio(b, 1, 1);
+  chunk_add_prio(b, 2, 3);
+  chunk_add_prio(b, 3, 2);
+  chunk_add_prio(b, 4, 3);
   cb_print(b);
-  chunk_add(b, 30);
+  chunk_add_prio(b, 5, 1);
   cb_print(b);
-  chunk_add(b, 110);
+  chunk_add_prio(b, 6, 2);
   cb_print(b);
-  chunk_add(b, 64);
+  chunk_add_prio(b, 7, 3);
+  cb_print(b);
+  cset_print("Buffermap", cb_get_bmap(b));
+
+  cb_destroy(b);
+
+  /* A chunk which does not fit must not evict anything */
+  b = cb_init("bytes=40,policy=priority");
+  if (b == NULL) {
+    printf("Error initialising the Chunk Buffer\n");
+
+    return -1;
+  }
+  chunk_add_prio(b, 1, 3);
+  chunk_add_prio(b, 2, 1);
+  chunk_add_prio(b, 3, 1);
+  chunk_add_prio(b, 4, 1);
+  chunk_add_prio(b, 10, 2);
+  cb_print(b);
+
+  cb_destroy(b);
+
+  /* Three chunks per segment, at most two segments */
+  b = cb_init("size=8,store=mmap,segment=64,segments=2");
+  if (b == NULL) {
+    printf("Error initialising the Chunk Buffer\n");
+
+    return -1;
+  }
+  chunk_add(b, 1);
+  chunk_add(b, 2);
+  chunk_add(b, 3);
   chunk_add(b, 4);
+  chunk_add(b, 5);
   cb_print(b);
+  chunk_add(b, 6);
   chunk_add(b, 7);
-  chunk_add(b, 34);
-  chunk_add(b, 2);
-  chunk_add(b, 33);
   cb_print(b);
+  chunk_check(b, 5);
+  chunk_check(b, 2);
+  cset_print("Buffermap", cb_get_bmap(b));
 
   cb_destroy(b);
 
+  /* Chunk views are copied only when accepted */
+  b = cb_init("size=4");
+  if (b == NULL) {
+    printf("Error initialising the Chunk Buffer\n");
+
+    return -1;
+  }
+  chunk_add_view(b, 10);
+  chunk_add_view(b, 12);
+  chunk_add_view(b, 10);
+  chunk_add_view(b, 5);
+  cb_print(b);
+  chunk_check(b, 12);
+
+  cb_destroy(b);
+
+  /* Reference counted chunks are stored without copying them */
+  b = cb_init("size=4,refcount=1");
+  if (b == NULL) {
+    printf("Error initialising the Chunk Buffer\n");
+
+    return -1;
+  }
+  chunk_add_shared(b, 1);
+  chunk_add_shared(b, 2);
+  chunk_add_shared(b, 6);
+  cb_print(b);
+
+  cb_destroy(b);
+
+  /* The window must fit in the buffermap */
+  b = cb_init("size=1048577");
+  printf("Window of 2^20 + 1 IDs: %s\n", b ? "accepted" : "refused");
+  if (b) {
+    cb_destroy(b);
+  }
+
+  /* The sizes must be numbers with an optional K, M or G suffix */
+  for (i = 0; i < sizeof(bytes_cfg) / sizeof(bytes_cfg[0]); i++) {
+    b = cb_init(bytes_cfg[i]);
+    printf("\"%s\": %s\n", bytes_cfg[i], b ? "accepted" : "refused");
+    if (b) {
+      cb_destroy(b);
+    }
+  }
+
+  chunk_data_get_stats(&stats);
+  printf("Payload pool: %lu hits, %lu misses\n", stats.hits, stats.misses);
+  chunk_data_pool_flush();
+
   return 0;
 }
@@ -35,6 +35,7 @@ int main(int argc, char *argv[])
   struct chunk src_c;
   struct chunk dst_c;
   uint8_t buff[100];
+  uint8_t *block;
   int res;
 
   src_c.id = 666;
@@ -58,5 +59,34 @@ int main(int argc, char *argv[])
   chunk_print(stdout, &dst_c);
   free(dst_c.data);
 
+  block = chunk_data_alloc(res);
+  memcpy(block, buff, res);
+  res = decodeChunkShared(&dst_c, block, block, res);
+  fprintf(stdout, "Decoding it without copying: %d (%s)\n", res,
+          chunk_data_refcount(block) > 1 ? "shared" : "copied");
+  chunk_print(stdout, &dst_c);
+  chunk_release(&dst_c);
+
+  res = decodeChunkView(&dst_c, block, chunk_data_size(block));
+  fprintf(stdout, "Decoding it in place: %d (%s)\n", res,
+          dst_c.data == block + 20 ? "view" : "copied");
+  res = chunk_adopt(&dst_c, NULL);
+  fprintf(stdout, "Adopting it: %d (%s)\n", res,
+          dst_c.data == block + 20 ? "view" : "copied");
+  chunk_print(stdout, &dst_c);
+  chunk_release(&dst_c);
+  chunk_data_unref(block);
+
+  /* Sizes whose sum overflows must not pass the length checks */
+  src_c.size = 0x7ffffff0;
+  src_c.attributes_size = 0x7ffffff0;
+  encodeChunkHeader(&src_c, buff, sizeof(buff));
+  res = decodeChunk(&dst_c, buff, sizeof(buff));
+  fprintf(stdout, "Decoding a forged header: %d\n", res);
+  src_c.size = 10;
+  encodeChunkHeader(&src_c, buff, sizeof(buff));
+  res = decodeChunk(&dst_c, buff, sizeof(buff));
+  fprintf(stdout, "Decoding forged attributes: %d\n", res);
+
   return 0;
 }
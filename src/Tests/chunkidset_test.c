@@ -11,6 +11,7 @@
 #include "chunkidset.h"
 #include "trade_sig_la.h"
 #include "chunkid_set_h.h"
+#include "int_coding.h"
 
 static void simple_test(void)
 {
@@ -89,12 +90,168 @@ static void metadata_test(void)
   free(meta);
 }
 
+static struct chunkID_set *range_set(const char *mode, int from, int to, int step)
+{
+  struct chunkID_set *cset;
+  char config[32];
+  int i;
+
+  sprintf(config, "type=%s", mode);
+  cset = chunkID_set_init(config);
+  for (i = from; cset && i <= to; i += step) {
+    chunkID_set_add_chunk(cset, i);
+  }
+
+  return cset;
+}
+
+static void set_ops_test(const char *mode)
+{
+  struct chunkID_set *a, *b;
+  static uint8_t buff[2048];
+  int res, meta_len;
+  void *meta;
+
+  printf("Set operations (%s)\n", mode);
+  a = range_set(mode, 100, 400, 3);
+  b = range_set(mode, 250, 600, 2);
+  printf("Common: %d, only in the first: %d, only in the second: %d\n",
+         chunkID_set_intersection_size(a, b), chunkID_set_difference_size(a, b),
+         chunkID_set_difference_size(b, a));
+  printf("Chunks before 300: %d %d\n", chunkID_set_rank(a, 300), chunkID_set_rank(b, 300));
+  chunkID_set_union(a, b);
+  printf("Union: %d chunks, from %d to %d\n", chunkID_set_size(a),
+         chunkID_set_get_earliest(a), chunkID_set_get_latest(a));
+  chunkID_set_difference(a, b);
+  printf("Difference: %d chunks, from %d to %d\n", chunkID_set_size(a),
+         chunkID_set_get_earliest(a), chunkID_set_get_latest(a));
+  chunkID_set_free(a);
+
+  a = range_set(mode, 100, 400, 3);
+  chunkID_set_symmetric_difference(a, b);
+  printf("Symmetric difference: %d chunks, from %d to %d\n", chunkID_set_size(a),
+         chunkID_set_get_earliest(a), chunkID_set_get_latest(a));
+  chunkID_set_symmetric_difference(a, b);
+  printf("Toggled back: %d chunks\n", chunkID_set_size(a));
+  chunkID_set_free(a);
+
+  a = range_set(mode, 100, 400, 3);
+  chunkID_set_intersection(a, b);
+  printChunkID_set(a);
+  chunkID_set_trim(a, 4);
+  printChunkID_set(a);
+
+  res = encodeChunkSignaling(a, NULL, 0, buff, sizeof(buff));
+  printf("Encoding Result: %d\n", res);
+  chunkID_set_free(a);
+  a = decodeChunkSignaling(&meta, &meta_len, buff, res);
+  printChunkID_set(a);
+  chunkID_set_free(a);
+  chunkID_set_free(b);
+}
+
+static void compact_encoding_test(const char *mode)
+{
+  struct chunkID_set *cset, *compact;
+  static uint8_t buff[2048];
+  char config[64];
+  int res, meta_len;
+  void *meta;
+
+  /* A window of chunks with some holes, plus an old chunk */
+  cset = range_set(mode, 10000, 10499, 1);
+  chunkID_set_remove_chunk(cset, 10100);
+  chunkID_set_remove_chunk(cset, 10300);
+  chunkID_set_add_chunk(cset, 20);
+  res = encodeChunkSignaling(cset, NULL, 0, buff, sizeof(buff));
+  printf("Default encoding (%s): %d\n", mode, res);
+
+  /* The compact encodings must be enabled */
+  sprintf(config, "type=%s,encoding=compact", mode);
+  compact = chunkID_set_init(config);
+  chunkID_set_union(compact, cset);
+  res = encodeChunkSignaling(compact, NULL, 0, buff, sizeof(buff));
+  printf("Compact encoding (%s): %d\n", mode, res);
+  chunkID_set_free(compact);
+  chunkID_set_free(cset);
+
+  cset = decodeChunkSignaling(&meta, &meta_len, buff, res);
+  printf("Decoded %d chunks: %d ... %d\n", chunkID_set_size(cset),
+         chunkID_set_get_chunk(cset, 0), chunkID_set_get_chunk(cset, chunkID_set_size(cset) - 1));
+  free(meta);
+
+  /* Decode again, in the same set */
+  res = decodeChunkSignalingInto(cset, (const uint8_t **)&meta, &meta_len, buff, res);
+  printf("Decoded again (%d): %d chunks, earliest %d\n", res, chunkID_set_size(cset),
+         chunkID_set_get_earliest(cset));
+  chunkID_set_free(cset);
+}
+
+/* The span of a bitmap set is bounded, and checks give the rank of the ID */
+static void bitmap_window_test(void)
+{
+  struct chunkID_set *cset;
+  int res;
+
+  cset = chunkID_set_init("type=bitmap");
+  chunkID_set_add_chunk(cset, 100);
+  chunkID_set_add_chunk(cset, 200);
+  res = chunkID_set_add_chunk(cset, 100 + (1 << 20) + 64);
+  printf("Adding a far ID: %s, size %d\n", res < 0 ? "refused" : "accepted", chunkID_set_size(cset));
+  res = chunkID_set_add_chunk(cset, 100 + (1 << 19));
+  printf("Adding a near ID: %s, size %d\n", res < 0 ? "refused" : "accepted", chunkID_set_size(cset));
+  printf("Check 200: %d, rank %d; check 150: %d\n", chunkID_set_check(cset, 200),
+         chunkID_set_rank(cset, 200), chunkID_set_check(cset, 150));
+  chunkID_set_free(cset);
+}
+
+/* Tiny messages claiming a huge span must be refused, not expanded */
+static void forged_span_test(void)
+{
+  struct chunkID_set *cset;
+  uint8_t buff[32];
+  const uint8_t *meta;
+  int len, meta_len, res;
+
+  cset = chunkID_set_init("type=bitmap");
+
+  /* Delta encoding: IDs 0 and 0x7ffffffe */
+  int_cpy(buff, 2);
+  int_cpy(buff + 4, (2 << 8) | 1);
+  int_cpy(buff + 8, 0);
+  int_cpy(buff + 12, 0);
+  len = 16 + varint_cpy(buff + 16, 0x7ffffffe);
+  res = decodeChunkSignalingInto(cset, &meta, &meta_len, buff, len);
+  printf("Forged delta set (%d bytes): %s, size %d\n", len, res < 0 ? "refused" : "accepted", chunkID_set_size(cset));
+
+  /* Run lengths: one run of 2^31 IDs */
+  int_cpy(buff, 1U << 31);
+  int_cpy(buff + 4, (1 << 8) | 1);
+  len = 16 + varint_cpy(buff + 16, 1U << 31);
+  res = decodeChunkSignalingInto(cset, &meta, &meta_len, buff, len);
+  printf("Forged RLE set (%d bytes): %s, size %d\n", len, res < 0 ? "refused" : "accepted", chunkID_set_size(cset));
+
+  /* Plain bitmap of 2^31 bits */
+  int_cpy(buff, 1U << 31);
+  int_cpy(buff + 4, 1);
+  res = decodeChunkSignalingInto(cset, &meta, &meta_len, buff, 16);
+  printf("Forged bitmap: %s\n", res < 0 ? "refused" : "accepted");
+
+  chunkID_set_free(cset);
+}
+
 int main(int argc, char *argv[])
 {
   simple_test();
   encoding_test("priority");
   encoding_test("bitmap");
   metadata_test();
+  set_ops_test("bitmap");
+  set_ops_test("priority");
+  compact_encoding_test("bitmap");
+  compact_encoding_test("priority");
+  bitmap_window_test();
+  forged_span_test();
 
   return 0;
 }
@@ -0,0 +1,292 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "chunk.h"
+#include "trade_fec.h"
+
+static const char *kernels[] = {"scalar", "ssse3", "avx2"};
+static int refcount;	// the chunks are reference counted ("refcount=1")
+
+static void chunk_forge(struct chunk *c, int id, int size, int attributes_size)
+{
+  int i;
+
+  if (refcount) {
+    chunk_alloc(c, size, attributes_size);
+  } else {
+    c->data = malloc(size);
+    c->size = size;
+    c->attributes = attributes_size ? malloc(attributes_size) : NULL;
+    c->attributes_size = attributes_size;
+  }
+  c->id = id;
+  c->timestamp = 40 * id;
+  for (i = 0; i < size; i++) {
+    c->data[i] = id * 31 + i;
+  }
+  for (i = 0; i < attributes_size; i++) {
+    ((uint8_t *)c->attributes)[i] = id + i;
+  }
+}
+
+static void chunk_free(struct chunk *c)
+{
+  if (refcount) {
+    chunk_release(c);
+  } else {
+    free(c->data);
+    free(c->attributes);
+  }
+}
+
+static int chunk_same(const struct chunk *a, const struct chunk *b)
+{
+  return a->id == b->id && a->timestamp == b->timestamp && a->size == b->size &&
+         a->attributes_size == b->attributes_size && !memcmp(a->data, b->data, a->size) &&
+         (a->attributes_size == 0 || !memcmp(a->attributes, b->attributes, a->attributes_size));
+}
+
+/* Send a group of k chunks plus m repair chunks, losing some of them */
+static void loss_test(const char *config, int k, int m, const char *lost)
+{
+  struct fec_encoder *e = fecEncoderInit(config);
+  struct fec_decoder *d = fecDecoderInit(config);
+  struct chunk c[16], r[16], out;
+  int i, n = 0, ok = 1;
+
+  refcount = strstr(config, "refcount=1") != NULL;
+
+  for (i = 0; i < k; i++) {
+    chunk_forge(&c[i], 3 * k + i, 100 + 37 * i, i % 2 ? 12 : 0);
+    fecEncode(e, &c[i]);
+  }
+  for (i = 0; i < m; i++) {
+    fecEncoderGet(e, &r[i]);
+  }
+  for (i = 0; i < k + m; i++) {
+    if (lost[i] == 'x') {
+      continue;
+    }
+    fecDecode(d, i < k ? &c[i] : &r[i - k], i >= k);
+  }
+  while (fecDecoderGet(d, &out)) {
+    ok = ok && lost[out.id - 3 * k] == 'x' && chunk_same(&out, &c[out.id - 3 * k]);
+    chunk_free(&out);
+    n++;
+  }
+  printf("k=%d m=%d%s, lost %s: rebuilt %d chunks, %s\n", k, m, refcount ? " (refcount)" : "",
+         lost, n, ok ? "correct" : "WRONG");
+
+  for (i = 0; i < k; i++) {
+    chunk_free(&c[i]);
+  }
+  for (i = 0; i < m; i++) {
+    chunk_free(&r[i]);
+  }
+  fecEncoderFree(e);
+  fecDecoderFree(d);
+}
+
+/* A repair chunk with a block size smaller than a source must be refused */
+static void forged_len_test(int repair_first)
+{
+  struct fec_decoder *d = fecDecoderInit("k=2,m=1");
+  struct chunk c, r, out;
+  int res_c, res_r, n = 0;
+
+  chunk_forge(&c, 1, 4000, 0);
+  chunk_forge(&r, 0, 16, 0);
+  memset(r.data, 0, 16);
+  r.id = 0;
+  r.timestamp = 0;
+  r.data[0] = 2;
+  r.data[1] = 1;
+  r.data[4 + 3] = 8;
+  if (repair_first) {
+    res_r = fecDecode(d, &r, 1);
+    res_c = fecDecode(d, &c, 0);
+  } else {
+    res_c = fecDecode(d, &c, 0);
+    res_r = fecDecode(d, &r, 1);
+  }
+  while (fecDecoderGet(d, &out)) {
+    chunk_free(&out);
+    n++;
+  }
+  printf("Forged repair %s the source: repair %s, source %s, rebuilt %d chunks\n",
+         repair_first ? "before" : "after", res_r < 0 ? "refused" : "accepted",
+         res_c < 0 ? "refused" : "accepted", n);
+
+  chunk_free(&c);
+  chunk_free(&r);
+  fecDecoderFree(d);
+}
+
+/*
+ * All the kernels must generate the same repair chunks, also when
+ * encoders using different kernels are active at the same time
+ */
+static void kernels_test(void)
+{
+  struct fec_encoder *e[3];
+  struct chunk c[8], ref[2], r;
+  int i, j, same = 1;
+
+  for (i = 0; i < 8; i++) {
+    chunk_forge(&c[i], i, 1000 + 333 * i, 0);
+  }
+  for (j = 0; j < 3; j++) {
+    char config[64];
+
+    sprintf(config, "k=8,m=2,kernel=%s", kernels[j]);
+    e[j] = fecEncoderInit(config);
+  }
+  for (i = 0; i < 8; i++) {
+    for (j = 0; j < 3; j++) {
+      if (e[j]) {
+        fecEncode(e[j], &c[i]);
+      }
+    }
+  }
+  for (j = 0; j < 3; j++) {
+    if (e[j] == NULL) {
+      continue;
+    }
+    for (i = 0; fecEncoderGet(e[j], &r); i++) {
+      if (j == 0) {
+        ref[i] = r;
+      } else {
+        same = same && r.size == ref[i].size && !memcmp(r.data, ref[i].data, r.size);
+        chunk_free(&r);
+      }
+    }
+    fecEncoderFree(e[j]);
+  }
+  printf("Kernels agree: %s\n", same ? "yes" : "no");
+  for (i = 0; i < 8; i++) {
+    chunk_free(&c[i]);
+  }
+  chunk_free(&ref[0]);
+  chunk_free(&ref[1]);
+}
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Encoding and decoding throughput (MB/s of source chunks, on one core) */
+static void benchmark(int k, int m, int size)
+{
+  struct chunk *c = malloc(k * sizeof(struct chunk)), r, out;
+  int i, j;
+
+  refcount = 1;
+  for (i = 0; i < k; i++) {
+    chunk_forge(&c[i], i, size, 0);
+  }
+  for (j = 0; j < 3; j++) {
+    struct fec_encoder *e;
+    struct fec_decoder *d;
+    char config[64];
+    double start, enc = 0, dec = 0;
+    int groups = 0;
+
+    sprintf(config, "k=%d,m=%d,kernel=%s,refcount=1", k, m, kernels[j]);
+    e = fecEncoderInit(config);
+    d = fecDecoderInit(config);
+    if (e == NULL || d == NULL) {
+      printf("%s: not supported\n", kernels[j]);
+      continue;
+    }
+    while (enc + dec < 2) {
+      start = now();
+      for (i = 0; i < k; i++) {
+        c[i].id = groups * k + i;
+        fecEncode(e, &c[i]);
+      }
+      enc += now() - start;
+      /* Lose the first m chunks */
+      start = now();
+      for (i = m; i < k; i++) {
+        fecDecode(d, &c[i], 0);
+      }
+      while (fecEncoderGet(e, &r)) {
+        fecDecode(d, &r, 1);
+        chunk_free(&r);
+      }
+      while (fecDecoderGet(d, &out)) {
+        chunk_free(&out);
+      }
+      dec += now() - start;
+      groups++;
+    }
+    printf("%s: encoding %.1f MB/s, decoding %.1f MB/s per core\n", kernels[j],
+           groups * k * (double)size / enc / 1000000, groups * k * (double)size / dec / 1000000);
+    fecEncoderFree(e);
+    fecDecoderFree(d);
+  }
+  for (i = 0; i < k; i++) {
+    chunk_free(&c[i]);
+  }
+  free(c);
+}
+
+int main(int argc, char *argv[])
+{
+  int o, k = 8, m = 2, size = 65536, bench = 0;
+
+  while ((o = getopt(argc, argv, "bk:m:s:")) != -1) {
+    switch(o) {
+      case 'b':
+        bench = 1;
+        break;
+      case 'k':
+        k = atoi(optarg);
+        break;
+      case 'm':
+        m = atoi(optarg);
+        break;
+      case 's':
+        size = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Error: unknown option %c\n", o);
+
+        return -1;
+    }
+  }
+  if (bench) {
+    benchmark(k, m, size);
+
+    return 0;
+  }
+
+  loss_test("k=4,m=2", 4, 2, "....xx");
+  loss_test("k=4,m=2", 4, 2, "x.x...");
+  loss_test("k=4,m=2", 4, 2, ".x..x.");
+  loss_test("k=4,m=2", 4, 2, "xx.x..");
+  loss_test("k=8,m=3", 8, 3, "x..x.x.....");
+  loss_test("k=1,m=1", 1, 1, "x.");
+  loss_test("k=4,m=2,refcount=1", 4, 2, "x.x...");
+  loss_test("k=8,m=3,refcount=1", 8, 3, "x..x.x.....");
+  refcount = 0;
+  forged_len_test(1);
+  forged_len_test(0);
+  kernels_test();
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net_helper.h"
+#include "chunk.h"
+
+#define PORT 6700
+#define MSG_SIZE 2000
+#define NACK_DELAY 200	// ms, longer than handling a NACK and counting its fragments
+#define BUFFSIZE 4096
+
+/* Not provided by the library (usually defined by the application) */
+void reg_message_send(int size, uint8_t type)
+{
+}
+
+void reg_message_recv(int size, uint8_t type)
+{
+}
+
+static struct nodeID *node;
+static struct sockaddr_in dst;
+
+/* A plain UDP socket playing a receiver */
+static int receiver(int port, struct nodeID **id)
+{
+  struct sockaddr_in a;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  inet_aton("127.0.0.1", &a.sin_addr);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+    return -1;
+  }
+  *id = create_node("127.0.0.1", port);
+
+  return fd;
+}
+
+/* Count the datagrams received by fd in 50ms, and get the message ID */
+static int fragments(int fd, int *msg)
+{
+  uint8_t d[BUFFSIZE];
+  struct timeval tv;
+  fd_set fds;
+  int n = 0;
+
+  for (;;) {
+    tv.tv_sec = 0;
+    tv.tv_usec = 50000;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0 || recv(fd, d, sizeof(d), 0) < 11) {
+      return n;
+    }
+    if (msg) {
+      *msg = (d[3] << 8) | d[4];
+    }
+    n++;
+  }
+}
+
+/* Send a NACK for the cnt fragments in list, as a receiver does */
+static void nack(int fd, int msg, const int *list, int cnt)
+{
+  uint8_t d[11 + 2 * 16];
+  int i;
+
+  memset(d, 0, 11);
+  d[0] = 2;	// NACK
+  d[3] = msg >> 8;
+  d[4] = msg & 0xff;
+  d[7] = cnt >> 8;
+  d[8] = cnt & 0xff;
+  for (i = 0; i < cnt; i++) {
+    d[11 + 2 * i] = list[i] >> 8;
+    d[11 + 2 * i + 1] = list[i] & 0xff;
+  }
+  sendto(fd, d, 11 + 2 * cnt, 0, (struct sockaddr *)&dst, sizeof(dst));
+}
+
+/* The node handles the NACKs it received */
+static void handle(void)
+{
+  uint8_t buff[BUFFSIZE];
+  struct nh_msg m;
+  struct timeval tv;
+
+  for (;;) {
+    tv.tv_sec = 0;
+    tv.tv_usec = 20000;
+    if (wait4data(node, &tv, NULL) <= 0) {
+      break;
+    }
+    m.buff = buff;
+    m.size = BUFFSIZE;
+    if (recv_from_peers(node, &m, 1) > 0) {
+      nodeid_free(m.peer);
+    }
+  }
+}
+
+static void retransmitted(const char *what, int fd)
+{
+  static struct nh_reasm_stats old;
+  struct nh_reasm_stats s;
+
+  handle();
+  reasm_stats(&s);
+  printf("%s: %d fragments received, %u retransmitted\n", what, fragments(fd, NULL),
+         s.retransmitted - old.retransmitted);
+  old = s;
+}
+
+int main(int argc, char *argv[])
+{
+  static const int lost[] = {1, 3}, dup[] = {2, 2, 2, 2}, unsorted[] = {3, 0}, bad[] = {4, 1000};
+  struct nodeID *ids[2];
+  uint8_t buff[MSG_SIZE];
+  int fds[2], msg = 0, n;
+
+  node = net_helper_init("127.0.0.1", PORT, "mtu=576,nack_delay=200,send_cache_time=5000");
+  fds[0] = receiver(PORT + 1, &ids[0]);
+  fds[1] = receiver(PORT + 2, &ids[1]);
+  if (node == NULL || fds[0] < 0 || fds[1] < 0) {
+    fprintf(stderr, "Error creating the sockets\n");
+
+    return -1;
+  }
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(PORT);
+  inet_aton("127.0.0.1", &dst.sin_addr);
+
+  memset(buff, 0, sizeof(buff));
+  send_to_peer(node, ids[0], buff, sizeof(buff));
+  n = fragments(fds[0], &msg);
+  printf("Message sent in %d fragments\n", n);
+
+  nack(fds[0], msg, lost, 2);
+  retransmitted("NACK for 2 fragments", fds[0]);
+  nack(fds[0], msg, lost, 2);
+  retransmitted("Same NACK, at once", fds[0]);
+  usleep(NACK_DELAY * 1000);
+  nack(fds[0], msg, dup, 4);
+  retransmitted("Repeated fragment", fds[0]);
+  usleep(NACK_DELAY * 1000);
+  nack(fds[0], msg, unsorted, 2);
+  retransmitted("Unsorted list", fds[0]);
+  usleep(NACK_DELAY * 1000);
+  nack(fds[0], msg, bad, 2);
+  retransmitted("Fragments out of range", fds[0]);
+  usleep(NACK_DELAY * 1000);
+  nack(fds[1], msg, lost, 2);
+  retransmitted("NACK from another node", fds[1]);
+  usleep(NACK_DELAY * 1000);
+  nack(fds[0], msg + 1, lost, 2);
+  retransmitted("NACK for an unknown message", fds[0]);
+
+  /* A chunk payload is referenced by the cache, not copied */
+  {
+    uint8_t hdr[3] = {0, 0, 0};
+    uint8_t *payload = chunk_data_alloc(MSG_SIZE);
+    struct iovec iov[2];
+
+    memset(payload, 0, MSG_SIZE);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = MSG_SIZE;
+    send_to_peers_iov_shared(node, &ids[0], 1, iov, 2, 1 << 1, NULL);
+    printf("Shared payload sent in %d fragments, %d references\n", fragments(fds[0], &msg),
+           chunk_data_refcount(payload));
+    chunk_data_unref(payload);
+    usleep(NACK_DELAY * 1000);
+    nack(fds[0], msg, lost, 2);
+    retransmitted("NACK for the shared payload", fds[0]);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  nodeid_free(ids[0]);
+  nodeid_free(ids[1]);
+
+  return 0;
+}
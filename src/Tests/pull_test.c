@@ -0,0 +1,180 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "net_helper.h"
+#include "chunkidset.h"
+#include "trade_sig_ha.h"
+#include "trade_pull.h"
+
+/* The requests are not sent: the requested chunks are counted */
+static int requested;
+
+int requestChunks(struct nodeID *to, const struct chunkID_set *cset, int max_deliver, uint16_t trans_id)
+{
+  requested += chunkID_set_size(cset);
+
+  return 0;
+}
+
+/* Not provided by the library (usually defined by the application) */
+void reg_message_send(int size, uint8_t type)
+{
+}
+
+void reg_message_recv(int size, uint8_t type)
+{
+}
+
+static struct chunkID_set *chunks(int first, int n)
+{
+  struct chunkID_set *cset = chunkID_set_init("size=0");
+  int i;
+
+  for (i = 0; i < n; i++) {
+    chunkID_set_add_chunk(cset, first + i);
+  }
+
+  return cset;
+}
+
+static void set_print(const char *name, const struct chunkID_set *cset)
+{
+  int i;
+
+  printf("%s:", name);
+  for (i = 0; i < chunkID_set_size(cset); i++) {
+    printf(" %d", chunkID_set_get_chunk(cset, i));
+  }
+  printf("\n");
+}
+
+/* The window grows with the deliveries, and is halved (once) on timeouts */
+static void aimd_test(struct nodeID *a)
+{
+  struct pull_engine *pe = pullInit("window=2,window_max=8,rto=20,rto_min=20");
+  struct chunkID_set *cset = chunks(0, 10), *retry = chunkID_set_init("size=0");
+  int i, res;
+
+  printf("Initial window: %d\n", pullWindow(pe, a));
+  res = pullRequest(pe, a, cset, NULL);
+  printf("Requested %d chunks, window %d\n", res, pullWindow(pe, a));
+  res = pullRequest(pe, a, cset, NULL);
+  printf("Requested %d more chunks\n", res);
+  chunkID_set_free(cset);
+  for (i = 0; i < 3; i++) {
+    int j;
+
+    cset = chunks(i * 10, 10);
+    for (j = 0; j < 10; j++) {
+      pullReceived(pe, a, i * 10 + j);
+    }
+    printf("Delivered: window %d\n", pullWindow(pe, a));
+    chunkID_set_free(cset);
+    cset = chunks((i + 1) * 10, 10);
+    res = pullRequest(pe, a, cset, NULL);
+    printf("Requested %d chunks\n", res);
+    chunkID_set_free(cset);
+  }
+  pullDestroy(pe);
+
+  /* Timeouts */
+  pe = pullInit("window=4,window_max=8,rto=20,rto_min=20");
+  cset = chunks(100, 4);
+  res = pullRequest(pe, a, cset, NULL);
+  printf("Requested %d chunks\n", res);
+  usleep(30000);
+  res = pullCheck(pe, retry);
+  printf("Timed out: %d, window %d\n", res, pullWindow(pe, a));
+  set_print("To be retried", retry);
+
+  chunkID_set_free(cset);
+  chunkID_set_free(retry);
+  pullDestroy(pe);
+}
+
+/* A peer delivering one chunk every 20 ms does not need a large window */
+static void bdp_test(struct nodeID *a)
+{
+  struct pull_engine *pe = pullInit("window=2,window_max=64,rto=1000");
+  int i;
+
+  for (i = 0; i < 12; i++) {
+    struct chunkID_set *cset = chunks(i, 1);
+
+    pullRequest(pe, a, cset, NULL);
+    usleep(20000);
+    pullReceived(pe, a, i);
+    chunkID_set_free(cset);
+  }
+  i = pullWindow(pe, a);
+  printf("Window after 12 deliveries: %s\n", i >= 2 && i <= 4 ? "bounded by the BDP" : "NOT bounded");
+  pullDestroy(pe);
+}
+
+/* Chunks can be requested to other peers, and are not requested twice */
+static void reassign_test(struct nodeID *a, struct nodeID *b)
+{
+  struct pull_engine *pe = pullInit("window=4,rto=20,rto_min=20");
+  struct chunkID_set *cset = chunks(200, 4), *retry = chunkID_set_init("size=0");
+  struct timeval deadline;
+  int res;
+
+  pullRequest(pe, a, cset, NULL);
+  res = pullRequest(pe, b, cset, NULL);
+  printf("Pending chunks requested again: %d\n", res);
+  res = pullReceived(pe, b, 200);
+  printf("Chunk from the wrong peer: %d, window of a %d\n", res, pullWindow(pe, a));
+  res = pullReceived(pe, a, 200);
+  printf("Same chunk from the right peer: %d\n", res);
+  res = pullRemovePeer(pe, a, retry);
+  set_print("Removing a", retry);
+  res = pullRequest(pe, b, retry, NULL);
+  printf("Requested %d chunks to b\n", res);
+  chunkID_set_trim(retry, 0);
+
+  /* Late requests are dropped, not retried */
+  chunkID_set_free(cset);
+  cset = chunks(300, 1);
+  gettimeofday(&deadline, NULL);
+  deadline.tv_usec += 5000;
+  if (deadline.tv_usec >= 1000000) {
+    deadline.tv_sec++;
+    deadline.tv_usec -= 1000000;
+  }
+  pullRequest(pe, a, cset, &deadline);
+  usleep(10000);
+  res = pullCheck(pe, retry);
+  printf("Late: %d cancelled, %d to be retried\n", res, chunkID_set_size(retry));
+
+  chunkID_set_free(cset);
+  chunkID_set_free(retry);
+  pullDestroy(pe);
+}
+
+int main(int argc, char *argv[])
+{
+  struct nodeID *a, *b;
+
+  a = create_node("10.0.0.1", 6000);
+  b = create_node("10.0.0.2", 6000);
+
+  aimd_test(a);
+  bdp_test(a);
+  reassign_test(a, b);
+  printf("Requests sent for %d chunks\n", requested);
+
+  nodeid_free(a);
+  nodeid_free(b);
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net_helper.h"
+#include "grapes_msg_types.h"
+
+#define PORT 6710
+#define BUFFSIZE 4096
+
+/*
+ * 10 bytes per ms, in a bucket of 1KB: a 500 bytes chunk (531 bytes with
+ * the headers) is sent every 53ms, and its deadline is 80ms
+ */
+#define CONFIG "mtu=576,upload=80,burst=1,chunk_deadline=80,send_queue=3"
+
+/* Not provided by the library (usually defined by the application) */
+void reg_message_send(int size, uint8_t type)
+{
+}
+
+void reg_message_recv(int size, uint8_t type)
+{
+}
+
+static struct nodeID *node, *dst;
+static int receiver;
+
+/* Send the i-th message of the given type and size */
+static int msg_send(uint8_t type, int i, int size)
+{
+  uint8_t buff[BUFFSIZE];
+
+  memset(buff, 0, size);
+  buff[0] = type;
+  buff[1] = i;
+
+  return send_to_peer(node, dst, buff, size);
+}
+
+/* Let the node send its queues for ms milliseconds, printing what arrives */
+static void drain(int ms)
+{
+  uint8_t d[BUFFSIZE];
+  struct timeval tv;
+  int i;
+
+  printf("Received:");
+  for (i = 0; i < ms; i += 5) {
+    tv.tv_sec = 0;
+    tv.tv_usec = 5000;
+    wait4data(node, &tv, NULL);
+    /* The message follows a 3 bytes header */
+    while (recv(receiver, d, sizeof(d), MSG_DONTWAIT) > 4) {
+      printf(" %c%d", d[3] == MSG_TYPE_CHUNK ? 'c' : 's', d[4]);
+    }
+  }
+  printf("\n");
+}
+
+static void stats_print(void)
+{
+  static struct nh_queue_stats old;
+  struct nh_queue_stats s;
+
+  send_queue_stats(&s);
+  printf("\tqueued %u, sent %u, late %u, overflows %u, backlog %u bytes\n", s.queued - old.queued,
+         s.sent - old.sent, s.late - old.late, s.overflows - old.overflows, s.backlog);
+  old = s;
+}
+
+/* The signalling messages overtake the queued chunks */
+static void priority_test(void)
+{
+  int i;
+
+  printf("Priority\n");
+  for (i = 0; i < 6; i++) {
+    msg_send(MSG_TYPE_CHUNK, i, 200);
+  }
+  msg_send(MSG_TYPE_SIGNALLING, 1, 50);
+  msg_send(MSG_TYPE_SIGNALLING, 2, 50);
+  drain(300);
+  stats_print();
+}
+
+/* The chunks which cannot be sent within chunk_deadline are dropped */
+static void deadline_test(void)
+{
+  int i;
+
+  printf("Deadline\n");
+  for (i = 0; i < 6; i++) {
+    msg_send(MSG_TYPE_CHUNK, i, 500);
+  }
+  drain(300);
+  stats_print();
+}
+
+/* The chunks exceeding send_queue are refused, but not the signalling */
+static void overflow_test(void)
+{
+  uint8_t d[BUFFSIZE];
+  int i, res[8];
+  struct nh_queue_stats s;
+
+  printf("Overflow\n");
+  for (i = 0; i < 8; i++) {
+    res[i] = msg_send(MSG_TYPE_CHUNK, i, 500);
+  }
+  printf("Chunks queued:");
+  for (i = 0; i < 8; i++) {
+    printf(" %s", res[i] > 0 ? "yes" : "no");
+  }
+  printf("\nSignalling queued: %s\n", msg_send(MSG_TYPE_SIGNALLING, 1, 50) > 0 ? "yes" : "no");
+  send_queue_stats(&s);
+  printf("Overflows: %u, backlog %u bytes\n", s.overflows, s.backlog);
+
+  /* The queued chunks are either sent or late: the timing does not matter */
+  for (i = 0; i < 100 && s.backlog; i++) {
+    struct timeval tv = {0, 5000};
+
+    wait4data(node, &tv, NULL);
+    while (recv(receiver, d, sizeof(d), MSG_DONTWAIT) > 0);
+    send_queue_stats(&s);
+  }
+  printf("Drained: %s\n", s.backlog ? "no" : "yes");
+}
+
+int main(int argc, char *argv[])
+{
+  struct sockaddr_in a;
+  struct nh_queue_stats s;
+
+  node = net_helper_init("127.0.0.1", PORT, CONFIG);
+  dst = create_node("127.0.0.1", PORT + 1);
+  receiver = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(PORT + 1);
+  inet_aton("127.0.0.1", &a.sin_addr);
+  if (node == NULL || receiver < 0 || bind(receiver, (struct sockaddr *)&a, sizeof(a)) < 0) {
+    fprintf(stderr, "Error creating the sockets\n");
+
+    return -1;
+  }
+
+  priority_test();
+  deadline_test();
+  overflow_test();
+  send_queue_stats(&s);
+  printf("Queued messages sent or late: %s\n", s.queued == s.sent + s.late ? "all" : "NOT all");
+
+  close(receiver);
+  nodeid_free(dst);
+
+  return 0;
+}
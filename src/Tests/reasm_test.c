@@ -0,0 +1,191 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net_helper.h"
+
+#define PORT 6690
+#define FRAG_SIZE 100
+#define BUFFSIZE 4096
+
+/* Not provided by the library (usually defined by the application) */
+void reg_message_send(int size, uint8_t type)
+{
+}
+
+void reg_message_recv(int size, uint8_t type)
+{
+}
+
+static struct nodeID *node;
+static int sender;
+static struct sockaddr_in dst;
+
+static uint8_t pattern(int msg, int i)
+{
+  return msg * 7 + i;
+}
+
+/*
+ * Send a datagram as the net_helper does in MTU mode: the fragment i of
+ * message msg, with an extended header, and len bytes of data
+ */
+static void frag_send(int msg, int i, int frags, int frag_size, int len)
+{
+  uint8_t d[11 + BUFFSIZE];
+  int j;
+
+  d[0] = 1;	// data fragment
+  d[1] = 0;
+  d[2] = 0;
+  d[3] = msg >> 8;
+  d[4] = msg & 0xff;
+  d[5] = i >> 8;
+  d[6] = i & 0xff;
+  d[7] = frags >> 8;
+  d[8] = frags & 0xff;
+  d[9] = frag_size >> 8;
+  d[10] = frag_size & 0xff;
+  for (j = 0; j < len; j++) {
+    d[11 + j] = pattern(msg, i * frag_size + j);
+  }
+  sendto(sender, d, 11 + len, 0, (struct sockaddr *)&dst, sizeof(dst));
+}
+
+/* The fragment i of a message of len bytes */
+static void msg_send(int msg, int i, int len)
+{
+  int frags = (len + FRAG_SIZE - 1) / FRAG_SIZE;
+
+  frag_send(msg, i, frags, FRAG_SIZE, i == frags - 1 ? len - i * FRAG_SIZE : FRAG_SIZE);
+}
+
+/* Receive all the pending messages, batch at a time */
+static void receive(int batch)
+{
+  static uint8_t buffs[8][BUFFSIZE];
+  struct nh_msg msgs[8];
+  struct timeval tv;
+  int i, j, n;
+
+  for (;;) {
+    tv.tv_sec = 0;
+    tv.tv_usec = 50000;
+    if (wait4data(node, &tv, NULL) <= 0) {
+      break;
+    }
+    for (i = 0; i < batch; i++) {
+      msgs[i].buff = buffs[i];
+      msgs[i].size = BUFFSIZE;
+    }
+    n = recv_from_peers(node, msgs, batch);
+    for (i = 0; i < n; i++) {
+      /* The first byte identifies the message: it is pattern(msg, 0) */
+      int ok = 1, msg = msgs[i].buff[0] / 7;
+
+      for (j = 0; j < msgs[i].len; j++) {
+        ok = ok && msgs[i].buff[j] == pattern(msg, j);
+      }
+      printf("\tmessage %d: %d bytes, %s\n", msg, msgs[i].len, ok ? "correct" : "CORRUPTED");
+      nodeid_free(msgs[i].peer);
+    }
+  }
+}
+
+static void stats_print(void)
+{
+  static struct nh_reasm_stats old;
+  struct nh_reasm_stats s;
+
+  reasm_stats(&s);
+  printf("\treassembled %u, dropped %u, evicted %u\n", s.reassembled - old.reassembled,
+         s.dropped - old.dropped, s.evicted - old.evicted);
+  old = s;
+}
+
+static void reasm_test(int batch)
+{
+  int i;
+
+  printf("Receiving %s:\n", batch == 1 ? "one datagram at a time" : "in batches");
+
+  printf("Out of order\n");
+  msg_send(1, 2, 250);
+  msg_send(1, 0, 250);
+  msg_send(1, 1, 250);
+  receive(batch);
+  stats_print();
+
+  printf("Interleaved\n");
+  msg_send(2, 0, 300);
+  msg_send(3, 1, 150);
+  msg_send(2, 1, 300);
+  msg_send(3, 0, 150);
+  msg_send(2, 2, 300);
+  receive(batch);
+  stats_print();
+
+  printf("Duplicates\n");
+  msg_send(4, 0, 200);
+  msg_send(4, 0, 200);
+  msg_send(4, 1, 200);
+  msg_send(4, 1, 200);
+  receive(batch);
+  stats_print();
+
+  printf("Invalid index and lengths\n");
+  frag_send(5, 3, 3, FRAG_SIZE, 10);		// index out of range
+  frag_send(5, 0, 3, FRAG_SIZE, FRAG_SIZE - 1);	// short fragment
+  frag_send(5, 2, 3, FRAG_SIZE, FRAG_SIZE + 1);	// last fragment too long
+  frag_send(5, 2, 3, FRAG_SIZE, 0);		// empty last fragment
+  frag_send(5, 0, 3, 0, 0);			// no fragment size
+  receive(batch);
+  stats_print();
+
+  printf("Too large for the buffer\n");
+  for (i = 0; i < (BUFFSIZE + 50 + FRAG_SIZE - 1) / FRAG_SIZE; i++) {
+    msg_send(6, i, BUFFSIZE + 50);
+  }
+  receive(batch);
+  stats_print();
+
+  printf("Still working\n");
+  msg_send(7, 1, 120);
+  msg_send(7, 0, 120);
+  receive(batch);
+  stats_print();
+}
+
+int main(int argc, char *argv[])
+{
+  node = net_helper_init("127.0.0.1", PORT, "");
+  sender = socket(AF_INET, SOCK_DGRAM, 0);
+  if (node == NULL || sender < 0) {
+    fprintf(stderr, "Error creating the sockets\n");
+
+    return -1;
+  }
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(PORT);
+  inet_aton("127.0.0.1", &dst.sin_addr);
+
+  reasm_test(1);
+  reasm_test(8);
+  close(sender);
+
+  return 0;
+}
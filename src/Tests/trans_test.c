@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see gpl-3.0.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_helper.h"
+#include "peer.h"
+#include "peerset.h"
+#include "chunkidset.h"
+#include "trade_sig_ha.h"
+#include "trade_trans.h"
+
+/* The signaling messages are not sent: the transmissions are counted */
+static int transmissions;
+static struct nodeID *last_to;
+static uint16_t last_id;
+
+static int transmit(struct nodeID *to, uint16_t trans_id)
+{
+  transmissions++;
+  last_to = to;
+  last_id = trans_id;
+
+  return 0;
+}
+
+int requestChunks(struct nodeID *to, const struct chunkID_set *cset, int max_deliver, uint16_t trans_id)
+{
+  return transmit(to, trans_id);
+}
+
+int offerChunks(struct nodeID *to, struct chunkID_set *cset, int max_deliver, uint16_t trans_id)
+{
+  return transmit(to, trans_id);
+}
+
+int acceptChunks(struct nodeID *to, struct chunkID_set *cset, uint16_t trans_id)
+{
+  return transmit(to, trans_id);
+}
+
+int sendBufferMap(struct nodeID *to, const struct nodeID *owner, const struct chunkID_set *bmap, int cb_size, uint16_t trans_id)
+{
+  return transmit(to, trans_id);
+}
+
+/* Not provided by the library (usually defined by the application) */
+void reg_message_send(int size, uint8_t type)
+{
+}
+
+void reg_message_recv(int size, uint8_t type)
+{
+}
+
+static struct nodeID *peers[2];
+static int expired;
+
+static struct nodeID *failover(const struct nodeID *to, uint16_t trans_id, enum signaling_type type,
+                               struct chunkID_set *cset, void *opaque)
+{
+  expired++;
+
+  return nodeid_equal(to, peers[0]) ? peers[1] : NULL;
+}
+
+static void config_test(void)
+{
+  static const char *configs[] = {"rto=0", "rto=-5", "rto=3000000", "rto_max=3000000", "rto_min=0", "retries=-1", "rto=100"};
+  unsigned int i;
+
+  for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    struct trans_table *t = transInit(NULL, configs[i], NULL);
+
+    printf("Config \"%s\": %s\n", configs[i], t ? "accepted" : "refused");
+    if (t) {
+      transDestroy(t);
+    }
+  }
+}
+
+/* Replies are matched by ID and peer, and retransmitted replies are not RTT samples */
+static void match_test(struct peerset *ps)
+{
+  struct trans_table *t = transInit(ps, "rto=20,rto_max=1000,retries=1", NULL);
+  struct chunkID_set *cset = chunkID_set_init("size=0");
+  struct peer *p = peerset_get_peer(ps, peers[0]);
+  int a, b, res;
+  void *opaque = NULL;
+
+  chunkID_set_add_chunk(cset, 10);
+  a = transSend(t, sig_request, peers[0], cset, 1, &a);
+  b = transSend(t, sig_offer, peers[0], cset, 1, &b);
+  printf("Two transactions: %s IDs, %d pending\n", a != b ? "different" : "same", transPending(t));
+
+  res = transComplete(t, peers[1], a, NULL);
+  printf("Reply from another peer: %d\n", res);
+  res = transComplete(t, peers[0], a + b + 1, NULL);
+  printf("Reply with an unknown ID: %d\n", res);
+  usleep(5000);
+  res = transComplete(t, peers[0], a, &opaque);
+  printf("Reply: %d (%s opaque), RTT %s\n", res, opaque == &a ? "right" : "wrong",
+         p->srtt >= 5000 && p->srtt < 1000000 ? "sampled" : "NOT sampled");
+  res = transComplete(t, peers[0], a, NULL);
+  printf("Duplicate reply: %d\n", res);
+
+  /* Karn's rule */
+  p->srtt = 0;
+  usleep(25000);
+  transCheck(t);
+  res = transComplete(t, peers[0], b, NULL);
+  printf("Reply to a retransmission: %d, RTT %s\n", res, p->srtt ? "sampled" : "not sampled");
+
+  chunkID_set_free(cset);
+  transDestroy(t);
+}
+
+/* The timeout doubles at every retransmission, then the callback moves the transaction */
+static void timeout_test(struct peerset *ps)
+{
+  struct trans_table *t = transInit(ps, "rto=20,rto_max=1000,retries=2", failover);
+  struct timeval tv;
+  int id, i;
+
+  peerset_get_peer(ps, peers[0])->srtt = 0;
+  transmissions = 0;
+  id = transSend(t, sig_request, peers[0], NULL, 1, NULL);
+  transCheck(t);
+  printf("Before the timeout: %d transmissions\n", transmissions);
+  for (i = 0; i < 3; i++) {
+    transNextTimeout(t, &tv);
+    printf("Next timeout in about %ld ms\n", (tv.tv_sec * 1000000 + tv.tv_usec + 5000) / 10000 * 10);
+    usleep(tv.tv_sec * 1000000 + tv.tv_usec + 2000);
+    transCheck(t);
+    printf("%d transmissions, %d expired\n", transmissions, expired);
+  }
+  printf("Moved to the other peer: %s, same ID: %s, %d pending\n",
+         nodeid_equal(last_to, peers[1]) ? "yes" : "no", last_id == id ? "yes" : "no", transPending(t));
+
+  /* After its retransmissions, the transaction is dropped */
+  while (transNextTimeout(t, &tv)) {
+    usleep(tv.tv_sec * 1000000 + tv.tv_usec + 2000);
+    transCheck(t);
+  }
+  printf("%d transmissions, %d expired, %d pending\n", transmissions, expired, transPending(t));
+
+  transDestroy(t);
+}
+
+int main(int argc, char *argv[])
+{
+  struct peerset *ps;
+
+  peers[0] = create_node("10.0.0.1", 6000);
+  peers[1] = create_node("10.0.0.2", 6000);
+  ps = peerset_init("");
+  peerset_add_peer(ps, peers[0]);
+  peerset_add_peer(ps, peers[1]);
+
+  config_test();
+  match_test(ps);
+  timeout_test(ps);
+
+  nodeid_free(peers[0]);
+  nodeid_free(peers[1]);
+
+  return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ *  Copyright (c) 2026 Luca Abeni
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+
+#define POOL_MIN_SHIFT 6		/* smallest class: 64 bytes */
+#define POOL_CLASSES 15			/* largest class: 1MB */
+#define POOL_CLASS_BYTES (4 * 1024 * 1024)	/* cached memory per class */
+#define POOL_CLASS_MIN_BLOCKS 4
+#define INLINE_ATTRIBUTES_MAX 64
+#define CLS_NONE -1			/* allocated with malloc() */
+#define CLS_EXTERNAL -2			/* wrapped by chunk_data_wrap() */
+
+/*
+ * A payload block is a struct chunk_data followed by the payload bytes.
+ * Every payload pointer handed out (the block's data, or a slice of it)
+ * is immediately preceded by a pointer to the owning block. While a block
+ * is cached in the pool, "owner" links the free list.
+ */
+struct chunk_data {
+  int refcnt;
+  int size;
+  int cls;			/* size class, or CLS_NONE / CLS_EXTERNAL */
+  struct chunk_data *owner;
+};
+
+/* A memory area not allocated by us, used as a payload block */
+struct chunk_data_ext {
+  struct chunk_data d;
+  void (*release)(void *opaque);
+  void *opaque;
+};
+
+struct chunk_pool {
+  struct chunk_data *free[POOL_CLASSES];
+  int n_free[POOL_CLASSES];
+  struct chunk_data_stats stats;
+};
+
+static __thread struct chunk_pool pool;
+
+static inline struct chunk_data *chunk_data_owner(const uint8_t *data)
+{
+  struct chunk_data *d;
+
+  memcpy(&d, data - sizeof(d), sizeof(d));
+
+  return d;
+}
+
+static inline int class_size(int cls)
+{
+  return 1 << (cls + POOL_MIN_SHIFT);
+}
+
+static int size_class(int size)
+{
+  int cls;
+
+  for (cls = 0; cls < POOL_CLASSES; cls++) {
+    if (size <= class_size(cls)) {
+      return cls;
+    }
+  }
+
+  return -1;
+}
+
+static inline int class_max_blocks(int cls)
+{
+  int n = POOL_CLASS_BYTES / class_size(cls);
+
+  return n > POOL_CLASS_MIN_BLOCKS ? n : POOL_CLASS_MIN_BLOCKS;
+}
+
+static void block_release(struct chunk_data *d)
+{
+  if (d->cls == CLS_EXTERNAL) {
+    struct chunk_data_ext *ext = (struct chunk_data_ext *)d;
+
+    ext->release(ext->opaque);
+    free(ext);
+  } else if (d->cls >= 0 && pool.n_free[d->cls] < class_max_blocks(d->cls)) {
+    d->owner = pool.free[d->cls];
+    pool.free[d->cls] = d;
+    pool.n_free[d->cls]++;
+    pool.stats.cached_bytes += class_size(d->cls);
+  } else {
+    free(d);
+  }
+}
+
+uint8_t *chunk_data_alloc(int size)
+{
+  struct chunk_data *d;
+  int cls;
+
+  cls = size_class(size);
+  if (cls >= 0 && pool.free[cls]) {
+    d = pool.free[cls];
+    pool.free[cls] = d->owner;
+    pool.n_free[cls]--;
+    pool.stats.cached_bytes -= class_size(cls);
+    pool.stats.hits++;
+  } else {
+    d = malloc(sizeof(struct chunk_data) + (cls >= 0 ? class_size(cls) : size));
+    if (d == NULL) {
+      return NULL;
+    }
+    pool.stats.misses++;
+  }
+  d->refcnt = 1;
+  d->size = size;
+  d->cls = cls;
+  d->owner = d;
+
+  return (uint8_t *)(d + 1);
+}
+
+uint8_t *chunk_data_realloc(uint8_t *data, int size)
+{
+  struct chunk_data *d;
+  uint8_t *res;
+
+  if (data == NULL) {
+    return chunk_data_alloc(size);
+  }
+  d = chunk_data_owner(data);
+  if (d->refcnt != 1 || data != (uint8_t *)(d + 1)) {
+    return NULL;
+  }
+  if (d->cls >= 0 && size <= class_size(d->cls)) {
+    d->size = size;
+
+    return data;
+  }
+  res = chunk_data_alloc(size);
+  if (res == NULL) {
+    return NULL;
+  }
+  memcpy(res, data, d->size < size ? d->size : size);
+  block_release(d);
+
+  return res;
+}
+
+uint8_t *chunk_data_ref(uint8_t *data)
+{
+  if (data) {
+    chunk_data_owner(data)->refcnt++;
+  }
+
+  return data;
+}
+
+void chunk_data_unref(uint8_t *data)
+{
+  struct chunk_data *d;
+
+  if (data == NULL) {
+    return;
+  }
+  d = chunk_data_owner(data);
+  if (--d->refcnt == 0) {
+    block_release(d);
+  }
+}
+
+uint8_t *chunk_data_slice(uint8_t *data, int offset)
+{
+  struct chunk_data *d;
+
+  if (offset < (int)sizeof(d)) {
+    return NULL;
+  }
+  d = chunk_data_owner(data);
+  if (offset > d->size) {
+    return NULL;
+  }
+  memcpy(data + offset - sizeof(d), &d, sizeof(d));
+  d->refcnt++;
+
+  return data + offset;
+}
+
+uint8_t *chunk_data_wrap(uint8_t *mem, int size, void (*release)(void *opaque), void *opaque)
+{
+  struct chunk_data_ext *ext;
+
+  if (size < (int)sizeof(struct chunk_data *)) {
+    return NULL;
+  }
+  ext = malloc(sizeof(struct chunk_data_ext));
+  if (ext == NULL) {
+    return NULL;
+  }
+  ext->d.refcnt = 1;
+  ext->d.size = size - sizeof(struct chunk_data *);
+  ext->d.cls = CLS_EXTERNAL;
+  ext->d.owner = &ext->d;
+  ext->release = release;
+  ext->opaque = opaque;
+  memcpy(mem, &ext->d.owner, sizeof(struct chunk_data *));
+
+  return mem + sizeof(struct chunk_data *);
+}
+
+int chunk_data_size(const uint8_t *data)
+{
+  return chunk_data_owner(data)->size;
+}
+
+int chunk_data_refcount(const uint8_t *data)
+{
+  return chunk_data_owner(data)->refcnt;
+}
+
+void chunk_data_get_stats(struct chunk_data_stats *stats)
+{
+  *stats = pool.stats;
+}
+
+void chunk_data_pool_flush(void)
+{
+  int cls;
+
+  for (cls = 0; cls < POOL_CLASSES; cls++) {
+    while (pool.free[cls]) {
+      struct chunk_data *d = pool.free[cls];
+
+      pool.free[cls] = d->owner;
+      free(d);
+    }
+    pool.n_free[cls] = 0;
+  }
+  pool.stats.cached_bytes = 0;
+}
+
+int chunk_alloc(struct chunk *c, int size, int attributes_size)
+{
+  int inline_attr;
+
+  inline_attr = attributes_size > 0 && attributes_size <= INLINE_ATTRIBUTES_MAX;
+  c->data = chunk_data_alloc(inline_attr ? size + sizeof(void *) + attributes_size : size);
+  if (c->data == NULL) {
+    return -1;
+  }
+  c->size = size;
+  c->attributes_size = attributes_size;
+  if (inline_attr) {
+    c->attributes = chunk_data_slice(c->data, size + sizeof(void *));
+  } else if (attributes_size > 0) {
+    c->attributes = chunk_data_alloc(attributes_size);
+    if (c->attributes == NULL) {
+      chunk_data_unref(c->data);
+      c->data = NULL;
+
+      return -1;
+    }
+  } else {
+    c->attributes = NULL;
+  }
+
+  return 0;
+}
+
+int chunk_adopt(struct chunk *c, uint8_t *block)
+{
+  uint8_t *data = c->data;
+  uint8_t *attributes = c->attributes;
+
+  /* Do not pin a large receive buffer for a small payload */
+  if (block && c->size > 0 && c->size * 2 >= chunk_data_size(block) &&
+      data > block && data + c->size <= block + chunk_data_size(block)) {
+    c->data = chunk_data_slice(block, data - block);
+    if (c->data) {
+      if (c->attributes_size > 0) {
+        c->attributes = chunk_data_alloc(c->attributes_size);
+        if (c->attributes == NULL) {
+          chunk_data_unref(c->data);
+          c->data = data;
+          c->attributes = attributes;
+
+          return -1;
+        }
+        memcpy(c->attributes, attributes, c->attributes_size);
+      } else {
+        c->attributes = NULL;
+      }
+
+      return 0;
+    }
+  }
+
+  if (chunk_alloc(c, c->size, c->attributes_size) < 0) {
+    c->data = data;
+    c->attributes = attributes;
+
+    return -1;
+  }
+  memcpy(c->data, data, c->size);
+  if (c->attributes_size > 0) {
+    memcpy(c->attributes, attributes, c->attributes_size);
+  }
+
+  return 0;
+}
+
+void chunk_release(struct chunk *c)
+{
+  chunk_data_unref(c->data);
+  c->data = NULL;
+  chunk_data_unref(c->attributes);
+  c->attributes = NULL;
+}
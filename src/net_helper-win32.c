@@ -66,6 +66,126 @@ int wait4data(const struct nodeID *s, struct timeval *tout, int *user_fds)
   return 2;
 }
 
+/* The FDs are passed to select() at every call: nothing to forget */
+int wait4data_forget(int fd)
+{
+  return 0;
+}
+
+/*
+ * No persistent registration here: the waitset is a list of FDs, passed
+ * to wait4data()
+ */
+struct nh_waitset {
+  const struct nodeID *node;
+  int *fds;	/* n_fds FDs, and room for the -1 terminator */
+  int *tmp;
+  int n_fds;
+  int size;
+};
+
+struct nh_waitset *waitset_init(const struct nodeID *n)
+{
+  struct nh_waitset *w;
+
+  w = malloc(sizeof(struct nh_waitset));
+  if (w == NULL) {
+    return NULL;
+  }
+  memset(w, 0, sizeof(struct nh_waitset));
+  w->node = n;
+
+  return w;
+}
+
+int waitset_add(struct nh_waitset *w, int fd)
+{
+  int i;
+
+  for (i = 0; i < w->n_fds; i++) {
+    if (w->fds[i] == fd) {
+      return -1;
+    }
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  if (w->n_fds + 1 >= w->size) {
+    int size = w->size ? w->size * 2 : 16;
+    int *fds = realloc(w->fds, size * sizeof(int));
+    int *tmp = realloc(w->tmp, size * sizeof(int));
+
+    if (fds) {
+      w->fds = fds;
+    }
+    if (tmp) {
+      w->tmp = tmp;
+    }
+    if (fds == NULL || tmp == NULL) {
+      return -1;
+    }
+    w->size = size;
+  }
+  w->fds[w->n_fds++] = fd;
+
+  return 0;
+}
+
+int waitset_del(struct nh_waitset *w, int fd)
+{
+  int i;
+
+  for (i = 0; i < w->n_fds; i++) {
+    if (w->fds[i] == fd) {
+      w->fds[i] = w->fds[--w->n_fds];
+
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int waitset_wait(struct nh_waitset *w, struct timeval *tout, int *ready, int max_ready)
+{
+  struct timeval t, *pt = NULL;
+  int i, res;
+
+  for (i = 0; i < w->n_fds; i++) {
+    w->tmp[i] = w->fds[i];
+  }
+  if (w->tmp) {
+    w->tmp[w->n_fds] = -1;
+  }
+  if (tout) {
+    t = *tout;
+    pt = &t;
+  }
+  res = wait4data(w->node, pt, w->tmp);
+  if (res <= 0) {
+    return res;
+  }
+  if (res == 1) {
+    ready[0] = WAITSET_NODE;
+
+    return 1;
+  }
+  for (res = 0, i = 0; i < w->n_fds && res < max_ready; i++) {
+    if (w->tmp[i] != -2) {
+      ready[res++] = w->tmp[i];
+    }
+  }
+
+  return res;
+}
+
+void waitset_free(struct nh_waitset *w)
+{
+  free(w->fds);
+  free(w->tmp);
+  free(w);
+}
+
 struct nodeID *create_node(const char *IPaddr, int port)
 {
   struct nodeID *s;
@@ -142,6 +262,77 @@ int send_to_peer(const struct nodeID *from, struct nodeID *to, const uint8_t *bu
   return res;
 }
 
+/*
+ * The messages are copied anyway: gather the buffers in a single one,
+ * and send it to all the peers
+ */
+int send_to_peers_iov(const struct nodeID *from, struct nodeID **to, int n,
+                      const struct iovec *iov, int iovcnt, int *res)
+{
+  uint8_t *buff;
+  int i, len = 0, sent = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  buff = malloc(len > 0 ? len : 1);
+  if (buff == NULL) {
+    return -1;
+  }
+  for (len = 0, i = 0; i < iovcnt; i++) {
+    memcpy(buff + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  for (i = 0; i < n; i++) {
+    int r = send_to_peer(from, to[i], buff, len);
+
+    if (res) {
+      res[i] = r;
+    }
+    sent += r >= 0;
+  }
+  free(buff);
+
+  return sent;
+}
+
+/* The buffers are copied: sharing them makes no difference */
+int send_to_peers_iov_shared(const struct nodeID *from, struct nodeID **to, int n,
+                             const struct iovec *iov, int iovcnt, unsigned int shared, int *res)
+{
+  return send_to_peers_iov(from, to, n, iov, iovcnt, res);
+}
+
+int send_to_peer_iov(const struct nodeID *from, struct nodeID *to, const struct iovec *iov, int iovcnt)
+{
+  int res;
+
+  if (send_to_peers_iov(from, &to, 1, iov, iovcnt, &res) < 0) {
+    return -1;
+  }
+
+  return res;
+}
+
+/*
+ * No batching: send the messages one by one
+ */
+int send_to_peers(const struct nodeID *from, const struct nh_send_msg *msgs, int n, int *res)
+{
+  int i, sent = 0;
+
+  for (i = 0; i < n; i++) {
+    int r = send_to_peer(from, msgs[i].peer, msgs[i].buff, msgs[i].len);
+
+    if (res) {
+      res[i] = r;
+    }
+    sent += r >= 0;
+  }
+
+  return sent;
+}
+
 int recv_from_peer(const struct nodeID *local, struct nodeID **remote, uint8_t *buffer_ptr, int buffer_size)
 {
   int res, recv, len, addrlen;
@@ -172,6 +363,29 @@ int recv_from_peer(const struct nodeID *local, struct nodeID **remote, uint8_t *
   return recv;
 }
 
+/*
+ * No batching: receive one message
+ */
+int recv_from_peers(const struct nodeID *local, struct nh_msg *msgs, int n)
+{
+  if (n <= 0) {
+    return 0;
+  }
+  msgs[0].len = recv_from_peer(local, &msgs[0].peer, msgs[0].buff, msgs[0].size);
+
+  return msgs[0].len < 0 ? -1 : 1;
+}
+
+void reasm_stats(struct nh_reasm_stats *stats)
+{
+  memset(stats, 0, sizeof(struct nh_reasm_stats));
+}
+
+void send_queue_stats(struct nh_queue_stats *stats)
+{
+  memset(stats, 0, sizeof(struct nh_queue_stats));
+}
+
 const char *node_addr(const struct nodeID *s)
 {
   static char addr[256];
@@ -5,11 +5,18 @@
  *  This is free software; see lgpl-2.1.txt
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* for sendmmsg() and recvmmsg() */
+#endif
 #include <sys/types.h>
 #ifndef _WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -20,16 +27,96 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 #include "net_helper.h"
-
-#define MAX_MSG_SIZE 1024 * 60
+#include "grapes_msg_types.h"
+#include "chunk.h"
+#include "config.h"
+
+#define MAX_MSG_SIZE (1024 * 60)
+#define SEND_BATCH 32
+#define RECV_BATCH 32
+#define NODE_POOL_SIZE 256
+#define NODE_TABLE_SIZE 1024	/* a power of 2 */
+#define REASM_SLOTS 64
+#define CACHE_SLOTS 64
+#define QUEUE_TABLE_SIZE 256	/* a power of 2 */
+#define QUEUE_POOL_SIZE 64
+#define ITEM_POOL_SIZE 1024
+#define NACK_MAX 512
+#define NACK_RETRIES 3
+#define IP_UDP_HDR_SIZE 28
 
 struct nodeID {
   struct sockaddr_in addr;
   int fd;
+  int refs;
+  uint32_t hash;
+  struct nodeID *next;	/* in the same bucket of the intern table */
 };
 
+struct my_hdr_t {
+  uint8_t m_seq;
+  uint8_t frag_seq;
+  uint8_t frags;
+} __attribute__((packed));
+
+/*
+ * In MTU mode, the fragments of a message larger than a datagram have an
+ * extended header: a my_hdr_t with frag_seq 0 (never used otherwise)
+ * whose m_seq is the type of datagram, followed by 16 bit fields in
+ * network byte order. A NACK lists (in frags) the indexes of the missing
+ * fragments of message msg, as 16 bit integers after the header.
+ */
+#define FRAG_DATA 1
+#define FRAG_NACK 2
+
+struct ext_hdr_t {
+  struct my_hdr_t h;
+  uint16_t msg;
+  uint16_t frag_seq;	/* from 0 to frags - 1 */
+  uint16_t frags;
+  uint16_t frag_size;
+} __attribute__((packed));
+
+#define EXT_HDR_EXTRA (sizeof(struct ext_hdr_t) - sizeof(struct my_hdr_t))
+
+
+/*
+ * Each address is represented by a single nodeID, shared by reference
+ * counting: so, nodeid_dup() and receiving a message from a known peer
+ * do not allocate memory, and two nodeIDs are equal only if they are
+ * the same pointer. The table (and the pool of freed nodeIDs, recycled
+ * to avoid a malloc() per received message) is protected by a spinlock,
+ * because some applications receive in a thread and send in another.
+ */
+static struct nodeID *node_table[NODE_TABLE_SIZE];
+static struct nodeID *node_pool[NODE_POOL_SIZE];
+static int node_pool_len;
+static char node_lock;
+
+static int reasm_memory = 4096;	/* KB */
+static int reasm_timeout = 1000;	/* ms */
+
+/* MTU mode: if mtu is not 0, messages are sent in fragments of frag_size bytes */
+static int mtu;
+static int frag_size = MAX_MSG_SIZE;
+static int send_cache_memory = 4096;	/* KB */
+static int send_cache_time = 500;	/* ms */
+static int nack_delay = 20;	/* ms */
+
+static struct nh_reasm_stats frag_counters;
+
+/* Upload queues: used only if upload (kbit/s) is not 0 */
+static int upload;
+static int burst = 16;	/* KB */
+static int chunk_deadline = 300;	/* ms */
+static int send_queue_memory = 1024;	/* KB per destination */
+
+static struct nh_queue_stats queue_counters;
+
 #ifdef _WIN32
 static int inet_aton(const char *cp, struct in_addr *addr)
 {
@@ -143,88 +230,461 @@ ssize_t sendmsg (int sd, struct msghdr * msg, int flags)
 
 #endif
 
-int wait4data(const struct nodeID *s, struct timeval *tout, int *user_fds)
+#ifndef __linux__
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+static uint64_t now_ms(void);
+static int timers_timeout(int fd, uint64_t now);
+static void timers_run(int fd, uint64_t now);
+
+static void node_lock_take(void)
+{
+  while (__atomic_test_and_set(&node_lock, __ATOMIC_ACQUIRE));
+}
+
+static void node_lock_release(void)
+{
+  __atomic_clear(&node_lock, __ATOMIC_RELEASE);
+}
+
+static uint32_t node_hash(const struct sockaddr_in *addr)
+{
+  uint32_t h = ntohl(addr->sin_addr.s_addr) * 2654435761U ^ ntohs(addr->sin_port) * 40503U;
+
+  return h ^ (h >> 16);
+}
+
+/* Get the nodeID of an address, with a new reference */
+static struct nodeID *node_intern(const struct sockaddr_in *addr)
+{
+  uint32_t hash = node_hash(addr);
+  struct nodeID **bucket = &node_table[hash & (NODE_TABLE_SIZE - 1)];
+  struct nodeID *s;
+
+  node_lock_take();
+  for (s = *bucket; s; s = s->next) {
+    if (s->hash == hash && !memcmp(&s->addr, addr, sizeof(struct sockaddr_in))) {
+      s->refs++;
+      node_lock_release();
+
+      return s;
+    }
+  }
+  s = node_pool_len > 0 ? node_pool[--node_pool_len] : malloc(sizeof(struct nodeID));
+  if (s) {
+    s->addr = *addr;
+    s->fd = -1;
+    s->refs = 1;
+    s->hash = hash;
+    s->next = *bucket;
+    *bucket = s;
+  }
+  node_lock_release();
+
+  return s;
+}
+
+struct waitset_entry {
+  int fd;
+  unsigned int gen;
+  int hup;			/* hung up: the FD is likely to be closed */
+};
+
+struct nh_waitset {
+  int node_fd;
+#ifdef __linux__
+  int epfd;
+#endif
+  struct waitset_entry *fds;	/* the registered FDs */
+  int n_fds;
+  int size;
+  int *pos;			/* pos[fd] is the index of fd in fds, or -1 */
+  int pos_size;
+  unsigned int gen;		/* used by wait4data() */
+};
+
+struct nh_waitset *waitset_init(const struct nodeID *n)
+{
+  struct nh_waitset *w;
+
+  w = malloc(sizeof(struct nh_waitset));
+  if (w == NULL) {
+    return NULL;
+  }
+  memset(w, 0, sizeof(struct nh_waitset));
+  w->node_fd = n ? n->fd : -1;
+#ifdef __linux__
+  w->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (w->epfd < 0) {
+    free(w);
+
+    return NULL;
+  }
+  if (w->node_fd >= 0) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = w->node_fd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->node_fd, &ev) < 0) {
+      close(w->epfd);
+      free(w);
+
+      return NULL;
+    }
+  }
+#endif
+
+  return w;
+}
+
+static int waitset_find(const struct nh_waitset *w, int fd)
+{
+  return fd >= 0 && fd < w->pos_size ? w->pos[fd] : -1;
+}
+
+int waitset_add(struct nh_waitset *w, int fd)
+{
+  if (fd < 0 || fd == w->node_fd || waitset_find(w, fd) >= 0) {
+    return -1;
+  }
+  if (fd >= w->pos_size) {
+    int i, size = fd + 16;
+    int *pos = realloc(w->pos, size * sizeof(int));
+
+    if (pos == NULL) {
+      return -1;
+    }
+    for (i = w->pos_size; i < size; i++) {
+      pos[i] = -1;
+    }
+    w->pos = pos;
+    w->pos_size = size;
+  }
+  if (w->n_fds == w->size) {
+    int size = w->size ? w->size * 2 : 16;
+    struct waitset_entry *fds = realloc(w->fds, size * sizeof(struct waitset_entry));
+
+    if (fds == NULL) {
+      return -1;
+    }
+    w->fds = fds;
+    w->size = size;
+  }
+#ifdef __linux__
+  {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      return -1;
+    }
+  }
+#else
+  if (fd >= FD_SETSIZE) {
+    return -1;
+  }
+#endif
+  w->fds[w->n_fds].fd = fd;
+  w->fds[w->n_fds].gen = w->gen;
+  w->fds[w->n_fds].hup = 0;
+  w->pos[fd] = w->n_fds++;
+
+  return 0;
+}
+
+int waitset_del(struct nh_waitset *w, int fd)
 {
+  int i = waitset_find(w, fd);
+
+  if (i < 0) {
+    return -1;
+  }
+#ifdef __linux__
+  /* Fails if fd has already been closed: nothing to do in this case */
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+  w->pos[fd] = -1;
+  if (i != --w->n_fds) {
+    w->fds[i] = w->fds[w->n_fds];
+    w->pos[w->fds[i].fd] = i;
+  }
+
+  return 0;
+}
+
+#ifdef __linux__
+#define WAITSET_EVENTS 64
+
+/* Wait for at most timeout ms (forever if timeout < 0) */
+static int waitset_poll(struct nh_waitset *w, int timeout, int *ready, int max_ready)
+{
+  struct epoll_event ev[WAITSET_EVENTS];
+  int i, res;
+
+  if (max_ready > WAITSET_EVENTS) {
+    max_ready = WAITSET_EVENTS;
+  }
+  res = epoll_wait(w->epfd, ev, max_ready, timeout);
+  for (i = 0; i < res; i++) {
+    if (ev[i].data.fd == w->node_fd) {
+      ready[i] = WAITSET_NODE;
+      continue;
+    }
+    ready[i] = ev[i].data.fd;
+    if (ev[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+      w->fds[w->pos[ev[i].data.fd]].hup = 1;
+    }
+  }
+
+  return res;
+}
+#else
+static int waitset_poll(struct nh_waitset *w, int timeout, int *ready, int max_ready)
+{
+  struct timeval t;
   fd_set fds;
-  int i, res, max_fd;
+  int i, res, max_fd = w->node_fd;
 
   FD_ZERO(&fds);
-  if (s) {
-    max_fd = s->fd;
-    FD_SET(s->fd, &fds);
-  } else {
-    max_fd = -1;
+  if (w->node_fd >= 0) {
+    FD_SET(w->node_fd, &fds);
   }
-  if (user_fds) {
-    for (i = 0; user_fds[i] != -1; i++) {
-      FD_SET(user_fds[i], &fds);
-      if (user_fds[i] > max_fd) {
-        max_fd = user_fds[i];
-      }
+  for (i = 0; i < w->n_fds; i++) {
+    FD_SET(w->fds[i].fd, &fds);
+    if (w->fds[i].fd > max_fd) {
+      max_fd = w->fds[i].fd;
     }
   }
-  res = select(max_fd + 1, &fds, NULL, NULL, tout);
+  t.tv_sec = timeout / 1000;
+  t.tv_usec = (timeout % 1000) * 1000;
+  res = select(max_fd + 1, &fds, NULL, NULL, timeout < 0 ? NULL : &t);
   if (res <= 0) {
     return res;
   }
-  if (s && FD_ISSET(s->fd, &fds)) {
-    return 1;
+  res = 0;
+  if (w->node_fd >= 0 && FD_ISSET(w->node_fd, &fds) && res < max_ready) {
+    ready[res++] = WAITSET_NODE;
+  }
+  for (i = 0; i < w->n_fds && res < max_ready; i++) {
+    if (FD_ISSET(w->fds[i].fd, &fds)) {
+      ready[res++] = w->fds[i].fd;
+    }
+  }
+
+  return res;
+}
+#endif
+
+/*
+ * While waiting, the NACKs for the incomplete messages and the queued
+ * datagrams are sent when they are due
+ */
+int waitset_wait(struct nh_waitset *w, struct timeval *tout, int *ready, int max_ready)
+{
+  uint64_t now = now_ms(), end = 0;
+
+  if (tout) {
+    end = now + tout->tv_sec * 1000 + (tout->tv_usec + 999) / 1000;
+  }
+  for (;;) {
+    int res, timeout = tout ? (end > now ? end - now : 0) : -1;
+    int timer = timers_timeout(w->node_fd, now);
+
+    if (timer >= 0 && (timeout < 0 || timer <= timeout)) {
+      timeout = timer;
+    } else {
+      timer = -1;
+    }
+    res = waitset_poll(w, timeout, ready, max_ready);
+    if (res != 0 || timer < 0) {
+      return res;
+    }
+    now = now_ms();
+    timers_run(w->node_fd, now);
+  }
+}
+
+void waitset_free(struct nh_waitset *w)
+{
+#ifdef __linux__
+  close(w->epfd);
+#endif
+  free(w->fds);
+  free(w->pos);
+  free(w);
+}
+
+/*
+ * Keep a waitset with the FDs of the last call, so that only the changes
+ * in user_fds need to be registered. An FD already in the set is not
+ * registered again: if the caller closes it and gets the same number for
+ * a new file, epoll does not watch the new file. So, the FDs which hung up
+ * (and are likely to be closed) are removed after being reported, and the
+ * caller can remove the other ones with wait4data_forget().
+ */
+static struct nh_waitset *w4d;
+
+int wait4data_forget(int fd)
+{
+  return w4d ? waitset_del(w4d, fd) : -1;
+}
+
+int wait4data(const struct nodeID *s, struct timeval *tout, int *user_fds)
+{
+  static const struct nodeID *w_node;
+  static int *ready;
+  static int ready_size;
+  struct nh_waitset *w = w4d;
+  int i, res, node_ready = 0;
+
+  if (w == NULL || s != w_node) {
+    if (w) {
+      waitset_free(w);
+    }
+    w = w4d = waitset_init(s);
+    w_node = s;
+    if (w == NULL) {
+      return -1;
+    }
+  }
+
+  /* Register the new FDs, and remove the ones not in user_fds anymore */
+  if (++w->gen == 0) {
+    /* 0 marks the ready FDs */
+    w->gen = 1;
+  }
+  for (i = 0; user_fds && user_fds[i] != -1; i++) {
+    int p;
+
+    if (user_fds[i] < 0) {
+      continue;
+    }
+    p = waitset_find(w, user_fds[i]);
+    if (p < 0) {
+      if (waitset_add(w, user_fds[i]) < 0) {
+        return -1;
+      }
+      p = w->n_fds - 1;
+    }
+    w->fds[p].gen = w->gen;
+  }
+  for (i = w->n_fds - 1; i >= 0; i--) {
+    if (w->fds[i].gen != w->gen) {
+      waitset_del(w, w->fds[i].fd);
+    }
   }
 
-  /* If execution arrives here, user_fds cannot be 0
-     (an FD is ready, and it's not s->fd) */
-  for (i = 0; user_fds[i] != -1; i++) {
-    if (!FD_ISSET(user_fds[i], &fds)) {
-      user_fds[i] = -2;
+  if (ready_size < w->n_fds + 1) {
+    int *r = realloc(ready, (w->n_fds + 1) * sizeof(int));
+
+    if (r == NULL) {
+      return -1;
+    }
+    ready = r;
+    ready_size = w->n_fds + 1;
+  }
+  res = waitset_wait(w, tout, ready, ready_size);
+  if (res <= 0) {
+    return res;
+  }
+  for (i = 0; i < res; i++) {
+    if (ready[i] == WAITSET_NODE) {
+      node_ready = 1;
+    } else {
+      w->fds[w->pos[ready[i]]].gen = 0;
+    }
+  }
+  if (!node_ready) {
+    /* If execution arrives here, user_fds cannot be 0
+       (an FD is ready, and it's not s->fd) */
+    for (i = 0; user_fds[i] != -1; i++) {
+      if (user_fds[i] >= 0 && w->fds[w->pos[user_fds[i]]].gen != 0) {
+        user_fds[i] = -2;
+      }
+    }
+  }
+  for (i = w->n_fds - 1; i >= 0; i--) {
+    if (w->fds[i].hup) {
+      waitset_del(w, w->fds[i].fd);
     }
   }
 
-  return 2;
+  return node_ready ? 1 : 2;
 }
 
 struct nodeID *create_node(const char *IPaddr, int port)
 {
-  struct nodeID *s;
+  struct sockaddr_in addr;
   int res;
 
-  s = malloc(sizeof(struct nodeID));
-  memset(s, 0, sizeof(struct nodeID));
-  s->addr.sin_family = AF_INET;
-  s->addr.sin_port = htons(port);
-  res = inet_aton(IPaddr, &s->addr.sin_addr);
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  res = inet_aton(IPaddr, &addr.sin_addr);
   if (res == 0) {
-    free(s);
-
     return NULL;
   }
 
-  s->fd = -1;
-
-  return s;
+  return node_intern(&addr);
 }
 
 struct nodeID *net_helper_init(const char *my_addr, int port, const char *config)
 {
   int res;
   struct nodeID *myself;
+  struct tag *cfg_tags;
 
   myself = create_node(my_addr, port);
   if (myself == NULL) {
     fprintf(stderr, "Error creating my socket (%s:%d)!\n", my_addr, port);
+
+    return NULL;
   }
   myself->fd =  socket(AF_INET, SOCK_DGRAM, 0);
   if (myself->fd < 0) {
-    free(myself);
+    nodeid_free(myself);
     
     return NULL;
   }
   fprintf(stderr, "My sock: %d\n", myself->fd);
 
+  cfg_tags = config_parse(config);
+  if (cfg_tags) {
+    config_value_int_default(cfg_tags, "reasm_memory", &reasm_memory, 4096);
+    config_value_int_default(cfg_tags, "reasm_timeout", &reasm_timeout, 1000);
+    config_value_int_default(cfg_tags, "mtu", &mtu, 0);
+    config_value_int_default(cfg_tags, "send_cache", &send_cache_memory, 4096);
+    config_value_int_default(cfg_tags, "send_cache_time", &send_cache_time, 500);
+    config_value_int_default(cfg_tags, "nack_delay", &nack_delay, 20);
+    config_value_int_default(cfg_tags, "upload", &upload, 0);
+    config_value_int_default(cfg_tags, "burst", &burst, 16);
+    config_value_int_default(cfg_tags, "chunk_deadline", &chunk_deadline, 300);
+    config_value_int_default(cfg_tags, "send_queue", &send_queue_memory, 1024);
+    free(cfg_tags);
+  }
+  frag_size = MAX_MSG_SIZE;
+  if (mtu) {
+    if (mtu < 128 || mtu - IP_UDP_HDR_SIZE > MAX_MSG_SIZE) {
+      fprintf(stderr, "net-helper: invalid MTU %d\n", mtu);
+      mtu = 0;
+    } else {
+      frag_size = mtu - IP_UDP_HDR_SIZE - sizeof(struct ext_hdr_t);
+    }
+  }
+
   res = bind(myself->fd, (struct sockaddr *)&myself->addr, sizeof(struct sockaddr_in));
   if (res < 0) {
     /* bind failed: not a local address... Just close the socket! */
     close(myself->fd);
-    free(myself);
+    myself->fd = -1;
+    nodeid_free(myself);
 
     return NULL;
   }
@@ -238,139 +698,1441 @@ void bind_msg_type (uint8_t msgtype)
 
 void reg_message_send(int size, uint8_t type);
 
-struct my_hdr_t {
-  uint8_t m_seq;
-  uint8_t frag_seq;
-  uint8_t frags;
-} __attribute__((packed));
+static uint16_t m_seq;
 
-int send_to_peer(const struct nodeID *from, struct nodeID *to, const uint8_t *buffer_ptr, int buffer_size)
+/* The data of a message, for an iovec (sendmsg() does not write to it) */
+static void *iov_data(const uint8_t *p)
 {
-  static struct msghdr msg;
-  static struct my_hdr_t my_hdr;
-  struct iovec iov[2];
-  int res;
-
-  if (buffer_size <= 0) return;
-  reg_message_send(buffer_size, buffer_ptr[0]);
-
-  iov[0].iov_base = &my_hdr;
-  iov[0].iov_len = sizeof(struct my_hdr_t);
-  msg.msg_name = &to->addr;
-  msg.msg_namelen = sizeof(struct sockaddr_in);
-  msg.msg_iovlen = 2;
-  msg.msg_iov = iov;
-
-  my_hdr.m_seq++;
-  my_hdr.frags = (buffer_size / (MAX_MSG_SIZE)) + 1;
-  my_hdr.frag_seq = 0;
-
-  do {
-    iov[1].iov_base = buffer_ptr;
-    if (buffer_size > MAX_MSG_SIZE) {
-      iov[1].iov_len = MAX_MSG_SIZE;
-    } else {
-      iov[1].iov_len = buffer_size;
-    }
-    my_hdr.frag_seq++;
-
-    buffer_size -= iov[1].iov_len;
-    buffer_ptr += iov[1].iov_len;
-    res = sendmsg(from->fd, &msg, 0);
+  return (void *)(uintptr_t)p;
+}
 
-    if (res  < 0){
-      int error = errno;
-      fprintf(stderr,"net-helper: sendmsg failed errno %d: %s\n", error, strerror(error));
-    }
-  } while (buffer_size > 0);
+/* Build the header of the i-th fragment of a message; returns its size */
+static int frag_header(struct ext_hdr_t *h, uint16_t seq, int i, int frags)
+{
+  if (mtu == 0 || frags == 1) {
+    h->h.m_seq = seq;
+    h->h.frag_seq = i + 1;
+    h->h.frags = frags;
 
-  return res;
+    return sizeof(struct my_hdr_t);
+  }
+  h->h.m_seq = FRAG_DATA;
+  h->h.frag_seq = 0;
+  h->h.frags = 0;
+  h->msg = htons(seq);
+  h->frag_seq = htons(i);
+  h->frags = htons(frags);
+  h->frag_size = htons(frag_size);
+
+  return sizeof(struct ext_hdr_t);
 }
 
-void reg_message_recv(int size, uint8_t type);
-
-int recv_from_peer(const struct nodeID *local, struct nodeID **remote, uint8_t *buffer_ptr, int buffer_size)
-{
-  int res, recv, m_seq, frag_seq;
-  struct sockaddr_in raddr;
-  static struct msghdr msg;
-  static struct my_hdr_t my_hdr;
-  struct iovec iov[2];
-  uint8_t *buffer_ptr_orig = buffer_ptr;
+/*
+ * A message kept after being sent (for retransmissions) or until it is
+ * sent (in the upload queues): the buffers flagged as shared are
+ * reference counted chunk payloads, which are referenced instead of
+ * being copied; the others are copied in copy[]. The send cache and the
+ * queues share the same kept_msg, counting their references in refs.
+ */
+struct kept_piece {
+  const uint8_t *base;
+  int len;
+  uint8_t *ref;		/* the payload to release, or NULL if base is in copy[] */
+};
 
-  iov[0].iov_base = &my_hdr;
-  iov[0].iov_len = sizeof(struct my_hdr_t);
-  msg.msg_name = &raddr;
-  msg.msg_namelen = sizeof(struct sockaddr_in);
-  msg.msg_iovlen = 2;
-  msg.msg_iov = iov;
+struct kept_msg {
+  int len;
+  int refs;
+  int n_pieces;
+  struct kept_piece piece[NH_IOV_MAX];
+  uint8_t copy[];
+};
 
-  *remote = malloc(sizeof(struct nodeID));
-  if (*remote == NULL) {
-    return -1;
-  }
+static struct kept_msg *msg_keep(const struct iovec *iov, int iovcnt, unsigned int shared)
+{
+  struct kept_msg *m;
+  int i, copied = 0;
 
-  recv = 0;
-  m_seq = -1;
-  frag_seq = 0;
-  do {
-    iov[1].iov_base = buffer_ptr;
-    if (buffer_size > MAX_MSG_SIZE) {
-      iov[1].iov_len = MAX_MSG_SIZE;
-    } else {
-      iov[1].iov_len = buffer_size;
+  for (i = 0; i < iovcnt; i++) {
+    if (!(shared & (1U << i))) {
+      copied += iov[i].iov_len;
     }
-    buffer_size -= iov[1].iov_len;
-    buffer_ptr += iov[1].iov_len;
-    res = recvmsg(local->fd, &msg, 0);
-    recv += (res - sizeof(struct my_hdr_t));
-    if (m_seq != -1 && my_hdr.m_seq != m_seq) {
-      return -1;
-    } else {
-      m_seq = my_hdr.m_seq;
+  }
+  m = malloc(sizeof(struct kept_msg) + copied);
+  if (m == NULL) {
+    return NULL;
+  }
+  m->len = 0;
+  m->refs = 1;
+  m->n_pieces = 0;
+  for (copied = 0, i = 0; i < iovcnt; i++) {
+    struct kept_piece *p = &m->piece[m->n_pieces];
+
+    if (iov[i].iov_len == 0) {
+      continue;
     }
-    if (my_hdr.frag_seq != frag_seq + 1) {
-      return -1;
+    if (shared & (1U << i)) {
+      p->base = iov[i].iov_base;
+      p->ref = chunk_data_ref(iov[i].iov_base);
+      p->len = iov[i].iov_len;
+      m->n_pieces++;
+    } else if (m->n_pieces && p[-1].ref == NULL) {
+      /* Contiguous to the previous copy */
+      memcpy(m->copy + copied, iov[i].iov_base, iov[i].iov_len);
+      p[-1].len += iov[i].iov_len;
+      copied += iov[i].iov_len;
     } else {
-     frag_seq++;
+      memcpy(m->copy + copied, iov[i].iov_base, iov[i].iov_len);
+      p->base = m->copy + copied;
+      p->ref = NULL;
+      p->len = iov[i].iov_len;
+      copied += iov[i].iov_len;
+      m->n_pieces++;
     }
-  } while ((my_hdr.frag_seq < my_hdr.frags) && (buffer_size > 0));
-  memcpy(&(*remote)->addr, &raddr, msg.msg_namelen);
-  (*remote)->fd = -1;
-
-  reg_message_recv(recv, buffer_ptr_orig[0]);
+    m->len += iov[i].iov_len;
+  }
 
-  return recv;
+  return m;
 }
 
-const char *node_addr(const struct nodeID *s)
+static void msg_release(struct kept_msg *m)
 {
-  static char addr[256];
-
-  sprintf(addr, "%s:%d", inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port));
+  int i;
 
-  return addr;
+  if (--m->refs > 0) {
+    return;
+  }
+  for (i = 0; i < m->n_pieces; i++) {
+    chunk_data_unref(m->piece[i].ref);
+  }
+  free(m);
 }
 
-struct nodeID *nodeid_dup(struct nodeID *s)
+/* Describe len bytes of m, starting from off, in iov; returns the number of buffers */
+static int msg_iov(const struct kept_msg *m, int off, int len, struct iovec *iov)
 {
-  struct nodeID *res;
+  int i, n = 0;
 
-  res = malloc(sizeof(struct nodeID));
-  if (res != NULL) {
-    memcpy(res, s, sizeof(struct nodeID));
+  for (i = 0; i < m->n_pieces && len > 0; i++) {
+    int l = m->piece[i].len - off;
+
+    if (l <= 0) {
+      off -= m->piece[i].len;
+      continue;
+    }
+    if (l > len) {
+      l = len;
+    }
+    iov[n].iov_base = iov_data(m->piece[i].base + off);
+    iov[n].iov_len = l;
+    n++;
+    len -= l;
+    off = 0;
   }
 
-  return res;
+  return n;
 }
 
-int nodeid_equal(const struct nodeID *s1, const struct nodeID *s2)
-{
-  return (memcmp(&s1->addr, &s2->addr, sizeof(struct sockaddr_in)) == 0);
+/*
+ * In MTU mode, the messages sent in more fragments are kept for
+ * send_cache_time ms, to retransmit the fragments NACKed by the receivers
+ * (at most one NACK per receiver is served every nack_delay ms)
+ */
+struct cache_dest {
+  struct sockaddr_in addr;
+  uint64_t nacked;	/* when the last NACK of this receiver was served */
+};
+
+struct cache_entry {
+  uint16_t msg;
+  int frags;
+  struct kept_msg *m;	/* the message, or NULL if the entry is free */
+  struct cache_dest *to;
+  int n_to;
+  uint64_t time;
+};
+
+static struct cache_entry send_cache[CACHE_SLOTS];
+static int cache_next;
+static size_t cache_allocated;
+
+static void cache_free(struct cache_entry *e)
+{
+  cache_allocated -= e->m->len;
+  msg_release(e->m);
+  free(e->to);
+  e->m = NULL;
+}
+
+/* Keep m (with a new reference) for the n destinations */
+static void cache_add(uint16_t seq, int frags, struct kept_msg *m, struct nodeID **to, int n)
+{
+  struct cache_entry *e;
+  int i, len = m->len;
+
+  if (len > send_cache_memory * 1024) {
+    return;
+  }
+  /* The entries are used in order, so the oldest one is the next */
+  for (i = cache_next; send_cache[i].m &&
+       (send_cache[i].time + send_cache_time < now_ms() ||
+        cache_allocated + len > (size_t)send_cache_memory * 1024 || i == cache_next);
+       i = (i + 1) % CACHE_SLOTS) {
+    cache_free(&send_cache[i]);
+  }
+  e = &send_cache[cache_next];
+  e->to = malloc(n * sizeof(struct cache_dest));
+  if (e->to == NULL) {
+    return;
+  }
+  e->m = m;
+  m->refs++;
+  for (i = 0; i < n; i++) {
+    e->to[i].addr = to[i]->addr;
+    e->to[i].nacked = 0;
+  }
+  e->msg = seq;
+  e->frags = frags;
+  e->n_to = n;
+  e->time = now_ms();
+  cache_allocated += len;
+  cache_next = (cache_next + 1) % CACHE_SLOTS;
+}
+
+/*
+ * Send n datagrams (at most SEND_BATCH), with one sendmmsg() where
+ * available. Datagram i belongs to message owner[i]: the messages some
+ * datagram could not be sent for are marked with -1 in res.
+ */
+static void send_datagrams(int fd, struct mmsghdr *dgrams, const int *owner, int n, int *res)
+{
+  int i, r;
+
+  for (i = 0; i < n; i += r) {
+#ifdef __linux__
+    r = sendmmsg(fd, dgrams + i, n - i, 0);
+#else
+    r = sendmsg(fd, &dgrams[i].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+    if (r <= 0) {
+      /* dgrams[i] failed: go on with the next one */
+      int error = errno;
+      fprintf(stderr,"net-helper: sendmmsg failed errno %d: %s\n", error, strerror(error));
+      res[owner[i]] = -1;
+      r = 1;
+    }
+  }
+}
+
+/*
+ * With an upload limit, the messages are queued per destination, and
+ * their datagrams are sent when a token bucket (filled at upload kbit/s,
+ * up to burst KB) allows it, taking one datagram from each destination
+ * in turn: so, the messages to different peers are interleaved instead
+ * of being sent in bursts. Signalling messages go before the bulk ones
+ * (chunks), which are dropped if they wait more than chunk_deadline ms.
+ */
+struct out_item {
+  struct kept_msg *m;
+  uint16_t seq;
+  int frags;
+  int frag;		/* next fragment to send */
+  uint64_t deadline;	/* 0 for signalling messages */
+  struct out_item *next;
+};
+
+#define QUEUE_SIGNALLING 0
+#define QUEUE_BULK 1
+
+struct out_queue {
+  struct sockaddr_in to;
+  struct out_item *head[2], *tail[2];
+  int bytes;
+  int pos;		/* in queues[] */
+  uint32_t hash;
+  struct out_queue *next;	/* in the same bucket of queue_table */
+};
+
+/* The queues with something to send, indexed by destination in queue_table */
+static struct out_queue **queues;
+static int n_queues, queues_size;
+static struct out_queue *queue_table[QUEUE_TABLE_SIZE];
+static struct out_queue *queue_pool[QUEUE_POOL_SIZE];
+static int queue_pool_len;
+static struct out_item *item_pool[ITEM_POOL_SIZE];
+static int item_pool_len;
+static int queue_fd = -1;
+static int queue_rr[2];		/* the next queue to serve, for each class */
+static double tokens;		/* bytes */
+static uint64_t tokens_time;
+static int tokens_needed;	/* size of the datagram waiting for tokens, or 0 */
+
+static int msg_bulk(uint8_t type)
+{
+  return type == MSG_TYPE_CHUNK || type == MSG_TYPE_FEC;
+}
+
+static struct out_queue *queue_find(const struct sockaddr_in *to, uint32_t hash)
+{
+  struct out_queue *q;
+
+  for (q = queue_table[hash & (QUEUE_TABLE_SIZE - 1)]; q; q = q->next) {
+    if (q->hash == hash && !memcmp(&q->to, to, sizeof(struct sockaddr_in))) {
+      return q;
+    }
+  }
+
+  return NULL;
+}
+
+/* Get the queue of a destination, creating it if needed */
+static struct out_queue *queue_lookup(const struct sockaddr_in *to)
+{
+  uint32_t hash = node_hash(to);
+  struct out_queue **bucket = &queue_table[hash & (QUEUE_TABLE_SIZE - 1)];
+  struct out_queue *q = queue_find(to, hash);
+
+  if (q) {
+    return q;
+  }
+  if (n_queues == queues_size) {
+    struct out_queue **p = realloc(queues, (queues_size + 16) * sizeof(struct out_queue *));
+
+    if (p == NULL) {
+      return NULL;
+    }
+    queues = p;
+    queues_size += 16;
+  }
+  q = queue_pool_len > 0 ? queue_pool[--queue_pool_len] : malloc(sizeof(struct out_queue));
+  if (q == NULL) {
+    return NULL;
+  }
+  memset(q, 0, sizeof(struct out_queue));
+  q->to = *to;
+  q->hash = hash;
+  q->pos = n_queues;
+  q->next = *bucket;
+  *bucket = q;
+  queues[n_queues++] = q;
+
+  return q;
+}
+
+/* Forget an empty queue */
+static void queue_remove(struct out_queue *q)
+{
+  struct out_queue **p;
+
+  for (p = &queue_table[q->hash & (QUEUE_TABLE_SIZE - 1)]; *p != q; p = &(*p)->next);
+  *p = q->next;
+  queues[q->pos] = queues[--n_queues];
+  queues[q->pos]->pos = q->pos;
+  if (queue_pool_len < QUEUE_POOL_SIZE) {
+    queue_pool[queue_pool_len++] = q;
+  } else {
+    free(q);
+  }
+}
+
+/*
+ * Queue a message for n peers, with a new reference to m for each of
+ * them; res is set as in send_to_peers_iov(). m can be NULL, if it could
+ * not be kept. Returns the number of peers the message has been queued for.
+ */
+static int queue_add(int fd, struct kept_msg *m, uint16_t seq, int frags,
+                     struct nodeID **to, int n, int *res)
+{
+  uint64_t now = now_ms();
+  int i, bulk, queued = 0;
+
+  if (m == NULL) {
+    for (i = 0; res && i < n; i++) {
+      res[i] = -1;
+    }
+
+    return 0;
+  }
+  bulk = msg_bulk(m->piece[0].base[0]) ? QUEUE_BULK : QUEUE_SIGNALLING;
+
+  for (i = 0; i < n; i++) {
+    struct out_queue *q = queue_lookup(&to[i]->addr);
+    struct out_item *it = NULL;
+
+    if (q && (bulk == QUEUE_SIGNALLING || q->bytes + m->len <= send_queue_memory * 1024)) {
+      it = item_pool_len > 0 ? item_pool[--item_pool_len] : malloc(sizeof(struct out_item));
+    }
+    if (it == NULL) {
+      queue_counters.overflows++;
+      if (res) {
+        res[i] = -1;
+      }
+      continue;
+    }
+    it->m = m;
+    it->seq = seq;
+    it->frags = frags;
+    it->frag = 0;
+    it->deadline = bulk == QUEUE_BULK ? now + chunk_deadline : 0;
+    it->next = NULL;
+    if (q->tail[bulk]) {
+      q->tail[bulk]->next = it;
+    } else {
+      q->head[bulk] = it;
+    }
+    q->tail[bulk] = it;
+    q->bytes += m->len;
+    m->refs++;
+    queue_counters.queued++;
+    queue_counters.backlog += m->len;
+    if (res) {
+      res[i] = m->len;
+    }
+    queued++;
+  }
+  queue_fd = fd;
+
+  return queued;
+}
+
+/* Remove the first message of a queue, returning it (still referenced) */
+static struct kept_msg *queue_pop(struct out_queue *q, int c)
+{
+  struct out_item *it = q->head[c];
+  struct kept_msg *m = it->m;
+
+  q->head[c] = it->next;
+  if (q->head[c] == NULL) {
+    q->tail[c] = NULL;
+  }
+  q->bytes -= m->len;
+  queue_counters.backlog -= m->len;
+  if (item_pool_len < ITEM_POOL_SIZE) {
+    item_pool[item_pool_len++] = it;
+  } else {
+    free(it);
+  }
+
+  return m;
+}
+
+/*
+ * Find the queue to send the next datagram from: signalling messages
+ * first, then bulk ones, serving the destinations in turn. The late
+ * bulk messages found on the way are dropped.
+ */
+static struct out_queue *queue_next(int *c, uint64_t now)
+{
+  int k;
+
+  for (*c = QUEUE_SIGNALLING; *c <= QUEUE_BULK; (*c)++) {
+    for (k = 0; k < n_queues; k++) {
+      struct out_queue *q = queues[(queue_rr[*c] + k) % n_queues];
+
+      while (q->head[*c] && q->head[*c]->deadline && q->head[*c]->deadline < now) {
+        msg_release(queue_pop(q, *c));
+        queue_counters.late++;
+      }
+      if (q->head[*c]) {
+        queue_rr[*c] = (q->pos + 1) % n_queues;
+
+        return q;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* Send the queued datagrams the token bucket allows */
+static void queue_flush(uint64_t now)
+{
+  double max_tokens = burst * 1024;
+  int i, cnt;
+
+  if (upload == 0 || n_queues == 0) {
+    return;
+  }
+  /* A datagram must fit in the bucket */
+  if (max_tokens < frag_size + sizeof(struct ext_hdr_t) + IP_UDP_HDR_SIZE) {
+    max_tokens = frag_size + sizeof(struct ext_hdr_t) + IP_UDP_HDR_SIZE;
+  }
+  tokens += (now - tokens_time) * upload / 8.0;
+  if (tokens > max_tokens) {
+    tokens = max_tokens;
+  }
+  tokens_time = now;
+  tokens_needed = 0;
+
+  do {
+    struct mmsghdr dgrams[SEND_BATCH];
+    struct ext_hdr_t hdr[SEND_BATCH];
+    struct iovec frag[SEND_BATCH][1 + NH_IOV_MAX];
+    struct kept_msg *done[SEND_BATCH];
+    int owner[SEND_BATCH], res[SEND_BATCH];
+    int n_done = 0;
+
+    for (cnt = 0; cnt < SEND_BATCH; cnt++) {
+      struct out_queue *q;
+      struct out_item *it;
+      int c, off, len, size;
+
+      q = queue_next(&c, now);
+      if (q == NULL) {
+        break;
+      }
+      it = q->head[c];
+      off = it->frag * frag_size;
+      len = it->m->len - off > frag_size ? frag_size : it->m->len - off;
+      frag[cnt][0].iov_base = &hdr[cnt];
+      frag[cnt][0].iov_len = frag_header(&hdr[cnt], it->seq, it->frag, it->frags);
+      size = frag[cnt][0].iov_len + len + IP_UDP_HDR_SIZE;
+      if (tokens < size) {
+        /* Serve this queue first when the tokens are available */
+        queue_rr[c] = q->pos;
+        tokens_needed = size;
+        break;
+      }
+      tokens -= size;
+      memset(&dgrams[cnt], 0, sizeof(struct mmsghdr));
+      dgrams[cnt].msg_hdr.msg_name = &q->to;
+      dgrams[cnt].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      dgrams[cnt].msg_hdr.msg_iov = frag[cnt];
+      dgrams[cnt].msg_hdr.msg_iovlen = 1 + msg_iov(it->m, off, len, frag[cnt] + 1);
+      owner[cnt] = cnt;
+      if (++it->frag == it->frags) {
+        /* Keep the message until the datagram is sent */
+        done[n_done++] = queue_pop(q, c);
+      }
+    }
+    if (cnt) {
+      send_datagrams(queue_fd, dgrams, owner, cnt, res);
+      queue_counters.sent += cnt;
+    }
+    for (i = 0; i < n_done; i++) {
+      msg_release(done[i]);
+    }
+  } while (cnt == SEND_BATCH);
+
+  for (i = n_queues - 1; i >= 0; i--) {
+    if (queues[i]->head[QUEUE_SIGNALLING] == NULL && queues[i]->head[QUEUE_BULK] == NULL) {
+      queue_remove(queues[i]);
+    }
+  }
+}
+
+/*
+ * The first fragment of a message which is still queued for a
+ * destination (the following ones have not been sent yet), or -1
+ */
+static int queue_pending(const struct sockaddr_in *to, uint16_t seq)
+{
+  const struct out_queue *q = queue_find(to, node_hash(to));
+  int c;
+
+  for (c = QUEUE_SIGNALLING; q && c <= QUEUE_BULK; c++) {
+    const struct out_item *it;
+
+    for (it = q->head[c]; it; it = it->next) {
+      if (it->seq == seq) {
+        return it->frag;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* Time (in ms) until the next queued datagram can be sent, -1 if none */
+static int queue_timeout(uint64_t now)
+{
+  double missing;
+
+  if (upload == 0 || n_queues == 0) {
+    return -1;
+  }
+  missing = tokens_needed - tokens - (now - tokens_time) * upload / 8.0;
+
+  return missing > 0 ? missing * 8 / upload + 1 : 0;
+}
+
+/* A receiver NACKed some fragments: send them again, if they are cached */
+static void nack_recv(int fd, struct sockaddr_in *from, uint16_t msg, const uint8_t *list, int cnt)
+{
+  struct mmsghdr dgrams[SEND_BATCH];
+  struct ext_hdr_t hdr[SEND_BATCH];
+  struct iovec frag[SEND_BATCH][1 + NH_IOV_MAX];
+  int owner[SEND_BATCH], res = 0;
+  struct cache_entry *e = NULL;
+  uint64_t now = now_ms();
+  int i, pending, prev = -1, n = 0;
+
+  for (i = 0; i < CACHE_SLOTS && e == NULL; i++) {
+    if (send_cache[i].m && send_cache[i].msg == msg &&
+        send_cache[i].time + send_cache_time >= now) {
+      e = &send_cache[i];
+    }
+  }
+  for (i = 0; e && i < e->n_to; i++) {
+    if (!memcmp(&e->to[i].addr, from, sizeof(struct sockaddr_in))) {
+      break;
+    }
+  }
+  if (e == NULL || i == e->n_to) {
+    return;
+  }
+  /*
+   * A receiver NACKs again nack_delay ms after the last fragment arrived:
+   * ignore the NACKs arriving faster
+   */
+  if (e->to[i].nacked && e->to[i].nacked + nack_delay > now) {
+    return;
+  }
+  e->to[i].nacked = now;
+
+  /* With slow pacing, a receiver can NACK the fragments still queued */
+  pending = upload ? queue_pending(from, msg) : -1;
+  for (i = 0; i < cnt; i++) {
+    int seq = (list[2 * i] << 8) | list[2 * i + 1];
+    int off = seq * frag_size, nfrag;
+
+    /* The list is sorted (see nack_send()): skip the repeated indexes */
+    if (seq <= prev || seq >= e->frags || (pending >= 0 && seq >= pending)) {
+      continue;
+    }
+    prev = seq;
+    memset(&dgrams[n], 0, sizeof(struct mmsghdr));
+    frag[n][0].iov_base = &hdr[n];
+    frag[n][0].iov_len = frag_header(&hdr[n], msg, seq, e->frags);
+    nfrag = msg_iov(e->m, off, frag_size, frag[n] + 1);
+    dgrams[n].msg_hdr.msg_name = from;
+    dgrams[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    dgrams[n].msg_hdr.msg_iov = frag[n];
+    dgrams[n].msg_hdr.msg_iovlen = 1 + nfrag;
+    owner[n++] = 0;
+    frag_counters.retransmitted++;
+    if (upload) {
+      /* Retransmissions are not queued, but they use the upload bandwidth */
+      int len = e->m->len - off > frag_size ? frag_size : e->m->len - off;
+
+      tokens -= frag[n - 1][0].iov_len + len + IP_UDP_HDR_SIZE;
+    }
+    if (n == SEND_BATCH) {
+      send_datagrams(fd, dgrams, owner, n, &res);
+      n = 0;
+    }
+  }
+  if (n) {
+    send_datagrams(fd, dgrams, owner, n, &res);
+  }
+}
+
+/*
+ * Send the same fragment to n peers (at most SEND_BATCH). The peers it
+ * could not be sent to are marked with -1 in res.
+ */
+static void send_fragment(const struct nodeID *from, struct nodeID **to, int n,
+                          struct iovec *frag, int nfrag, int *res)
+{
+  struct mmsghdr msgs[SEND_BATCH];
+  int owner[SEND_BATCH];
+  int i;
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * n);
+  for (i = 0; i < n; i++) {
+    msgs[i].msg_hdr.msg_name = &to[i]->addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov = frag;
+    msgs[i].msg_hdr.msg_iovlen = nfrag;
+    owner[i] = i;
+  }
+  send_datagrams(from->fd, msgs, owner, n, res);
+}
+
+int send_to_peers_iov_shared(const struct nodeID *from, struct nodeID **to, int n,
+                             const struct iovec *iov, int iovcnt, unsigned int shared, int *res)
+{
+  struct ext_hdr_t hdr;
+  struct iovec frag[NH_IOV_MAX + 1];
+  int batch_res[SEND_BATCH];
+  int message_size = 0;
+  int i, j, frags, sent = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    message_size += iov[i].iov_len;
+  }
+  if (message_size <= 0 || iovcnt > NH_IOV_MAX) return -1;
+  for (i = 0; iov[i].iov_len == 0; i++);
+  for (j = 0; j < n; j++) {
+    reg_message_send(message_size, ((const uint8_t *)iov[i].iov_base)[0]);
+  }
+
+  frag[0].iov_base = &hdr;
+  m_seq++;
+  frags = (message_size - 1) / frag_size + 1;
+  if ((mtu && frags > 1) || upload) {
+    /* The cache and the queues reference the same copy */
+    struct kept_msg *m = msg_keep(iov, iovcnt, shared);
+
+    if (m && mtu && frags > 1) {
+      cache_add(m_seq, frags, m, to, n);
+    }
+    if (upload) {
+      sent = queue_add(from->fd, m, m_seq, frags, to, n, res);
+    }
+    if (m) {
+      msg_release(m);
+    }
+    if (upload) {
+      queue_flush(now_ms());
+
+      return sent;
+    }
+  }
+
+  for (j = 0; j < n; j += SEND_BATCH) {
+    int batch = n - j < SEND_BATCH ? n - j : SEND_BATCH;
+    int buffer_size = message_size;
+    int frag_seq = 0;
+    size_t off = 0;
+
+    for (i = 0; i < batch; i++) {
+      batch_res[i] = message_size;
+    }
+
+    /* Each fragment is made of up to frag_size bytes from the buffers */
+    i = 0;
+    do {
+      int len = 0, nfrag = 1;
+
+      while (len < frag_size && i < iovcnt) {
+        size_t l = iov[i].iov_len - off;
+
+        if (l > frag_size - len) {
+          l = frag_size - len;
+        }
+        if (l) {
+          frag[nfrag].iov_base = (uint8_t *)iov[i].iov_base + off;
+          frag[nfrag].iov_len = l;
+          nfrag++;
+        }
+        len += l;
+        off += l;
+        if (off == iov[i].iov_len) {
+          i++;
+          off = 0;
+        }
+      }
+      frag[0].iov_len = frag_header(&hdr, m_seq, frag_seq++, frags);
+      buffer_size -= len;
+      send_fragment(from, to + j, batch, frag, nfrag, batch_res);
+    } while (buffer_size > 0);
+
+    for (i = 0; i < batch; i++) {
+      if (res) {
+        res[j + i] = batch_res[i];
+      }
+      sent += batch_res[i] >= 0;
+    }
+  }
+
+  return sent;
+}
+
+int send_to_peers_iov(const struct nodeID *from, struct nodeID **to, int n,
+                      const struct iovec *iov, int iovcnt, int *res)
+{
+  return send_to_peers_iov_shared(from, to, n, iov, iovcnt, 0, res);
+}
+
+int send_to_peer_iov(const struct nodeID *from, struct nodeID *to, const struct iovec *iov, int iovcnt)
+{
+  int res;
+
+  if (send_to_peers_iov(from, &to, 1, iov, iovcnt, &res) < 0) {
+    return -1;
+  }
+
+  return res;
+}
+
+/*
+ * Each message is split in fragments of up to frag_size bytes, and the
+ * fragments of up to SEND_BATCH messages are queued and sent together
+ */
+int send_to_peers(const struct nodeID *from, const struct nh_send_msg *msgs, int n, int *res)
+{
+  struct mmsghdr dgrams[SEND_BATCH];
+  struct ext_hdr_t hdr[SEND_BATCH];
+  struct iovec frag[SEND_BATCH][2];
+  int owner[SEND_BATCH];
+  int batch_res[SEND_BATCH];
+  int i, j, cnt = 0, sent = 0;
+
+  for (j = 0; j < n; j += SEND_BATCH) {
+    int batch = n - j < SEND_BATCH ? n - j : SEND_BATCH;
+
+    for (i = 0; i < batch; i++) {
+      const struct nh_send_msg *m = &msgs[j + i];
+      int frags, frag_seq = 0, off = 0;
+
+      if (m->len <= 0) {
+        batch_res[i] = -1;
+        continue;
+      }
+      batch_res[i] = m->len;
+      reg_message_send(m->len, m->buff[0]);
+      m_seq++;
+      frags = (m->len - 1) / frag_size + 1;
+      if ((mtu && frags > 1) || upload) {
+        struct iovec v;
+        struct nodeID *to = m->peer;
+        struct kept_msg *k;
+
+        v.iov_base = iov_data(m->buff);
+        v.iov_len = m->len;
+        k = msg_keep(&v, 1, 0);
+        if (k && mtu && frags > 1) {
+          cache_add(m_seq, frags, k, &to, 1);
+        }
+        if (upload) {
+          queue_add(from->fd, k, m_seq, frags, &to, 1, &batch_res[i]);
+        }
+        if (k) {
+          msg_release(k);
+        }
+        if (upload) {
+          continue;
+        }
+      }
+      do {
+        int len = m->len - off > frag_size ? frag_size : m->len - off;
+
+        if (cnt == SEND_BATCH) {
+          send_datagrams(from->fd, dgrams, owner, cnt, batch_res);
+          cnt = 0;
+        }
+        frag[cnt][0].iov_base = &hdr[cnt];
+        frag[cnt][0].iov_len = frag_header(&hdr[cnt], m_seq, frag_seq++, frags);
+        frag[cnt][1].iov_base = iov_data(m->buff + off);
+        frag[cnt][1].iov_len = len;
+        memset(&dgrams[cnt], 0, sizeof(struct mmsghdr));
+        dgrams[cnt].msg_hdr.msg_name = &m->peer->addr;
+        dgrams[cnt].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        dgrams[cnt].msg_hdr.msg_iov = frag[cnt];
+        dgrams[cnt].msg_hdr.msg_iovlen = 2;
+        owner[cnt++] = i;
+        off += len;
+      } while (off < m->len);
+    }
+    if (cnt) {
+      send_datagrams(from->fd, dgrams, owner, cnt, batch_res);
+      cnt = 0;
+    }
+
+    for (i = 0; i < batch; i++) {
+      if (res) {
+        res[j + i] = batch_res[i];
+      }
+      sent += batch_res[i] >= 0;
+    }
+  }
+  if (upload) {
+    queue_flush(now_ms());
+  }
+
+  return sent;
+}
+
+int send_to_peer(const struct nodeID *from, struct nodeID *to, const uint8_t *buffer_ptr, int buffer_size)
+{
+  struct nh_send_msg msg;
+  int res;
+
+  if (buffer_size <= 0) return -1;
+  msg.peer = to;
+  msg.buff = buffer_ptr;
+  msg.len = buffer_size;
+  send_to_peers(from, &msg, 1, &res);
+
+  return res;
+}
+
+void reg_message_recv(int size, uint8_t type);
+
+/*
+ * Wait for some datagrams, and receive up to n of them (at most
+ * RECV_BATCH) with one recvmmsg() where available.
+ */
+static int recv_datagrams(int fd, struct mmsghdr *dgrams, int n)
+{
+#ifndef _WIN32
+  /* Send the NACKs and the queued datagrams that become due while waiting */
+  for (;;) {
+    struct pollfd pfd;
+    int timeout = timers_timeout(fd, now_ms());
+
+    if (timeout < 0) {
+      break;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout) != 0) {
+      break;
+    }
+    timers_run(fd, now_ms());
+  }
+#endif
+#ifdef __linux__
+  return recvmmsg(fd, dgrams, n, MSG_WAITFORONE, NULL);
+#else
+  int res;
+
+  res = recvmsg(fd, &dgrams[0].msg_hdr, 0);
+  if (res < 0) {
+    return -1;
+  }
+  dgrams[0].msg_len = res;
+
+  return 1;
+#endif
+}
+
+/* A received datagram, with the fields of its header */
+struct frag_info {
+  int type;		/* FRAG_DATA or FRAG_NACK, 0 if invalid */
+  int ext;		/* the datagram has an extended header */
+  uint16_t msg;
+  int seq;		/* from 0 */
+  int frags;
+  int frag_size;
+  uint8_t *buff;	/* the buffer the datagram has been received in */
+  uint8_t *data;
+  int len;
+};
+
+static void frag_parse(struct frag_info *f, const struct my_hdr_t *hdr, unsigned int msg_len, uint8_t *buff)
+{
+  struct ext_hdr_t h;
+
+  memset(f, 0, sizeof(struct frag_info));
+  f->buff = buff;
+  if (msg_len < sizeof(struct my_hdr_t)) {
+    return;
+  }
+  f->data = buff;
+  f->len = msg_len - sizeof(struct my_hdr_t);
+  if (hdr->frag_seq) {
+    f->msg = hdr->m_seq;
+    f->seq = hdr->frag_seq - 1;
+    f->frags = hdr->frags;
+    f->frag_size = MAX_MSG_SIZE;
+    f->type = f->seq < f->frags ? FRAG_DATA : 0;
+  } else if (f->len >= EXT_HDR_EXTRA) {
+    memcpy((uint8_t *)&h + sizeof(struct my_hdr_t), buff, EXT_HDR_EXTRA);
+    f->ext = 1;
+    f->msg = ntohs(h.msg);
+    f->seq = ntohs(h.frag_seq);
+    f->frags = ntohs(h.frags);
+    f->frag_size = ntohs(h.frag_size);
+    f->data = buff + EXT_HDR_EXTRA;
+    f->len -= EXT_HDR_EXTRA;
+    f->type = hdr->m_seq;
+    if (f->type == FRAG_DATA && (f->seq >= f->frags || f->frag_size == 0)) {
+      f->type = 0;
+    } else if (f->type == FRAG_NACK && f->len < 2 * f->frags) {
+      f->type = 0;
+    }
+  }
+  if (f->type == FRAG_DATA &&
+      (f->seq == f->frags - 1 ? f->len <= 0 || f->len > f->frag_size : f->len != f->frag_size)) {
+    /* All the fragments but the last one are frag_size bytes long */
+    f->type = 0;
+  }
+}
+
+static int frag_same_msg(const struct frag_info *f1, const struct sockaddr_in *a1,
+                         const struct frag_info *f2, const struct sockaddr_in *a2)
+{
+  return f1->type == f2->type && f1->ext == f2->ext && f1->msg == f2->msg &&
+         f1->frags == f2->frags && f1->frag_size == f2->frag_size &&
+         !memcmp(a1, a2, sizeof(struct sockaddr_in));
+}
+
+/*
+ * Messages sent in more fragments can arrive in any order and
+ * interleaved with the fragments of other messages: the fragments of a
+ * message are collected in a reassembly buffer, identified by sender
+ * and sequence number.
+ */
+struct reasm_entry {
+  struct sockaddr_in from;
+  int ext;
+  uint16_t msg;
+  int frags;
+  int frag_size;
+  int received;
+  uint8_t *buff;	/* frags * frag_size bytes, or NULL if the entry is free */
+  uint32_t *mask;	/* received fragments */
+  int len;		/* known when the last fragment arrives */
+  uint64_t start;	/* arrival time of the first fragment, in ms */
+  uint64_t last;	/* arrival time of the last fragment, or of the last NACK */
+  int nacks;
+};
+
+static struct reasm_entry reasm[REASM_SLOTS];
+static int reasm_used;
+static size_t reasm_allocated;
+
+static uint64_t now_ms(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void reasm_free(struct reasm_entry *e)
+{
+  free(e->buff);
+  free(e->mask);
+  e->buff = NULL;
+  reasm_allocated -= (size_t)e->frags * e->frag_size;
+  reasm_used--;
+}
+
+static void reasm_expire(uint64_t now)
+{
+  int i;
+
+  for (i = 0; i < REASM_SLOTS && reasm_used; i++) {
+    if (reasm[i].buff && now - reasm[i].start > reasm_timeout) {
+      reasm_free(&reasm[i]);
+      frag_counters.timeouts++;
+    }
+  }
+}
+
+/* Ask the sender of an incomplete message for its missing fragments */
+static void nack_send(int fd, struct reasm_entry *e, uint64_t now)
+{
+  struct ext_hdr_t h;
+  uint8_t list[2 * NACK_MAX];
+  struct msghdr msg;
+  struct iovec iov[2];
+  int i, cnt = 0;
+
+  for (i = 0; i < e->frags && cnt < NACK_MAX; i++) {
+    if (!(e->mask[i / 32] & (1U << (i % 32)))) {
+      list[2 * cnt] = i >> 8;
+      list[2 * cnt + 1] = i & 0xff;
+      cnt++;
+    }
+  }
+  memset(&h, 0, sizeof(h));
+  h.h.m_seq = FRAG_NACK;
+  h.msg = htons(e->msg);
+  h.frags = htons(cnt);
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = list;
+  iov[1].iov_len = 2 * cnt;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &e->from;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  sendmsg(fd, &msg, 0);
+  e->last = now;
+  e->nacks++;
+  frag_counters.nacks++;
+}
+
+/* Time (in ms) before the next NACK is due, or -1 if none is pending */
+static int nack_timeout(uint64_t now)
+{
+  int i, res = -1;
+
+  for (i = 0; i < REASM_SLOTS && reasm_used; i++) {
+    const struct reasm_entry *e = &reasm[i];
+
+    if (e->buff && e->ext && e->nacks < NACK_RETRIES) {
+      int t = e->last + nack_delay > now ? e->last + nack_delay - now : 0;
+
+      if (res < 0 || t < res) {
+        res = t;
+      }
+    }
+  }
+
+  return res;
+}
+
+static void reasm_nack(int fd, uint64_t now)
+{
+  int i;
+
+  for (i = 0; i < REASM_SLOTS && reasm_used; i++) {
+    struct reasm_entry *e = &reasm[i];
+
+    if (e->buff && e->ext && e->nacks < NACK_RETRIES && e->last + nack_delay <= now) {
+      nack_send(fd, e, now);
+    }
+  }
+}
+
+/* Time (in ms) until a NACK or a queued datagram is due, -1 if none */
+static int timers_timeout(int fd, uint64_t now)
+{
+  int nack = fd >= 0 ? nack_timeout(now) : -1;
+  int queue = queue_timeout(now);
+
+  if (nack < 0 || (queue >= 0 && queue < nack)) {
+    return queue;
+  }
+
+  return nack;
+}
+
+static void timers_run(int fd, uint64_t now)
+{
+  if (fd >= 0) {
+    reasm_nack(fd, now);
+  }
+  queue_flush(now);
+}
+
+/*
+ * Find the reassembly buffer of a message, or allocate a new one (if
+ * needed, the oldest incomplete messages are dropped to make room)
+ */
+static struct reasm_entry *reasm_lookup(const struct sockaddr_in *from, const struct frag_info *f)
+{
+  size_t size = (size_t)f->frags * f->frag_size;
+  struct reasm_entry *e = NULL;
+  int i;
+
+  for (i = 0; i < REASM_SLOTS; i++) {
+    if (reasm[i].buff && reasm[i].ext == f->ext && reasm[i].msg == f->msg &&
+        !memcmp(&reasm[i].from, from, sizeof(struct sockaddr_in))) {
+      if (reasm[i].frags == f->frags && reasm[i].frag_size == f->frag_size) {
+        return &reasm[i];
+      }
+      /* The sequence number wrapped around, and this is an old message */
+      reasm_free(&reasm[i]);
+      frag_counters.evicted++;
+    }
+  }
+
+  if (size > (size_t)reasm_memory * 1024) {
+    return NULL;
+  }
+  while (reasm_used == REASM_SLOTS || reasm_allocated + size > (size_t)reasm_memory * 1024) {
+    struct reasm_entry *oldest = NULL;
+
+    for (i = 0; i < REASM_SLOTS; i++) {
+      if (reasm[i].buff && (oldest == NULL || reasm[i].start < oldest->start)) {
+        oldest = &reasm[i];
+      }
+    }
+    reasm_free(oldest);
+    frag_counters.evicted++;
+  }
+  for (i = 0; e == NULL; i++) {
+    if (reasm[i].buff == NULL) {
+      e = &reasm[i];
+    }
+  }
+  e->buff = malloc(size);
+  e->mask = calloc((f->frags + 31) / 32, sizeof(uint32_t));
+  if (e->buff == NULL || e->mask == NULL) {
+    free(e->buff);
+    free(e->mask);
+    e->buff = NULL;
+
+    return NULL;
+  }
+  reasm_allocated += size;
+  reasm_used++;
+  e->from = *from;
+  e->ext = f->ext;
+  e->msg = f->msg;
+  e->frags = f->frags;
+  e->frag_size = f->frag_size;
+  e->received = 0;
+  e->len = -1;
+  e->start = now_ms();
+  e->last = e->start;
+  e->nacks = 0;
+
+  return e;
+}
+
+/* Store a fragment; returns 1 if the message is complete */
+static int reasm_add(int fd, struct reasm_entry *e, const struct frag_info *f)
+{
+  int i = f->seq;
+
+  if (e->mask[i / 32] & (1U << (i % 32))) {
+    if (e->ext) {
+      /* A retransmission already received */
+      frag_counters.dropped++;
+
+      return 0;
+    }
+    /* Already received: this is a new message with the same m_seq */
+    memset(e->mask, 0, (e->frags + 31) / 32 * sizeof(uint32_t));
+    e->received = 0;
+    e->len = -1;
+    e->start = now_ms();
+    frag_counters.evicted++;
+  }
+  e->mask[i / 32] |= 1U << (i % 32);
+  e->received++;
+  e->last = now_ms();
+  memcpy(e->buff + i * e->frag_size, f->data, f->len);
+  if (i == e->frags - 1) {
+    e->len = i * e->frag_size + f->len;
+    if (e->ext && e->received < e->frags && e->nacks == 0) {
+      /* The fragments are sent in order: the missing ones are lost */
+      nack_send(fd, e, e->last);
+    }
+  }
+
+  return e->received == e->frags;
+}
+
+/*
+ * The d-th datagram is a fragment of a larger message: look for the
+ * other fragments in the batch. If they are all there, the message is
+ * assembled directly in out; otherwise, they are stored in the message
+ * reassembly buffer (and the message is copied to out if it is now
+ * complete). The fragments of the message are marked in done.
+ * Returns the length of the message, 0 if it is not complete, or -1
+ * on error.
+ */
+static int recv_fragments(int fd, const struct frag_info *fi, const struct sockaddr_in *raddr,
+                          uint8_t *done, int d, int n, uint8_t *out, int size)
+{
+  int slots[RECV_BATCH];
+  int i, cnt = 0, len = -1, first = -1;
+  struct reasm_entry *e;
+
+  for (i = d; i < n; i++) {
+    int j;
+
+    if (done[i] || !frag_same_msg(&fi[i], &raddr[i], &fi[d], &raddr[d])) {
+      continue;
+    }
+    done[i] = 1;
+    for (j = 0; j < cnt; j++) {
+      if (fi[slots[j]].seq == fi[i].seq) {
+        break;
+      }
+    }
+    if (j < cnt) {
+      /* Duplicate */
+      frag_counters.dropped++;
+      continue;
+    }
+    if (fi[i].seq == fi[i].frags - 1) {
+      len = fi[i].seq * fi[i].frag_size + fi[i].len;
+    }
+    slots[cnt++] = i;
+  }
+
+  if (cnt == fi[d].frags) {
+    /* All in the batch: assemble in out */
+    if (len > size) {
+      frag_counters.dropped += cnt;
+
+      return -1;
+    }
+    for (i = 0; i < cnt; i++) {
+      if (fi[slots[i]].buff == out) {
+        /* out is the buffer of this fragment: move it first */
+        first = slots[i];
+        memmove(out + fi[first].seq * fi[first].frag_size, fi[first].data, fi[first].len);
+      }
+    }
+    for (i = 0; i < cnt; i++) {
+      if (slots[i] != first) {
+        memcpy(out + fi[slots[i]].seq * fi[slots[i]].frag_size, fi[slots[i]].data, fi[slots[i]].len);
+      }
+    }
+    frag_counters.reassembled++;
+
+    return len;
+  }
+
+  e = reasm_lookup(&raddr[d], &fi[d]);
+  if (e == NULL) {
+    frag_counters.dropped += cnt;
+
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    if (reasm_add(fd, e, &fi[slots[i]])) {
+      len = e->len;
+      if (len <= size) {
+        memcpy(out, e->buff, len);
+        frag_counters.reassembled++;
+      } else {
+        frag_counters.dropped += e->frags;
+        len = -1;
+      }
+      reasm_free(e);
+
+      return len;
+    }
+  }
+
+  return 0;
+}
+
+int recv_from_peers(const struct nodeID *local, struct nh_msg *msgs, int n)
+{
+  struct mmsghdr dgrams[RECV_BATCH];
+  struct my_hdr_t hdr[RECV_BATCH];
+  struct sockaddr_in raddr[RECV_BATCH];
+  struct iovec iov[RECV_BATCH][2];
+  struct frag_info fi[RECV_BATCH];
+  uint8_t done[RECV_BATCH];
+  int i, d, res, recv = 0;
+
+  if (n > RECV_BATCH) {
+    n = RECV_BATCH;
+  }
+  memset(dgrams, 0, sizeof(struct mmsghdr) * n);
+  for (i = 0; i < n; i++) {
+    iov[i][0].iov_base = &hdr[i];
+    iov[i][0].iov_len = sizeof(struct my_hdr_t);
+    iov[i][1].iov_base = msgs[i].buff;
+    iov[i][1].iov_len = msgs[i].size > MAX_MSG_SIZE ? MAX_MSG_SIZE : msgs[i].size;
+    dgrams[i].msg_hdr.msg_name = &raddr[i];
+    dgrams[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    dgrams[i].msg_hdr.msg_iov = iov[i];
+    dgrams[i].msg_hdr.msg_iovlen = 2;
+  }
+  res = recv_datagrams(local->fd, dgrams, n);
+  if (res <= 0) {
+    return -1;
+  }
+  if (reasm_used) {
+    reasm_expire(now_ms());
+  }
+  for (d = 0; d < res; d++) {
+    frag_parse(&fi[d], &hdr[d], dgrams[d].msg_len, msgs[d].buff);
+  }
+
+  /*
+   * The i-th message is stored in the buffer of the d-th datagram (its
+   * first fragment): if d > i (because some datagrams were fragments
+   * of a previous message, or have been discarded), move it.
+   */
+  memset(done, 0, res);
+  for (d = 0; d < res; d++) {
+    int len;
+
+    if (done[d]) {
+      continue;
+    }
+    if (fi[d].type == FRAG_NACK) {
+      nack_recv(local->fd, &raddr[d], fi[d].msg, fi[d].data, fi[d].frags);
+      continue;
+    }
+    if (fi[d].type != FRAG_DATA) {
+      frag_counters.dropped++;
+      continue;
+    }
+    if (fi[d].frags > 1) {
+      len = recv_fragments(local->fd, fi, raddr, done, d, res, msgs[recv].buff, msgs[recv].size);
+    } else {
+      len = fi[d].len;
+      if (len > msgs[recv].size) {
+        frag_counters.dropped++;
+        continue;
+      }
+      if (msgs[recv].buff != fi[d].data) {
+        memmove(msgs[recv].buff, fi[d].data, len);
+      }
+    }
+    if (len <= 0) {
+      continue;
+    }
+    msgs[recv].peer = node_intern(&raddr[d]);
+    if (msgs[recv].peer == NULL) {
+      break;
+    }
+    msgs[recv].len = len;
+    reg_message_recv(len, msgs[recv].buff[0]);
+    recv++;
+  }
+
+  return recv;
+}
+
+/* Wait until a whole message is received */
+int recv_from_peer(const struct nodeID *local, struct nodeID **remote, uint8_t *buffer_ptr, int buffer_size)
+{
+  struct nh_msg msg;
+  int res;
+
+  msg.buff = buffer_ptr;
+  msg.size = buffer_size;
+  do {
+    res = recv_from_peers(local, &msg, 1);
+  } while (res == 0);
+  if (res < 0) {
+    *remote = NULL;
+
+    return -1;
+  }
+  *remote = msg.peer;
+
+  return msg.len;
+}
+
+void reasm_stats(struct nh_reasm_stats *stats)
+{
+  *stats = frag_counters;
+}
+
+void send_queue_stats(struct nh_queue_stats *stats)
+{
+  *stats = queue_counters;
+}
+
+const char *node_addr(const struct nodeID *s)
+{
+  static char addr[256];
+
+  sprintf(addr, "%s:%d", inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port));
+
+  return addr;
+}
+
+struct nodeID *nodeid_dup(struct nodeID *s)
+{
+  node_lock_take();
+  s->refs++;
+  node_lock_release();
+
+  return s;
+}
+
+int nodeid_equal(const struct nodeID *s1, const struct nodeID *s2)
+{
+  return s1 == s2;
 }
 
 int nodeid_cmp(const struct nodeID *s1, const struct nodeID *s2)
 {
+  if (s1 == s2) {
+    return 0;
+  }
+
   return memcmp(&s1->addr, &s2->addr, sizeof(struct sockaddr_in));
 }
 
@@ -385,19 +2147,34 @@ int nodeid_dump(uint8_t *b, const struct nodeID *s, size_t max_write_size)
 
 struct nodeID *nodeid_undump(const uint8_t *b, int *len)
 {
-  struct nodeID *res;
-  res = malloc(sizeof(struct nodeID));
-  if (res != NULL) {
-    memcpy(&res->addr, b, sizeof(struct sockaddr_in));
-    res->fd = -1;
-  }
+  struct sockaddr_in addr;
+
+  memcpy(&addr, b, sizeof(struct sockaddr_in));
   *len = sizeof(struct sockaddr_in);
 
-  return res;
+  return node_intern(&addr);
 }
 
 void nodeid_free(struct nodeID *s)
 {
+  struct nodeID **p;
+
+  if (s == NULL) {
+    return;
+  }
+  node_lock_take();
+  if (--s->refs > 0) {
+    node_lock_release();
+
+    return;
+  }
+  for (p = &node_table[s->hash & (NODE_TABLE_SIZE - 1)]; *p != s; p = &(*p)->next);
+  *p = s->next;
+  if (node_pool_len < NODE_POOL_SIZE) {
+    node_pool[node_pool_len++] = s;
+    s = NULL;
+  }
+  node_lock_release();
   free(s);
 }
 